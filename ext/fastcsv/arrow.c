@@ -0,0 +1,648 @@
+#include "arrow.h"
+#include "utf8.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <strings.h>
+
+// Arrow format specifications.
+// https://arrow.apache.org/docs/format/Columnar.html
+// https://github.com/apache/arrow/blob/main/format/Schema.fbs
+// https://github.com/apache/arrow/blob/main/format/Message.fbs
+
+// FlatBuffers format.
+// https://flatbuffers.dev/internals/
+
+enum { ARROW_INT64, ARROW_FLOAT64, ARROW_UTF8, ARROW_BOOL };
+
+static const char *type_names[] = {"int64", "float64", "utf8", "bool"};
+
+// Schema.fbs: union Type
+enum { TYPE_INT = 2, TYPE_FLOATING_POINT = 3, TYPE_UTF8 = 5, TYPE_BOOL = 6 };
+
+// Message.fbs: union MessageHeader
+enum { HEADER_SCHEMA = 1, HEADER_RECORD_BATCH = 3 };
+
+// Schema.fbs: enum MetadataVersion
+#define METADATA_V5 4
+
+// Schema.fbs: enum Precision
+#define PRECISION_DOUBLE 2
+
+// Offsets into a Utf8 column's data are 32-bit, so the batch is written before
+// a column's data can overflow them.
+#define MAX_DATA_SIZE (1L << 30)
+
+typedef struct {
+  char *ptr;
+  long len, capa;
+} Bytes;
+
+typedef struct {
+  char *name;
+  long name_len;
+  int type;
+  long null_count;
+  Bytes validity, values, data;
+} Column;
+
+struct ArrowWriter {
+  VALUE output;
+  Column *columns;
+  long ncolumns;
+  long batch_size;
+  long length; // rows in the current batch
+  long total;  // rows written
+  long column; // next column in the current row
+  int skip;    // the current row is the header
+  Bytes message;
+  char error[256];
+};
+
+// Appends `n` zeroed bytes and returns their offset. Pointers into the bytes
+// are invalidated, so the builders below work with offsets.
+static long bytes_grow(Bytes *b, long n) {
+  long at = b->len;
+
+  if (b->len + n > b->capa) {
+    b->capa = b->len + n > 2 * b->capa ? b->len + n : 2 * b->capa;
+    REALLOC_N(b->ptr, char, b->capa);
+  }
+  memset(b->ptr + at, 0, n);
+  b->len += n;
+
+  return at;
+}
+
+static void bytes_pad(Bytes *b, long align) {
+  if (b->len % align) {
+    bytes_grow(b, align - b->len % align);
+  }
+}
+
+static void bytes_free(Bytes *b) {
+  if (b->ptr != NULL) {
+    free(b->ptr);
+    b->ptr = NULL;
+  }
+  b->len = b->capa = 0;
+}
+
+// Arrow and FlatBuffers are little-endian. arrow_writer_new rejects big-endian
+// hosts, so values are copied as is.
+static void put16(Bytes *b, long at, uint16_t value) {
+  memcpy(b->ptr + at, &value, 2);
+}
+
+static void put32(Bytes *b, long at, uint32_t value) {
+  memcpy(b->ptr + at, &value, 4);
+}
+
+static void put64(Bytes *b, long at, uint64_t value) {
+  memcpy(b->ptr + at, &value, 8);
+}
+
+// The builders write FlatBuffers front to back: a table's vtable precedes it
+// and the objects that it references follow it, so that references, which
+// are unsigned, point forward.
+
+// Writes a table with `n` fields of the given sizes, 0 if absent, and sets
+// `at[i]` to the offset of each field. Returns the table's offset.
+static long fb_table(Bytes *b, int n, const int *sizes, long *at) {
+  uint16_t offsets[8];
+  long vtable, table, size = 4;
+  int i;
+
+  for (i = 0; i < n; i++) {
+    offsets[i] = 0;
+    if (sizes[i]) {
+      size = (size + sizes[i] - 1) / sizes[i] * sizes[i];
+      offsets[i] = (uint16_t)size;
+      size += sizes[i];
+    }
+  }
+
+  bytes_pad(b, 2);
+  vtable = bytes_grow(b, 4 + 2 * n);
+  put16(b, vtable, (uint16_t)(4 + 2 * n));
+  put16(b, vtable + 2, (uint16_t)size);
+  for (i = 0; i < n; i++) {
+    put16(b, vtable + 4 + 2 * i, offsets[i]);
+  }
+
+  // Fields are aligned relative to the table.
+  bytes_pad(b, 8);
+  table = bytes_grow(b, size);
+  put32(b, table, (uint32_t)(table - vtable));
+  for (i = 0; i < n; i++) {
+    at[i] = table + offsets[i];
+  }
+
+  return table;
+}
+
+// Points the reference at `at` to `target`.
+static void fb_ref(Bytes *b, long at, long target) {
+  put32(b, at, (uint32_t)(target - at));
+}
+
+static long fb_string(Bytes *b, const char *ptr, long len) {
+  long at;
+
+  bytes_pad(b, 4);
+  at = bytes_grow(b, 4 + len + 1);
+  put32(b, at, (uint32_t)len);
+  memcpy(b->ptr + at + 4, ptr, len);
+
+  return at;
+}
+
+// Writes a vector's length, followed by room for its elements, which are
+// aligned to `align`. Returns the offset of the first element.
+static long fb_vector(Bytes *b, long count, long size, long align) {
+  long at;
+
+  bytes_pad(b, 4);
+  if ((b->len + 4) % align) {
+    bytes_grow(b, 4);
+  }
+  at = bytes_grow(b, 4 + count * size);
+  put32(b, at, (uint32_t)count);
+
+  return at + 4;
+}
+
+// Starts an encapsulated message: a continuation marker, the metadata's
+// length, which is filled in by end_metadata, and the Message table. Returns
+// the offset of the Message's header reference.
+static long start_message(Bytes *b, int header_type, long body_length) {
+  int sizes[4] = {2, 1, 4, 8}; // version, header_type, header, bodyLength
+  long at[4], table;
+
+  b->len = 0;
+  bytes_grow(b, 8);
+  put32(b, 0, 0xFFFFFFFF);
+
+  bytes_grow(b, 4); // root reference
+  table = fb_table(b, 4, sizes, at);
+  fb_ref(b, 8, table);
+  put16(b, at[0], METADATA_V5);
+  b->ptr[at[1]] = (char)header_type;
+  put64(b, at[3], (uint64_t)body_length);
+
+  return at[2];
+}
+
+// The body starts on an 8-byte boundary.
+static void end_metadata(Bytes *b) {
+  bytes_pad(b, 8);
+  put32(b, 4, (uint32_t)(b->len - 8));
+}
+
+static void write_bytes(ArrowWriter *w, const char *ptr, long len) {
+  rb_io_write(w->output, rb_str_new(ptr, len));
+}
+
+// Arrow buffers are padded to 8 bytes.
+static long padded(long len) {
+  return (len + 7) / 8 * 8;
+}
+
+// The buffers of a column: a validity bitmap, which is empty if there are no
+// nulls, then its values, then a Utf8 column's data.
+static int column_buffers(Column *c, long length, long *lengths) {
+  lengths[0] = c->null_count ? (length + 7) / 8 : 0;
+  switch (c->type) {
+    case ARROW_UTF8:
+      lengths[1] = (length + 1) * 4;
+      lengths[2] = c->data.len;
+      return 3;
+    case ARROW_BOOL:
+      lengths[1] = (length + 7) / 8;
+      return 2;
+    default:
+      lengths[1] = length * 8;
+      return 2;
+  }
+}
+
+void arrow_writer_start(ArrowWriter *w) {
+  Bytes *b = &w->message;
+  long header, fields, i;
+  int schema_sizes[2] = {2, 4};             // endianness, fields
+  int field_sizes[6] = {4, 1, 1, 4, 0, 4}; // name, nullable, type_type, type, dictionary, children
+  long at[6];
+
+  header = start_message(b, HEADER_SCHEMA, 0);
+  fb_ref(b, header, fb_table(b, 2, schema_sizes, at));
+  fields = fb_vector(b, w->ncolumns, 4, 4);
+  fb_ref(b, at[1], fields - 4);
+
+  for (i = 0; i < w->ncolumns; i++) {
+    Column *c = &w->columns[i];
+    long type_at[2], name, type, children;
+
+    fb_ref(b, fields + 4 * i, fb_table(b, 6, field_sizes, at));
+    b->ptr[at[1]] = 1;
+
+    name = fb_string(b, c->name, c->name_len);
+    fb_ref(b, at[0], name);
+
+    switch (c->type) {
+      case ARROW_INT64: {
+        int sizes[2] = {4, 1}; // bitWidth, is_signed
+        b->ptr[at[2]] = TYPE_INT;
+        type = fb_table(b, 2, sizes, type_at);
+        put32(b, type_at[0], 64);
+        b->ptr[type_at[1]] = 1;
+        break;
+      }
+      case ARROW_FLOAT64: {
+        int sizes[1] = {2}; // precision
+        b->ptr[at[2]] = TYPE_FLOATING_POINT;
+        type = fb_table(b, 1, sizes, type_at);
+        put16(b, type_at[0], PRECISION_DOUBLE);
+        break;
+      }
+      case ARROW_UTF8:
+        b->ptr[at[2]] = TYPE_UTF8;
+        type = fb_table(b, 0, NULL, type_at);
+        break;
+      default:
+        b->ptr[at[2]] = TYPE_BOOL;
+        type = fb_table(b, 0, NULL, type_at);
+        break;
+    }
+    fb_ref(b, at[3], type);
+
+    // Readers require the children, even if there are none.
+    children = fb_vector(b, 0, 4, 4);
+    fb_ref(b, at[5], children - 4);
+  }
+
+  end_metadata(b);
+  write_bytes(w, b->ptr, b->len);
+}
+
+// Writes the buffered rows as a record batch.
+static void write_batch(ArrowWriter *w) {
+  Bytes *b = &w->message;
+  int sizes[4] = {8, 4, 4, 0}; // length, nodes, buffers, compression
+  long at[4], header, nodes, buffers, body = 0, nbuffers = 0, i, j;
+  long lengths[3];
+
+  for (i = 0; i < w->ncolumns; i++) {
+    int n = column_buffers(&w->columns[i], w->length, lengths);
+    for (j = 0; j < n; j++) {
+      body += padded(lengths[j]);
+    }
+    nbuffers += n;
+  }
+
+  header = start_message(b, HEADER_RECORD_BATCH, body);
+  fb_ref(b, header, fb_table(b, 4, sizes, at));
+  put64(b, at[0], (uint64_t)w->length);
+
+  nodes = fb_vector(b, w->ncolumns, 16, 8);
+  fb_ref(b, at[1], nodes - 4);
+  for (i = 0; i < w->ncolumns; i++) {
+    put64(b, nodes + 16 * i, (uint64_t)w->length);
+    put64(b, nodes + 16 * i + 8, (uint64_t)w->columns[i].null_count);
+  }
+
+  buffers = fb_vector(b, nbuffers, 16, 8);
+  fb_ref(b, at[2], buffers - 4);
+  body = 0;
+  for (i = 0; i < w->ncolumns; i++) {
+    int n = column_buffers(&w->columns[i], w->length, lengths);
+    for (j = 0; j < n; j++) {
+      put64(b, buffers, (uint64_t)body);
+      put64(b, buffers + 8, (uint64_t)lengths[j]);
+      buffers += 16;
+      body += padded(lengths[j]);
+    }
+  }
+
+  end_metadata(b);
+
+  for (i = 0; i < w->ncolumns; i++) {
+    Column *c = &w->columns[i];
+    Bytes *sources[3];
+    int n = column_buffers(c, w->length, lengths);
+
+    sources[0] = &c->validity;
+    sources[1] = &c->values;
+    sources[2] = &c->data;
+    for (j = 0; j < n; j++) {
+      long to = bytes_grow(b, padded(lengths[j]));
+      memcpy(b->ptr + to, sources[j]->ptr, lengths[j]);
+    }
+
+    c->null_count = 0;
+    c->validity.len = 0;
+    c->values.len = 0;
+    c->data.len = 0;
+    if (c->type == ARROW_UTF8) {
+      bytes_grow(&c->values, 4);
+    }
+  }
+
+  write_bytes(w, b->ptr, b->len);
+  w->total += w->length;
+  w->length = 0;
+}
+
+static void set_bit(Bytes *b, long index, int value) {
+  if (index / 8 >= b->len) {
+    bytes_grow(b, index / 8 + 1 - b->len);
+  }
+  if (value) {
+    b->ptr[index / 8] |= (char)(1 << (index % 8));
+  }
+}
+
+int arrow_parse_int64(const char *ptr, long len, int64_t *value) {
+  const char *end = ptr + len;
+  uint64_t result = 0, limit = INT64_MAX;
+  int negative = 0;
+
+  if (ptr < end && (*ptr == '-' || *ptr == '+')) {
+    negative = *ptr == '-';
+    limit += negative;
+    ptr++;
+  }
+  if (ptr == end) {
+    return 0;
+  }
+
+  for (; ptr < end; ptr++) {
+    unsigned digit = (unsigned char)*ptr - '0';
+    if (digit > 9 || result > (limit - digit) / 10) {
+      return 0;
+    }
+    result = result * 10 + digit;
+  }
+
+  *value = negative && result ? -(int64_t)(result - 1) - 1 : (int64_t)result;
+  return 1;
+}
+
+int arrow_parse_float64(const char *ptr, long len, double *value) {
+  char copy[64], *end;
+
+  // strtod needs a terminated string and skips leading whitespace.
+  if (len >= (long)sizeof(copy) || isspace((unsigned char)*ptr)) {
+    return 0;
+  }
+  memcpy(copy, ptr, len);
+  copy[len] = '\0';
+  *value = strtod(copy, &end);
+
+  return end == copy + len;
+}
+
+int arrow_parse_bool(const char *ptr, long len) {
+  if (len == 4 && strncasecmp(ptr, "true", 4) == 0) {
+    return 1;
+  }
+  if (len == 5 && strncasecmp(ptr, "false", 5) == 0) {
+    return 0;
+  }
+  return -1;
+}
+
+int arrow_writer_field(void *data, const char *ptr, size_t size, int column, bool quoted) {
+  ArrowWriter *w = data;
+  long len = (long)size;
+  int null = ptr == NULL;
+  Column *c;
+  long row = w->length;
+
+  if (w->skip) {
+    return 0;
+  }
+  if (w->column == w->ncolumns) {
+    snprintf(w->error, sizeof(w->error), "Too many fields (the schema has %ld columns)", w->ncolumns);
+    return -1;
+  }
+  c = &w->columns[w->column++];
+
+  // Empty fields are null, unless they're quoted strings.
+  if (null || (len == 0 && c->type != ARROW_UTF8)) {
+    c->null_count++;
+    set_bit(&c->validity, row, 0);
+    switch (c->type) {
+      case ARROW_UTF8:
+        put32(&c->values, bytes_grow(&c->values, 4), (uint32_t)c->data.len);
+        break;
+      case ARROW_BOOL:
+        set_bit(&c->values, row, 0);
+        break;
+      default:
+        bytes_grow(&c->values, 8);
+        break;
+    }
+    return 0;
+  }
+
+  set_bit(&c->validity, row, 1);
+  switch (c->type) {
+    case ARROW_INT64: {
+      int64_t value;
+      if (!arrow_parse_int64(ptr, len, &value)) {
+        goto invalid;
+      }
+      put64(&c->values, bytes_grow(&c->values, 8), (uint64_t)value);
+      break;
+    }
+    case ARROW_FLOAT64: {
+      double value;
+      uint64_t bits;
+      if (!arrow_parse_float64(ptr, len, &value)) {
+        goto invalid;
+      }
+      memcpy(&bits, &value, 8);
+      put64(&c->values, bytes_grow(&c->values, 8), bits);
+      break;
+    }
+    case ARROW_UTF8: {
+      long at;
+      if (find_invalid_utf8(ptr, ptr + len) != NULL) {
+        snprintf(w->error, sizeof(w->error), "Invalid UTF-8 for column \"%.*s\"", (int)c->name_len, c->name);
+        return -1;
+      }
+      at = bytes_grow(&c->data, len);
+      memcpy(c->data.ptr + at, ptr, len);
+      put32(&c->values, bytes_grow(&c->values, 4), (uint32_t)c->data.len);
+      break;
+    }
+    default:
+      switch (arrow_parse_bool(ptr, len)) {
+        case 1:
+          set_bit(&c->values, row, 1);
+          break;
+        case 0:
+          set_bit(&c->values, row, 0);
+          break;
+        default:
+          goto invalid;
+      }
+      break;
+  }
+  return 0;
+
+invalid:
+  snprintf(w->error, sizeof(w->error), "Invalid %s value \"%.*s\" for column \"%.*s\"", type_names[c->type], (int)(len > 32 ? 32 : len), ptr, (int)c->name_len, c->name);
+  return -1;
+}
+
+int arrow_writer_row_end(void *data) {
+  ArrowWriter *w = data;
+  long i;
+
+  if (w->skip) {
+    w->skip = 0;
+    return 0;
+  }
+  // Blank rows are skipped.
+  if (w->column == 0) {
+    return 0;
+  }
+  // Short rows are padded with nulls.
+  while (w->column < w->ncolumns) {
+    arrow_writer_field(w, NULL, 0, (int)w->column, false);
+  }
+  w->column = 0;
+  w->length++;
+
+  if (w->length == w->batch_size) {
+    write_batch(w);
+  }
+  else {
+    for (i = 0; i < w->ncolumns; i++) {
+      if (w->columns[i].data.len > MAX_DATA_SIZE) {
+        write_batch(w);
+        break;
+      }
+    }
+  }
+
+  return 0;
+}
+
+const char *arrow_writer_error(ArrowWriter *w) {
+  return w->error;
+}
+
+long arrow_writer_finish(ArrowWriter *w) {
+  static const char eos[8] = {'\xFF', '\xFF', '\xFF', '\xFF', 0, 0, 0, 0};
+
+  if (w->length) {
+    write_batch(w);
+  }
+  write_bytes(w, eos, sizeof(eos));
+
+  return w->total;
+}
+
+static void arrow_writer_free(void *data) {
+  ArrowWriter *w = data;
+  long i;
+
+  for (i = 0; i < w->ncolumns; i++) {
+    if (w->columns[i].name != NULL) {
+      free(w->columns[i].name);
+    }
+    bytes_free(&w->columns[i].validity);
+    bytes_free(&w->columns[i].values);
+    bytes_free(&w->columns[i].data);
+  }
+  if (w->columns != NULL) {
+    free(w->columns);
+  }
+  bytes_free(&w->message);
+  free(w);
+}
+
+static int type_from_value(VALUE type) {
+  const char *name;
+  int i;
+
+  if (SYMBOL_P(type)) {
+    type = rb_sym_to_s(type);
+  }
+  if (TYPE(type) != T_STRING) {
+    return -1;
+  }
+  name = StringValueCStr(type);
+  for (i = 0; i < 4; i++) {
+    if (strcmp(name, type_names[i]) == 0) {
+      return i;
+    }
+  }
+  if (strcmp(name, "string") == 0) {
+    return ARROW_UTF8;
+  }
+
+  return -1;
+}
+
+VALUE arrow_writer_new(VALUE schema, VALUE output, long batch_size, int headers, ArrowWriter **writer) {
+  static const uint16_t one = 1;
+  ArrowWriter *w;
+  VALUE holder;
+  long i;
+
+  if (*(const char *)&one != 1) {
+    rb_raise(rb_eNotImpError, "Arrow output is not supported on big-endian platforms");
+  }
+
+  if (TYPE(schema) == T_HASH) {
+    schema = rb_funcall(schema, rb_intern("to_a"), 0);
+  }
+  if (TYPE(schema) != T_ARRAY || RARRAY_LEN(schema) == 0) {
+    rb_raise(rb_eArgError, ":schema has to be a Hash or an Array of [name, type] pairs");
+  }
+
+  w = ALLOC(ArrowWriter);
+  memset(w, 0, sizeof(ArrowWriter));
+  holder = Data_Wrap_Struct(0, NULL, arrow_writer_free, w);
+
+  w->output = output;
+  w->batch_size = batch_size;
+  w->skip = headers;
+  w->columns = ALLOC_N(Column, RARRAY_LEN(schema));
+  memset(w->columns, 0, sizeof(Column) * RARRAY_LEN(schema));
+
+  for (i = 0; i < RARRAY_LEN(schema); i++) {
+    VALUE pair = rb_ary_entry(schema, i), name;
+    Column *c = &w->columns[i];
+
+    if (TYPE(pair) != T_ARRAY || RARRAY_LEN(pair) != 2) {
+      rb_raise(rb_eArgError, ":schema has to be a Hash or an Array of [name, type] pairs");
+    }
+    c->type = type_from_value(rb_ary_entry(pair, 1));
+    if (c->type < 0) {
+      rb_raise(rb_eArgError, ":schema types have to be :int64, :float64, :utf8 or :bool");
+    }
+
+    name = rb_ary_entry(pair, 0);
+    if (SYMBOL_P(name)) {
+      name = rb_sym_to_s(name);
+    }
+    StringValue(name);
+    c->name_len = RSTRING_LEN(name);
+    c->name = ALLOC_N(char, c->name_len);
+    memcpy(c->name, RSTRING_PTR(name), c->name_len);
+    w->ncolumns++;
+
+    // A Utf8 column's offsets start with 0.
+    if (c->type == ARROW_UTF8) {
+      bytes_grow(&c->values, 4);
+    }
+  }
+
+  *writer = w;
+  return holder;
+}
@@ -0,0 +1,40 @@
+#ifndef FASTCSV_ARROW_H
+#define FASTCSV_ARROW_H
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Writes fields to an IO in the Arrow IPC streaming format, one record batch
+// at a time, without creating a Ruby object per field.
+// @see https://arrow.apache.org/docs/format/Columnar.html#ipc-streaming-format
+typedef struct ArrowWriter ArrowWriter;
+
+// Returns an object that frees the writer when garbage collected. `schema` is a
+// Hash or an Array of [name, type] pairs. If `headers`, the first row is
+// skipped.
+VALUE arrow_writer_new(VALUE schema, VALUE output, long batch_size, int headers, ArrowWriter **writer);
+
+// Writes the schema.
+void arrow_writer_start(ArrowWriter *w);
+
+// FastCSVSink callbacks. Return -1 if a field doesn't match the schema.
+int arrow_writer_field(void *data, const char *ptr, size_t size, int column, bool quoted);
+int arrow_writer_row_end(void *data);
+
+// Describes the last error.
+const char *arrow_writer_error(ArrowWriter *w);
+
+// Parse a field's bytes as a value of a column's type. Return 0 if the bytes
+// aren't a valid value.
+int arrow_parse_int64(const char *ptr, long len, int64_t *value);
+int arrow_parse_float64(const char *ptr, long len, double *value);
+// Returns 1 for true, 0 for false and -1 if invalid.
+int arrow_parse_bool(const char *ptr, long len);
+
+// Writes the last record batch and the end-of-stream marker. Returns the
+// number of rows written.
+long arrow_writer_finish(ArrowWriter *w);
+
+#endif
@@ -1,3 +1,92 @@
+require 'fileutils'
 require 'mkmf'
 
+# The checked-in parser is generated with `ragel -G2`. To compare Ragel's
+# code-generation styles, regenerate it in the build directory with another
+# style: --with-ragel-style=T0|T1|F0|F1|G0|G1|G2. Requires ragel.
+if style = with_config('ragel-style')
+  unless %w(T0 T1 F0 F1 G0 G1 G2).include?(style)
+    abort '--with-ragel-style must be one of T0, T1, F0, F1, G0, G1 or G2'
+  end
+  if File.expand_path($srcdir) == File.expand_path('.')
+    abort '--with-ragel-style would overwrite the checked-in fastcsv.c; build outside the source directory'
+  end
+  ragel = find_executable('ragel') or abort '--with-ragel-style requires ragel'
+  system(ragel, "-#{style}", '-o', 'fastcsv.c', File.join($srcdir, 'fastcsv.rl')) or abort 'ragel failed'
+end
+
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+# Files are read from their descriptor, which rb_io_t's `fd` member exposes
+# before Ruby 3.1.
+have_func('rb_io_descriptor', 'ruby/io.h')
+# The :read_ahead option reads Files on a background thread.
+have_header('pthread.h')
+
+# Compressed input is decompressed in the parse loop: gzip with zlib and, if
+# available, zstd with libzstd (use --with-zstd-dir to locate it).
+if have_library('z', 'inflateInit2_', 'zlib.h')
+  $defs << '-DHAVE_LIBZ'
+end
+dir_config('zstd')
+if have_library('zstd', 'ZSTD_decompressStream', 'zstd.h')
+  $defs << '-DHAVE_LIBZSTD'
+end
+
+# --with-fastcsv-march=ARCH compiles for a CPU (for example, native or
+# x86-64-v3), in which case the binary may not run on older CPUs. Otherwise,
+# the functions marked DISPATCH are compiled for AVX2 and for the baseline,
+# and the version for the CPU is chosen at load time.
+if march = with_config('fastcsv-march')
+  try_cflags("-march=#{march}") or abort "the compiler doesn't accept -march=#{march}"
+  $CFLAGS << " -march=#{march}"
+elsif try_compile(<<~SRC, '-Werror')
+  __attribute__((target_clones("avx2", "default"))) int f(void) { return 0; }
+  int main(void) { return f(); }
+SRC
+  $defs << '-DHAVE_TARGET_CLONES'
+end
+
+# --enable-lto optimizes across the parser, the Arrow writer and the schema
+# inferrer.
+if enable_config('lto', false)
+  if try_cflags('-flto') && try_ldflags('-flto')
+    $CFLAGS << ' -flto'
+    $DLDFLAGS << ' -flto'
+  else
+    abort "the compiler doesn't support -flto"
+  end
+end
+
+# --enable-pgo builds an instrumented extension, trains it with train.rb on a
+# generated corpus and on any files matching --with-pgo-corpus=GLOB, and then
+# writes a Makefile that compiles with the recorded profile.
+pgo = enable_config('pgo', false)
+if pgo
+  $CFLAGS << ' $(PGO_CFLAGS)'
+  $DLDFLAGS << ' $(PGO_CFLAGS)'
+end
+
 create_makefile('fastcsv/fastcsv')
+
+if pgo
+  profile = File.expand_path('pgo')
+  clang = try_cpp("#ifndef __clang__\n#error\n#endif")
+  make = ENV['MAKE'] || find_executable('gmake') || find_executable('make') or abort '--enable-pgo requires make'
+  FileUtils.rm_rf(profile)
+
+  system(make, "PGO_CFLAGS=-fprofile-generate=#{profile}") or abort 'instrumented build failed'
+  system(RbConfig.ruby, File.join($srcdir, 'train.rb'), File.expand_path("fastcsv.#{RbConfig::CONFIG['DLEXT']}"), *Dir[with_config('pgo-corpus', '')]) or abort 'training failed'
+  system(make, 'clean') or abort 'make clean failed'
+
+  # Clang writes raw profiles that must be merged first.
+  if clang
+    llvm_profdata = find_executable('llvm-profdata') or abort '--enable-pgo with clang requires llvm-profdata'
+    system(llvm_profdata, 'merge', '-o', File.join(profile, 'default.profdata'), *Dir[File.join(profile, '*.profraw')]) or abort 'llvm-profdata failed'
+    flags = "-fprofile-use=#{File.join(profile, 'default.profdata')}"
+  else
+    flags = "-fprofile-use=#{profile} -fprofile-correction -Wno-missing-profile"
+  end
+  File.open('Makefile', 'a') do |f|
+    f.puts "PGO_CFLAGS = #{flags}"
+  end
+end
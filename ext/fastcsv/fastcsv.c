@@ -2,7 +2,31 @@
 #line 1 "ext/fastcsv/fastcsv.rl"
 #include <ruby.h>
 #include <ruby/encoding.h>
+#include <ruby/io.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#include <unistd.h>
+#endif
+#if defined(HAVE_RB_THREAD_CALL_WITHOUT_GVL) && defined(HAVE_PTHREAD_H)
+#define HAVE_READ_AHEAD
+#include <pthread.h>
+#include <sys/stat.h>
+#endif
+#ifdef HAVE_LIBZ
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBZSTD
+#include <zstd.h>
+#endif
+#include "fastcsv.h"
+#include "arrow.h"
+#include "schema.h"
+#include "sniff.h"
+#include "utf8.h"
 
 // CSV specifications.
 // http://tools.ietf.org/html/rfc4180
@@ -23,39 +47,373 @@ if (enc2 != NULL) { \
   field = rb_str_encode(field, rb_enc_from_encoding(enc), 0, Qnil); \
 }
 
-#define FREE \
-if (buf != NULL) { \
-  free(buf); \
+// Report or replace the first invalid byte sequence in a field. `curline`
+// counts rows, so the line breaks in fields are added. A sink's field
+// has no String, so one is created only to be scrubbed, and the sink receives
+// its bytes.
+#define VALIDATE(start, end) \
+if (validate_encoding) { \
+  char *invalid = find_invalid_byte(start, end, encoding); \
+  if (invalid != NULL) { \
+    if (validate_encoding == VALIDATE_RAISE) { \
+      long offset = consumed + (invalid - (in_place ? src_start : buf)); \
+      long line = curline + s->field_lines + count_line_breaks(start, invalid); \
+      FREE; \
+      rb_raise(eError, "Invalid byte sequence in line %ld (byte offset %ld).", line, offset); \
+    } \
+    if (mode == MODE_SINK) { \
+      field = rb_funcall(rb_enc_str_new(field_ptr, field_len, encoding), s_scrub, 1, replace); \
+      field_ptr = RSTRING_PTR(field); \
+      field_len = RSTRING_LEN(field); \
+    } \
+    else { \
+      field = rb_funcall(field, s_scrub, 1, replace); \
+    } \
+  } \
+}
+
+// A sink receives a quoted field's bytes, without a String being created. A
+// quoted field without escapes is created like an unquoted field. With :strip,
+// the token includes the stripped characters around the quote characters.
+#define READ_QUOTED \
+{ \
+  char *from = ts + 1, *to = p - 1; \
+  if (strip) { \
+    while (from[-1] != quote_char) { \
+      from++; \
+    } \
+    while (*to != quote_char) { \
+      to--; \
+    } \
+  } \
+  if (skip_row) { \
+    field = Qnil; \
+  } \
+  else { \
+    field_len = unescape_quoted_field(&field_ptr, &s->scratch, &s->scratch_size, quote_char, escape_char, from, to); \
+    if (mode == MODE_SINK) { \
+      field = Qtrue; \
+      VALIDATE(from, to); \
+    } \
+    else { \
+      field = rb_enc_str_new(field_ptr, field_len, encoding); \
+      VALIDATE(from, to); \
+      ENCODE; \
+      if (field_len == 0 && s->empty_value != Qundef) { \
+        field = NIL_P(s->empty_value) ? Qundef : s->empty_value; \
+      } \
+    } \
+  } \
+  if (validate_encoding) { \
+    s->field_lines += count_line_breaks(from, to); \
+  } \
+}
+
+// To stop, the end of the chunk is moved to the next byte, so that the machine
+// exits without reading further. A sink may fail without an error message.
+#define SINK_CALL(call) \
+if (!stopped) { \
+  int status = (call); \
+  if (status < 0) { \
+    FREE; \
+    rb_raise(eError, "%s in line %d.", sink->error == NULL ? "Invalid field" : sink->error, curline); \
+  } \
+  else if (status > 0) { \
+    stopped = true; \
+    pe = p + 1; \
+  } \
+}
+
+// Fields are appended to the row, to their columns or passed to the sink. In
+// the sink's case, `field` is Qtrue if the field isn't nil. A skipped row's
+// fields are only counted. `field` is nil for an empty unquoted field, which is
+// :nil_value, and Qundef for a null value, so that a row of one null value
+// isn't blank. A sink is told whether the field was quoted, so
+// `in_quoted_field` is reset after the field is pushed.
+#define FIELD_VALUE (NIL_P(field) ? s->nil_value : field == Qundef ? Qnil : field)
+#define PUSH_FIELD \
+if (skip_row) { \
+} \
+else if (mode == MODE_ROWS || mode == MODE_SHIFT) { \
+  rb_ary_push(row, FIELD_VALUE); \
+} \
+else if (mode == MODE_COLUMNS) { \
+  push_column(result, column, rows, FIELD_VALUE); \
+} \
+else if (NIL_P(field) || field == Qundef) { \
+  SINK_CALL(sink->on_field(sink->data, NULL, 0, (int)column, in_quoted_field)); \
+} \
+else { \
+  SINK_CALL(sink->on_field(sink->data, field_ptr, field_len, (int)column, in_quoted_field)); \
+} \
+column++;
+
+// The first row's width is learned, so that later rows' Arrays are allocated
+// to fit, instead of growing as fields are pushed. With :strict_width, rows of
+// other widths raise an error. Blank rows are allowed, and dropped with
+// :skip_blanks. Rows that :skip_lines matched are dropped, as is the row in
+// which a sink stopped, so that its end isn't passed to the sink or counted.
+#define END_ROW \
+if (skip_row) { \
+  skip_row = false; \
+} \
+else if (skip_blanks && column == 0) { \
+} \
+else if (stopped) { \
+} \
+else { \
+  if (width == 0) { \
+    width = column; \
+  } \
+  else if (strict_width && column && column != width) { \
+    FREE; \
+    rb_raise(eError, "Expected %ld fields but found %ld in line %d.", width, column, curline); \
+  } \
+  if (mode == MODE_ROWS) { \
+    if (NIL_P(result)) { \
+      rb_yield(row); \
+    } \
+    else { \
+      rb_ary_push(result, row); \
+    } \
+    row = rb_ary_new2(width); \
+  } \
+  else if (mode == MODE_SHIFT) { \
+    result = row; \
+    row = rb_ary_new2(width); \
+    suspended = true; \
+    pe = p + 1; \
+  } \
+  else if (mode == MODE_COLUMNS) { \
+    end_columns(result, column, rows); \
+  } \
+  else { \
+    SINK_CALL(sink->on_row_end(sink->data)); \
+  } \
+  rows++; \
+} \
+column = 0;
+
+// Rows that begin with the :skip_lines prefix are skipped. If the chunk ends
+// first, the rest of the prefix is compared at the start of the next chunk.
+#define MATCH_PREFIX(from) \
+if (skip_pos >= 0) { \
+  skip_pos = match_prefix(s->skip_lines, skip_pos, (from), pe); \
+  if (skip_pos == RSTRING_LEN(s->skip_lines)) { \
+    skip_row = true; \
+    skip_pos = -1; \
+  } \
+}
+
+// #row isn't set in other modes, to avoid allocating a String per row.
+#define SET_ROW \
+if ((mode != MODE_ROWS && mode != MODE_SHIFT) || skip_row) { \
 } \
-if (row_sep != NULL) { \
-  free(row_sep); \
+else if (start == 0 || p == start) { \
+  rb_ivar_set(self, s_row, rb_str_new2("")); \
+} \
+else if (p > start) { \
+  rb_ivar_set(self, s_row, rb_str_new(start, p - start)); \
 }
 
-static VALUE cClass, cParser, eError;
-static ID s_read, s_row;
+// The Scan's resources are kept up to date as they're allocated, so that they
+// can be freed if the scan exits early.
+#define FREE \
+scan_free(s);
+
+static VALUE cClass, cParser, cDialect, cRows, eError;
+static ID s_read, s_row, s_scrub, s_string, s_pos, s_pos_set, s_StringIO, s_to_str, s_encoding,
+  s_internal_encoding, s_external_encoding, s_buffer_size;
+// Option names and values.
+static ID s_quote_char, s_col_sep, s_validate_encoding, s_replace, s_compression, s_gzip, s_zstd,
+  s_auto, s_strict_width, s_read_ahead, s_strip, s_skip_blanks, s_skip_lines, s_comment_char, s_skip_rows, s_batch_size, s_schema, s_headers, s_sample_rows,
+  s_row_sep, s_liberal_parsing, s_escape_char, s_null_marker,
+  s_null_values, s_nil_value, s_empty_value;
+
+enum { VALIDATE_NONE, VALIDATE_RAISE, VALIDATE_REPLACE };
+
+enum { MODE_ROWS, MODE_SHIFT, MODE_COLUMNS, MODE_SINK, MODE_COUNT };
+
+// Receives fields as bytes instead of as Strings. See fastcsv.h.
+typedef FastCSVSink Sink;
+
+enum { COMPRESSION_NONE, COMPRESSION_GZIP, COMPRESSION_ZSTD, COMPRESSION_AUTO };
+
+static const char *compression_names[] = {"plain", "gzip", "zstd", "auto"};
+
+// Decompresses input into the scan buffer.
+typedef struct {
+  int format;
+  bool started;  // the format is known and its stream is initialized
+  bool finished; // a gzip member or zstd frame has ended
+  bool eof;      // the compressed input is exhausted
+  bool own_in;
+  char *in;
+  long in_size, in_len, in_pos;
+  const char *error;
+#ifdef HAVE_LIBZ
+  z_stream zs;
+#endif
+#ifdef HAVE_LIBZSTD
+  ZSTD_DStream *zds;
+#endif
+} Inflater;
+
+// Reads the next chunk of a File on a background thread while the current
+// chunk is scanned.
+typedef struct {
+  int fd;        // a duplicate of the File's descriptor
+  char *chunk;
+  long size, len, pos;
+  int error;
+  bool full;     // the chunk has been read and not yet taken
+  bool eof;      // the chunk is the last one
+  bool stop;
+  bool interrupted;
+#ifdef HAVE_READ_AHEAD
+  bool started;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+} ReadAhead;
+
+// Options are compiled once by Parser.new, instead of on every call.
+typedef struct {
+  char quote_char;
+  char col_sep;
+  bool sniff_quote_char; // :auto
+  bool sniff_col_sep;    // :auto
+  int validate_encoding;
+  int compression;
+  bool strict_width;
+  bool liberal_parsing;
+  bool read_ahead;
+  bool strip;
+  uint32_t strip_set[8]; // a bit per byte to strip from unquoted fields
+  bool skip_blanks;
+  VALUE skip_lines;      // a prefix, or nil
+  char escape_char;      // or 0
+  VALUE null_marker;     // an unquoted field that is nil, or nil
+  VALUE null_values;     // unquoted fields that are nil, or nil
+  VALUE nil_value;       // the value of empty unquoted fields
+  VALUE empty_value;     // the value of empty quoted fields, or Qundef for ""
+  char comment_char;     // or 0
+  long skip_rows;
+  bool has_encoding; // whether :encoding was given
+  rb_encoding *enc;
+  rb_encoding *enc2;
+  VALUE replace;
+} Options;
 
 // @see https://github.com/nofxx/georuby_c/blob/b3b91fd90980d7c295ac8f6012d89878ea7cd569/ext/types.h#L22
 typedef struct {
-  char *start;
+  Options options;
+  // The buffer is kept between calls, so that parsing many small inputs
+  // doesn't allocate a buffer per input.
+  char *buf;
+  int buf_capa;
 } Data;
 
+// The state of counting rows, kept between chunks.
+typedef struct {
+  long rows;    // row separators
+  long line;    // the line of the last quoted field
+  bool quoted;  // in a quoted field
+  bool cr;      // the last chunk ended with a carriage return
+  bool content; // the current row isn't empty
+} Counter;
+
+// The state of a scan, which is kept between calls when rows are returned one
+// at a time.
+typedef struct {
+  VALUE self, port, src, ahead_holder, row, field, replace, result, skip_lines, null_values, nil_value, empty_value;
+  Data *d;
+  Sink *sink;
+  int mode, cs, act, have, curline, io, fd_read, in_place, compression, done, unclosed_line;
+  int buffer_size, buf_capa, taint, len_row_sep, validate_encoding;
+  char *p, *pe, *ts, *te, *start, *mark_row_sep, *row_sep, *src_start, *src_end, *window, *buf;
+  char *field_ptr, *scratch;
+  long consumed, column, rows, width, field_len, scratch_size, skip_pos;
+  rb_encoding *enc, *enc2, *encoding;
+  Inflater *inflater;
+  ReadAhead *ahead;
+  char quote_char, col_sep, comment_char, escape_char;
+  bool in_quoted_field, stopped, suspended, strict_width, strip, skip_blanks, skip_row, liberal_parsing;
+  long field_lines;   // line breaks in fields, if validating
+  bool at_row_start; // lines may be discarded before the machine resumes
+  bool discarding;   // in a discarded line
+  bool discard_lf;   // a discarded line ended with "\r", which may precede "\n"
+  long skip_rows;    // lines left to discard
+  bool sniff_quote_char, sniff_col_sep; // guessed from the first chunk
+  uint32_t strip_set[8];
+  bool finished; // resources are freed
+  bool busy;     // a Rows is scanning
+  Counter counter;
+} Scan;
+
+
+#line 537 "ext/fastcsv/fastcsv.rl"
+
+
+
+#line 361 "ext/fastcsv/fastcsv.c"
+static const int raw_parse_start = 7;
+static const int raw_parse_first_final = 7;
+static const int raw_parse_error = 0;
+
+static const int raw_parse_en_main = 7;
 
-#line 156 "ext/fastcsv/fastcsv.rl"
 
+#line 540 "ext/fastcsv/fastcsv.rl"
 
+// Whether the byte at `p` follows an odd number of escape characters in the
+// current token. Only quote characters, column separators and line breaks are
+// checked.
+#define ESCAPED(p) (escape_char && escaped((p), ts, escape_char))
 
-#line 48 "ext/fastcsv/fastcsv.c"
-static const int raw_parse_start = 4;
-static const int raw_parse_first_final = 4;
-static const int raw_parse_error = 0;
+static inline bool escaped(const char *p, const char *ts, char escape_char) {
+  const char *q = p;
+
+  while (q > ts && q[-1] == escape_char) {
+    q--;
+  }
+
+  return (p - q) & 1;
+}
 
-static const int raw_parse_en_main = 4;
+// Whether the bytes are one of :null_values.
+static bool null_value_p(VALUE values, const char *ptr, long len) {
+  long i;
 
+  for (i = 0; i < RARRAY_LEN(values); i++) {
+    VALUE value = RARRAY_AREF(values, i);
+    if (RSTRING_LEN(value) == len && memcmp(RSTRING_PTR(value), ptr, len) == 0) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+#define STRIP_P(set, c) ((set)[(unsigned char)(c) >> 5] & (UINT32_C(1) << ((unsigned char)(c) & 31)))
+
+// Whether only stripped characters precede the byte at `p` in the current
+// token, in which case a quote character opens a quoted field.
+#define STRIPPED(p) (strip && stripped((p), ts, s->strip_set))
+
+static inline bool stripped(const char *p, const char *ts, const uint32_t *strip_set) {
+  while (ts < p && STRIP_P(strip_set, *ts)) {
+    ts++;
+  }
 
-#line 159 "ext/fastcsv/fastcsv.rl"
+  return ts == p;
+}
 
 // 16 kB
 #define BUFSIZE 16384
+// Larger buffers aren't kept between calls.
+#define KEEP_BUFSIZE (64 * BUFSIZE)
 
 // @see http://rxr.whitequark.org/mri/source/io.c#4845
 static void rb_io_ext_int_to_encs(rb_encoding *ext, rb_encoding *intern, rb_encoding **enc, rb_encoding **enc2, int fmode) {
@@ -83,292 +441,1649 @@ static void rb_io_ext_int_to_encs(rb_encoding *ext, rb_encoding *intern, rb_enco
   }
 }
 
-static void parse_quoted_field(VALUE* field, rb_encoding* encoding, char quote_char, char* quoted_field_start, char *quoted_field_end) {
-  // read the full quoted field, handling any escape sequences
-  if (quoted_field_end == quoted_field_start) {
-    // empty quoted field is an empty string
-    *field = rb_enc_str_new("", 0, encoding);
-  } else {
-    // largest possible buffer. if there's escaping, the resulting string will
-    // not use the entire buffer
-    char *copy = ALLOC_N(char, quoted_field_end - quoted_field_start);
-    char *reader = quoted_field_start, *writer = copy;
-    int escaped = 0;
+// Returns the byte that an escape sequence stands for. Letters stand for control
+// characters, like in MySQL's and PostgreSQL's text formats, and other bytes
+// stand for themselves.
+static char escaped_byte(char c) {
+  switch (c) {
+    case '0': return '\0';
+    case 'b': return '\b';
+    case 'f': return '\f';
+    case 'n': return '\n';
+    case 'r': return '\r';
+    case 't': return '\t';
+    case 'v': return '\v';
+    case 'Z': return '\032';
+    default: return c;
+  }
+}
 
-    while (quoted_field_end > reader) {
-      if (*reader == quote_char && !escaped) {
-        // Skip the escaping character.
-        escaped = 1;
-      }
-      else {
-        escaped = 0;
-        *writer++ = *reader;
-      }
-      reader++;
+// Returns the next escape character or, if `quote_char` isn't 0, quote
+// character, or NULL.
+static char *find_escape(char *p, char *pe, char escape_char, char quote_char) {
+  if (!quote_char) {
+    return memchr(p, escape_char, pe - p);
+  }
+  for (; p < pe; p++) {
+    if (*p == escape_char || *p == quote_char) {
+      return p;
     }
+  }
+  return NULL;
+}
+
+// Unescapes a field with :escape_char. In a quoted field, a doubled quote
+// character still stands for one. An escape character that ends the field
+// stands for itself.
+static long unescape_escaped_field(char **field, char **scratch, long *scratch_size, char escape_char, char quote_char, char *field_start, char *field_end) {
+  long len = field_end - field_start;
+  char *reader = field_start, *writer, *escape = find_escape(field_start, field_end, escape_char, quote_char);
+
+  if (escape == NULL) {
+    *field = field_start;
+    return len;
+  }
 
-    *field = rb_enc_str_new(copy, writer - copy, encoding);
+  if (*scratch_size < len) {
+    *scratch_size = len;
+    REALLOC_N(*scratch, char, *scratch_size);
+  }
+  writer = *scratch;
 
-    if (copy != NULL) {
-      free(copy);
+  do {
+    memcpy(writer, reader, escape - reader);
+    writer += escape - reader;
+    if (escape + 1 == field_end) {
+      *writer++ = *escape;
+    }
+    else if (*escape == escape_char) {
+      *writer++ = escaped_byte(escape[1]);
+    }
+    else {
+      *writer++ = quote_char;
     }
+    reader = escape + 2;
+  } while (reader < field_end && (escape = find_escape(reader, field_end, escape_char, quote_char)) != NULL);
+  if (reader < field_end) {
+    memcpy(writer, reader, field_end - reader);
+    writer += field_end - reader;
   }
+
+  *field = *scratch;
+  return writer - *scratch;
 }
 
-static VALUE raw_parse(int argc, VALUE *argv, VALUE self) {
-  int cs, act, have = 0, curline = 1, io = 0;
-  char *ts = 0, *te = 0, *buf = 0, *eof = 0, *mark_row_sep = 0, *row_sep = 0;
+// Reads the full quoted field, handling any escape sequences. A field without
+// escaped quote chars is returned in place; otherwise, it's unescaped into the
+// scratch buffer, which is reused between fields, instead of into a buffer
+// allocated per field. With :escape_char, unescape_escaped_field reads it.
+static long unescape_quoted_field(char **field, char **scratch, long *scratch_size, char quote_char, char escape_char, char *quoted_field_start, char *quoted_field_end) {
+  long len = quoted_field_end - quoted_field_start;
+  char *reader = quoted_field_start, *writer, *quote;
 
-  VALUE port, opts, r_encoding;
-  VALUE row = rb_ary_new(), field = Qnil, bufsize = Qnil;
-  int done = 0, unclosed_line = 0, buffer_size = 0, taint = 0, len_row_sep = 0;
-  rb_encoding *enc = NULL, *enc2 = NULL, *encoding = NULL;
+  if (escape_char) {
+    return unescape_escaped_field(field, scratch, scratch_size, escape_char, quote_char, quoted_field_start, quoted_field_end);
+  }
 
-  Data *d;
-  Data_Get_Struct(self, Data, d);
+  quote = memchr(quoted_field_start, quote_char, len);
 
-  VALUE option;
-  char quote_char = '"', col_sep = ',';
+  if (quote == NULL) {
+    *field = quoted_field_start;
+    return len;
+  }
 
-  bool in_quoted_field = false;
+  if (*scratch_size < len) {
+    *scratch_size = len;
+    REALLOC_N(*scratch, char, *scratch_size);
+  }
+  writer = *scratch;
 
-  rb_scan_args(argc, argv, "11", &port, &opts);
-  taint = OBJ_TAINTED(port);
-  io = rb_respond_to(port, s_read);
-  if (!io) {
-    if (rb_respond_to(port, rb_intern("to_str"))) {
-      port = rb_funcall(port, rb_intern("to_str"), 0);
-      StringValue(port);
-    }
-    else {
-      rb_raise(rb_eArgError, "data has to respond to #read or #to_str");
+  // Copies the runs between escaping characters, skipping each escaping
+  // character and copying the character that it escapes.
+  do {
+    memcpy(writer, reader, quote - reader);
+    writer += quote - reader;
+    if (quote + 1 < quoted_field_end) {
+      *writer++ = quote[1];
     }
+    reader = quote + 2;
+  } while (reader < quoted_field_end && (quote = memchr(reader, quote_char, quoted_field_end - reader)) != NULL);
+  if (reader < quoted_field_end) {
+    memcpy(writer, reader, quoted_field_end - reader);
+    writer += quoted_field_end - reader;
   }
 
-  if (NIL_P(opts)) {
-    opts = rb_hash_new();
+  *field = *scratch;
+  return writer - *scratch;
+}
+
+// Counts "\n", "\r\n" and "\r" line breaks, which only quoted fields contain,
+// with memchr, so that fields without line breaks cost two vectorized scans.
+static long count_line_breaks(const char *p, const char *pe) {
+  const char *q;
+  long count = 0;
+
+  for (q = p; q < pe && (q = memchr(q, '\n', pe - q)) != NULL; q++) {
+    count++;
   }
-  else if (TYPE(opts) != T_HASH) {
-    rb_raise(rb_eArgError, "options has to be a Hash or nil");
+  for (q = p; q < pe && (q = memchr(q, '\r', pe - q)) != NULL; q++) {
+    if (q + 1 == pe || q[1] != '\n') {
+      count++;
+    }
   }
 
-  option = rb_hash_aref(opts, ID2SYM(rb_intern("quote_char")));
-  if (TYPE(option) == T_STRING && RSTRING_LEN(option) == 1) {
-    quote_char = *StringValueCStr(option);
+  return count;
+}
+
+static char *find_invalid_byte(char *start, char *end, rb_encoding *encoding) {
+  if (encoding == NULL || encoding == rb_ascii8bit_encoding()) {
+    return NULL;
   }
-  else if (!NIL_P(option)) {
-    rb_raise(rb_eArgError, ":quote_char has to be a single character String");
+  if (encoding == rb_utf8_encoding()) {
+    return (char *)find_invalid_utf8(start, end);
   }
 
-  option = rb_hash_aref(opts, ID2SYM(rb_intern("col_sep")));
-  if (TYPE(option) == T_STRING && RSTRING_LEN(option) == 1) {
-    col_sep = *StringValueCStr(option);
+  while (start < end) {
+    int len = rb_enc_precise_mbclen(start, end, encoding);
+    if (!MBCLEN_CHARFOUND_P(len)) {
+      return start;
+    }
+    start += MBCLEN_CHARFOUND_LEN(len);
   }
-  else if (!NIL_P(option)) {
-    rb_raise(rb_eArgError, ":col_sep has to be a single character String");
+
+  return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+typedef struct {
+  int fd;
+  char *ptr;
+  size_t length;
+  ssize_t result;
+  int error;
+} read_args;
+
+static void *read_without_gvl(void *data) {
+  read_args *args = data;
+  args->result = read(args->fd, args->ptr, args->length);
+  args->error = errno;
+  return NULL;
+}
+#endif
+
+// A File's descriptor. rb_io_t's `fd` member is deprecated where
+// rb_io_descriptor exists.
+#ifdef HAVE_RB_IO_DESCRIPTOR
+#define IO_DESCRIPTOR(port, fptr) rb_io_descriptor(port)
+#else
+#define IO_DESCRIPTOR(port, fptr) ((fptr)->fd)
+#endif
+
+// Reads up to `length` bytes from a File's descriptor into `ptr`, like
+// IO#read(length) but without allocating a String. Stops early only at EOF.
+// Returns -1 if the IO has buffered data, in which case use IO#read instead.
+static long read_direct(VALUE port, char *ptr, long length) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_io_t *fptr;
+  read_args args;
+  long total = 0;
+  int fd;
+
+  GetOpenFile(port, fptr);
+  rb_io_check_readable(fptr);
+  if (rb_io_read_pending(fptr)) {
+    return -1;
+  }
+  fd = IO_DESCRIPTOR(port, fptr);
+
+  while (total < length) {
+    args.fd = fd;
+    args.ptr = ptr + total;
+    args.length = length - total;
+    rb_thread_call_without_gvl(read_without_gvl, &args, RUBY_UBF_IO, NULL);
+
+    if (args.result > 0) {
+      total += args.result;
+    }
+    else if (args.result == 0) {
+      break;
+    }
+    else if (args.error == EINTR) {
+      rb_thread_check_ints();
+    }
+    else if (args.error == EAGAIN || args.error == EWOULDBLOCK) {
+      rb_io_wait_readable(fd);
+    }
+    else {
+      rb_syserr_fail(args.error, NULL);
+    }
   }
 
-  // @see rb_io_extract_modeenc parse_mode_enc
-  /* Set to defaults */
-  rb_io_ext_int_to_encs(NULL, NULL, &enc, &enc2, 0);
+  return total;
+#else
+  return -1;
+#endif
+}
 
-  // "enc" (internal) or "enc2:enc" (external:internal) or "enc:-" (external).
-  // We don't support binmode, which would force "ASCII-8BIT", or "BOM|UTF-*".
-  // @see http://ruby-doc.org/core-2.1.1/IO.html#method-c-new-label-Open+Mode
-  option = rb_hash_aref(opts, ID2SYM(rb_intern("encoding")));
-  if (TYPE(option) == T_STRING) {
-    // `parse_mode_enc` is not in header file.
-    const char *estr = StringValueCStr(option), *ptr;
-    char encname[ENCODING_MAXNAMELEN+1];
-    int idx, idx2;
-    rb_encoding *ext_enc, *int_enc;
+#ifdef HAVE_READ_AHEAD
+// Runs without the GVL. Reads one chunk at a time, waiting for the previous
+// chunk to be taken before reading the next.
+static void *read_ahead_run(void *data) {
+  ReadAhead *ra = data;
 
-    /* parse estr as "enc" or "enc2:enc" or "enc:-" */
+  pthread_mutex_lock(&ra->lock);
+  while (!ra->stop && !ra->eof) {
+    long len = 0;
+    int error = 0;
 
-    ptr = strrchr(estr, ':');
-    if (ptr) {
-      long len = (ptr++) - estr;
-      if (len == 0 || len > ENCODING_MAXNAMELEN) { // ":enc"
-        idx = -1;
-      }
-      else { // "enc2:enc" or "enc:-"
-        memcpy(encname, estr, len);
-        encname[len] = '\0';
-        estr = encname;
-        idx = rb_enc_find_index(encname);
-      }
-    }
-    else { // "enc"
-      idx = rb_enc_find_index(estr);
+    if (ra->full) {
+      pthread_cond_wait(&ra->cond, &ra->lock);
+      continue;
     }
+    pthread_mutex_unlock(&ra->lock);
 
-    if (idx >= 0) {
-      ext_enc = rb_enc_from_index(idx);
-    }
-    else {
-      if (idx != -2) { // ":enc"
-        // `unsupported_encoding` is not in header file.
-        rb_warn("Unsupported encoding %s ignored", estr);
+    while (len < ra->size) {
+      ssize_t result = read(ra->fd, ra->chunk + len, ra->size - len);
+      if (result > 0) {
+        len += result;
       }
-      ext_enc = NULL;
-    }
-
-    int_enc = NULL;
-    if (ptr) {
-      if (*ptr == '-' && *(ptr+1) == '\0') { // "enc:-"
-        /* Special case - "-" => no transcoding */
-        int_enc = (rb_encoding *)Qnil;
+      else if (result == 0) {
+        break;
       }
-      else { // "enc2:enc"
-        idx2 = rb_enc_find_index(ptr);
-        if (idx2 < 0) {
-          // `unsupported_encoding` is not in header file.
-          rb_warn("Unsupported encoding %s ignored", ptr);
-        }
-        else if (idx2 == idx) {
-          int_enc = (rb_encoding *)Qnil;
-        }
-        else {
-          int_enc = rb_enc_from_index(idx2);
-        }
+      else if (errno != EINTR) {
+        error = errno;
+        break;
       }
     }
 
-    rb_io_ext_int_to_encs(ext_enc, int_enc, &enc, &enc2, 0);
+    pthread_mutex_lock(&ra->lock);
+    ra->len = len;
+    ra->pos = 0;
+    ra->error = error;
+    ra->eof = len < ra->size;
+    ra->full = true;
+    pthread_cond_broadcast(&ra->cond);
   }
-  else if (!NIL_P(option)) {
-    rb_raise(rb_eArgError, ":encoding has to be a String");
+  pthread_mutex_unlock(&ra->lock);
+
+  return NULL;
+}
+
+static void *read_ahead_wait(void *data) {
+  ReadAhead *ra = data;
+
+  pthread_mutex_lock(&ra->lock);
+  while (!ra->full && !ra->interrupted) {
+    pthread_cond_wait(&ra->cond, &ra->lock);
   }
+  ra->interrupted = false;
+  pthread_mutex_unlock(&ra->lock);
 
-  // @see CSV#raw_encoding
-  // @see https://github.com/ruby/ruby/blob/ab337e61ecb5f42384ba7d710c36faf96a454e5c/lib/csv.rb#L2290
-  if (rb_respond_to(port, rb_intern("internal_encoding"))) {
-    r_encoding = rb_funcall(port, rb_intern("internal_encoding"), 0);
-    if (NIL_P(r_encoding)) {
-      r_encoding = rb_funcall(port, rb_intern("external_encoding"), 0);
-    }
+  return NULL;
+}
+
+// Wakes the waiting Ruby thread, e.g. on Thread#raise or Ctrl-C.
+static void read_ahead_interrupt(void *data) {
+  ReadAhead *ra = data;
+
+  pthread_mutex_lock(&ra->lock);
+  ra->interrupted = true;
+  pthread_cond_broadcast(&ra->cond);
+  pthread_mutex_unlock(&ra->lock);
+}
+#endif
+
+// Stops the background thread and frees its chunk. Safe to call twice.
+static void read_ahead_stop(ReadAhead *ra) {
+#ifdef HAVE_READ_AHEAD
+  if (ra->started) {
+    pthread_mutex_lock(&ra->lock);
+    ra->stop = true;
+    pthread_cond_broadcast(&ra->cond);
+    pthread_mutex_unlock(&ra->lock);
+    // The descriptor is a regular file's, so a pending read returns promptly.
+    pthread_join(ra->thread, NULL);
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    ra->started = false;
+  }
+  if (ra->fd >= 0) {
+    close(ra->fd);
+    ra->fd = -1;
+  }
+#endif
+  if (ra->chunk != NULL) {
+    free(ra->chunk);
+    ra->chunk = NULL;
   }
-  else if (rb_respond_to(port, rb_intern("string"))) {
-    r_encoding = rb_funcall(rb_funcall(port, rb_intern("string"), 0), rb_intern("encoding"), 0);
+}
+
+// Frees the state if a scan is abandoned, e.g. if a FastCSV::Rows isn't read to
+// the end.
+static void read_ahead_free(void *data) {
+  read_ahead_stop(data);
+  free(data);
+}
+
+// Starts reading a File ahead on a background thread. The File's descriptor is
+// duplicated, so that closing the File doesn't affect the thread; the duplicate
+// shares the File's offset, like `read_direct`. Returns NULL if the File has
+// buffered data or isn't a regular file, in which case it is read as usual.
+static ReadAhead *read_ahead_start(VALUE port, long size, VALUE *holder) {
+#ifdef HAVE_READ_AHEAD
+  rb_io_t *fptr;
+  struct stat st;
+  ReadAhead *ra;
+  int fd;
+
+  GetOpenFile(port, fptr);
+  rb_io_check_readable(fptr);
+  fd = IO_DESCRIPTOR(port, fptr);
+  if (rb_io_read_pending(fptr) || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return NULL;
+  }
+
+  ra = ALLOC(ReadAhead);
+  memset(ra, 0, sizeof(ReadAhead));
+  ra->fd = -1;
+  *holder = Data_Wrap_Struct(0, NULL, read_ahead_free, ra);
+
+  ra->chunk = ALLOC_N(char, size);
+  ra->size = size;
+  ra->fd = dup(fd);
+  if (ra->fd < 0) {
+    return NULL;
+  }
+  pthread_mutex_init(&ra->lock, NULL);
+  pthread_cond_init(&ra->cond, NULL);
+  if (pthread_create(&ra->thread, NULL, read_ahead_run, ra) != 0) {
+    pthread_cond_destroy(&ra->cond);
+    pthread_mutex_destroy(&ra->lock);
+    return NULL;
+  }
+  ra->started = true;
+
+  return ra;
+#else
+  return NULL;
+#endif
+}
+
+// Copies up to `length` bytes that were read ahead into `ptr`. Stops early only
+// at EOF.
+static long read_ahead_take(ReadAhead *ra, char *ptr, long length) {
+  long total = 0;
+
+#ifdef HAVE_READ_AHEAD
+  while (total < length) {
+    bool full;
+    long len;
+
+    pthread_mutex_lock(&ra->lock);
+    full = ra->full;
+    pthread_mutex_unlock(&ra->lock);
+    if (!full) {
+      rb_thread_call_without_gvl(read_ahead_wait, ra, read_ahead_interrupt, ra);
+      rb_thread_check_ints();
+      continue;
+    }
+    if (ra->error != 0) {
+      rb_syserr_fail(ra->error, NULL);
+    }
+
+    len = ra->len - ra->pos;
+    if (len > length - total) {
+      len = length - total;
+    }
+    memcpy(ptr + total, ra->chunk + ra->pos, len);
+    total += len;
+    ra->pos += len;
+
+    if (ra->pos == ra->len) {
+      if (ra->eof) {
+        break;
+      }
+      pthread_mutex_lock(&ra->lock);
+      ra->full = false;
+      pthread_cond_broadcast(&ra->cond);
+      pthread_mutex_unlock(&ra->lock);
+    }
   }
-  else if (rb_respond_to(port, rb_intern("encoding"))) {
-    r_encoding = rb_funcall(port, rb_intern("encoding"), 0);
+#endif
+
+  return total;
+}
+
+// Reads up to `length` bytes from an IO into `ptr`. Returns 0 at EOF.
+static long read_port(VALUE port, int fd_read, ReadAhead *ahead, char *ptr, long length) {
+  VALUE str;
+  long len;
+
+  if (ahead != NULL) {
+    return read_ahead_take(ahead, ptr, length);
   }
-  else {
-    r_encoding = rb_enc_from_encoding(rb_ascii8bit_encoding());
+
+  len = fd_read ? read_direct(port, ptr, length) : -1;
+
+  if (len < 0) {
+    // Reads "`length` bytes without any conversion (binary mode)."
+    // "The resulted string is always ASCII-8BIT encoding."
+    // @see http://www.ruby-doc.org/core-2.1.4/IO.html#method-i-read
+    str = rb_funcall(port, s_read, 1, LONG2NUM(length));
+    if (NIL_P(str)) {
+      // "`nil` means it met EOF at beginning," e.g. for `StringIO.new("")`.
+      len = 0;
+    }
+    else {
+      len = RSTRING_LEN(str);
+      memcpy(ptr, StringValuePtr(str), len);
+    }
   }
 
-  // @see CSV#initialize
-  // @see https://github.com/ruby/ruby/blob/ab337e61ecb5f42384ba7d710c36faf96a454e5c/lib/csv.rb#L1510
-  if (NIL_P(r_encoding)) {
-    r_encoding = rb_enc_from_encoding(rb_default_internal_encoding());
+  return len;
+}
+
+// Guesses the format from the magic number of a gzip member or zstd frame.
+static int detect_compression(const char *ptr, long len) {
+  if (len >= 2 && (unsigned char)ptr[0] == 0x1F && (unsigned char)ptr[1] == 0x8B) {
+    return COMPRESSION_GZIP;
   }
-  if (NIL_P(r_encoding)) {
-    r_encoding = rb_enc_from_encoding(rb_default_external_encoding());
+  if (len >= 4 && (unsigned char)ptr[0] == 0x28 && (unsigned char)ptr[1] == 0xB5 && (unsigned char)ptr[2] == 0x2F && (unsigned char)ptr[3] == 0xFD) {
+    return COMPRESSION_ZSTD;
   }
+  return COMPRESSION_NONE;
+}
 
-  if (enc2 != NULL) {
-    encoding = enc2;
-  }
-  else if (enc != NULL) {
-    encoding = enc;
+static void inflater_free(Inflater *z) {
+  if (z->started) {
+#ifdef HAVE_LIBZ
+    if (z->format == COMPRESSION_GZIP) {
+      inflateEnd(&z->zs);
+    }
+#endif
+#ifdef HAVE_LIBZSTD
+    if (z->format == COMPRESSION_ZSTD) {
+      ZSTD_freeDStream(z->zds);
+    }
+#endif
   }
-  else if (!NIL_P(r_encoding)) {
-    encoding = rb_enc_get(r_encoding);
+  if (z->own_in && z->in != NULL) {
+    free(z->in);
   }
+  free(z);
+}
 
-  // In case #raw_parse is called multiple times on the same parser. Note that
-  // using IO methods on a re-used parser can cause segmentation faults.
-  rb_ivar_set(self, s_row, Qnil);
+typedef struct {
+  Inflater *z;
+  char *out;
+  long out_size, out_len;
+} inflate_args;
 
-  buffer_size = BUFSIZE;
-  if (rb_ivar_defined(self, rb_intern("@buffer_size")) == Qtrue) {
-    bufsize = rb_ivar_get(self, rb_intern("@buffer_size"));
-    if (!NIL_P(bufsize)) {
-      buffer_size = NUM2INT(bufsize);
-      // buffer_size = 0 can cause segmentation faults.
-      if (buffer_size == 0) {
-        buffer_size = BUFSIZE;
-      }
+// Decompresses as much buffered input as fits. Doesn't touch Ruby objects, so
+// that it can run without the GVL.
+static void *inflate_without_gvl(void *data) {
+  inflate_args *args = data;
+  Inflater *z = args->z;
+
+#ifdef HAVE_LIBZ
+  if (z->format == COMPRESSION_GZIP) {
+    int ret;
+
+    z->zs.next_in = (Bytef *)(z->in + z->in_pos);
+    z->zs.avail_in = (uInt)(z->in_len - z->in_pos);
+    z->zs.next_out = (Bytef *)(args->out + args->out_len);
+    z->zs.avail_out = (uInt)(args->out_size - args->out_len);
+
+    ret = inflate(&z->zs, Z_NO_FLUSH);
+
+    args->out_len = args->out_size - z->zs.avail_out;
+    z->in_pos = z->in_len - z->zs.avail_in;
+    if (ret == Z_STREAM_END) {
+      z->finished = true;
+    }
+    else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      z->error = z->zs.msg != NULL ? z->zs.msg : "invalid data";
     }
   }
+#endif
+#ifdef HAVE_LIBZSTD
+  if (z->format == COMPRESSION_ZSTD) {
+    ZSTD_inBuffer input = {z->in, (size_t)z->in_len, (size_t)z->in_pos};
+    ZSTD_outBuffer output = {args->out, (size_t)args->out_size, (size_t)args->out_len};
+    size_t ret = ZSTD_decompressStream(z->zds, &output, &input);
 
-  if (io) {
-    buf = ALLOC_N(char, buffer_size);
+    args->out_len = output.pos;
+    z->in_pos = input.pos;
+    if (ZSTD_isError(ret)) {
+      z->error = ZSTD_getErrorName(ret);
+    }
+    else {
+      z->finished = ret == 0;
+    }
   }
+#endif
 
-  
-#line 302 "ext/fastcsv/fastcsv.c"
-	{
-	cs = raw_parse_start;
-	ts = 0;
-	te = 0;
-	act = 0;
-	}
-
-#line 404 "ext/fastcsv/fastcsv.rl"
-
-  while (!done) {
-    VALUE str;
-    char *p, *pe;
-    int len, space = buffer_size - have, tokstart_diff, tokend_diff, start_diff, mark_row_sep_diff;
+  return NULL;
+}
 
-    if (io) {
-      if (space == 0) {
-        // Not moving d->start will cause intermittent segmentation faults.
-        tokstart_diff = ts - buf;
-        tokend_diff = te - buf;
-        start_diff = d->start - buf;
-        mark_row_sep_diff = mark_row_sep - buf;
+// Fills `ptr` with up to `length` decompressed bytes, reading compressed input
+// from the IO as needed. Returns 0 at the end of the input, or -1 and sets
+// `z->error` if the input is invalid.
+static long inflate_port(Inflater *z, VALUE port, int fd_read, ReadAhead *ahead, char *ptr, long length) {
+  inflate_args args;
+  long out_before, in_before;
 
-        buffer_size += BUFSIZE;
-        REALLOC_N(buf, char, buffer_size);
+  args.z = z;
+  args.out = ptr;
+  args.out_size = length;
+  args.out_len = 0;
 
-        space = buffer_size - have;
+  while (args.out_len < length) {
+    if (z->in_pos == z->in_len && !z->eof) {
+      z->in_len = read_port(port, fd_read, ahead, z->in, z->in_size);
+      z->in_pos = 0;
+      z->eof = z->in_len == 0;
+    }
 
-        ts = buf + tokstart_diff;
-        te = buf + tokend_diff;
-        d->start = buf + start_diff;
-        mark_row_sep = buf + mark_row_sep_diff;
+    if (!z->started) {
+      if (z->format == COMPRESSION_AUTO) {
+        z->format = detect_compression(z->in + z->in_pos, z->in_len - z->in_pos);
       }
-      p = buf + have;
-
-      // Reads "`length` bytes without any conversion (binary mode)."
-      // "The resulted string is always ASCII-8BIT encoding."
-      // @see http://www.ruby-doc.org/core-2.1.4/IO.html#method-i-read
-      str = rb_funcall(port, s_read, 1, INT2FIX(space));
-      if (NIL_P(str)) {
-        // "`nil` means it met EOF at beginning," e.g. for `StringIO.new("")`.
-        len = 0;
+#ifdef HAVE_LIBZ
+      if (z->format == COMPRESSION_GZIP) {
+        // 16 selects the gzip wrapper.
+        if (inflateInit2(&z->zs, 15 + 16) != Z_OK) {
+          z->error = "could not initialize zlib";
+          return -1;
+        }
       }
-      else {
-        len = RSTRING_LEN(str);
-        memcpy(p, StringValuePtr(str), len);
+#endif
+#ifdef HAVE_LIBZSTD
+      if (z->format == COMPRESSION_ZSTD) {
+        z->zds = ZSTD_createDStream();
+        if (z->zds == NULL || ZSTD_isError(ZSTD_initDStream(z->zds))) {
+          z->error = "could not initialize zstd";
+          return -1;
+        }
       }
+#endif
+      z->started = true;
+    }
 
-      // "The 1 to `length`-1 bytes string means it met EOF after reading the result."
-      if (len < space) {
-        // EOF actions don't work in scanners, so we add a sentinel value.
-        // @see http://www.complang.org/pipermail/ragel-users/2007-May/001516.html
-        // @see https://github.com/leeonix/lua-csv-ragel/blob/master/src/csv.rl
-        p[len++] = 0;
-        done = 1;
+    if (z->format == COMPRESSION_NONE) {
+      long len = z->in_len - z->in_pos;
+      if (len == 0) {
+        break;
+      }
+      if (len > length - args.out_len) {
+        len = length - args.out_len;
       }
+      memcpy(ptr + args.out_len, z->in + z->in_pos, len);
+      args.out_len += len;
+      z->in_pos += len;
+      continue;
+    }
+
+    if (z->finished) {
+      if (z->in_pos == z->in_len) {
+        break;
+      }
+      // Concatenated gzip members or zstd frames.
+#ifdef HAVE_LIBZ
+      if (z->format == COMPRESSION_GZIP) {
+        // The next member's magic number may span reads.
+        if (z->in_len - z->in_pos < 2 && !z->eof) {
+          long kept = z->in_len - z->in_pos;
+          memmove(z->in, z->in + z->in_pos, kept);
+          z->in_len = kept + read_port(port, fd_read, ahead, z->in + kept, z->in_size - kept);
+          z->in_pos = 0;
+          z->eof = z->in_len == kept;
+        }
+        // Like Zlib::GzipReader and zcat, bytes after the last member that
+        // don't begin another member are ignored.
+        if (detect_compression(z->in + z->in_pos, z->in_len - z->in_pos) != COMPRESSION_GZIP) {
+          z->in_pos = z->in_len;
+          z->eof = true;
+          break;
+        }
+        inflateReset(&z->zs);
+      }
+#endif
+      z->finished = false;
+    }
+
+    out_before = args.out_len;
+    in_before = z->in_pos;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(inflate_without_gvl, &args, NULL, NULL);
+#else
+    inflate_without_gvl(&args);
+#endif
+    if (z->error != NULL) {
+      return -1;
+    }
+
+    if (args.out_len == out_before && z->in_pos == in_before) {
+      if (z->eof && !z->finished) {
+        z->error = "unexpected end of input";
+        return -1;
+      }
+      if (z->in_pos < z->in_len) {
+        z->error = "invalid data";
+        return -1;
+      }
+    }
+  }
+
+  return args.out_len;
+}
+
+// Appends a field to the `index`th column, adding the column, backfilled with
+// nil for the `rows` rows before, if it's new.
+static void push_column(VALUE columns, long index, long rows, VALUE field) {
+  VALUE column;
+
+  if (index < RARRAY_LEN(columns)) {
+    column = rb_ary_entry(columns, index);
+  }
+  else {
+    long i;
+    column = rb_ary_new2(rows + 1);
+    for (i = 0; i < rows; i++) {
+      rb_ary_push(column, Qnil);
+    }
+    rb_ary_push(columns, column);
+  }
+
+  rb_ary_push(column, field);
+}
+
+// Pads the columns after the last field of a short row with nil.
+static void end_columns(VALUE columns, long index, long rows) {
+  for (; index < RARRAY_LEN(columns); index++) {
+    VALUE column = rb_ary_entry(columns, index);
+    if (RARRAY_LEN(column) == rows) {
+      rb_ary_push(column, Qnil);
+    }
+  }
+}
+
+// Keeps the buffer for the next call, unless the parser already has one or the
+// buffer grew to fit a long field.
+static void release_buffer(Data *d, char *buf, int buf_capa) {
+  if (d->buf == NULL && buf_capa <= KEEP_BUFSIZE) {
+    d->buf = buf;
+    d->buf_capa = buf_capa;
+  }
+  else {
+    free(buf);
+  }
+}
+
+static void default_options(Options *o) {
+  o->quote_char = '"';
+  o->col_sep = ',';
+  o->sniff_quote_char = false;
+  o->sniff_col_sep = false;
+  o->validate_encoding = VALIDATE_NONE;
+  o->compression = COMPRESSION_NONE;
+  o->strict_width = false;
+  o->liberal_parsing = false;
+  o->read_ahead = false;
+  o->strip = false;
+  memset(o->strip_set, 0, sizeof(o->strip_set));
+  o->skip_blanks = false;
+  o->skip_lines = Qnil;
+  o->escape_char = 0;
+  o->null_marker = Qnil;
+  o->null_values = Qnil;
+  o->nil_value = Qnil;
+  o->empty_value = Qundef;
+  o->comment_char = 0;
+  o->skip_rows = 0;
+  o->has_encoding = false;
+  o->enc = NULL;
+  o->enc2 = NULL;
+  o->replace = Qnil;
+}
+
+// Sets the options that are keys of `opts`. A nil value sets the default.
+static void compile_options(VALUE opts, Options *o) {
+  VALUE option;
+
+  option = rb_hash_lookup2(opts, ID2SYM(s_quote_char), Qundef);
+  if (option == Qundef) {
+  }
+  else if (TYPE(option) == T_STRING && RSTRING_LEN(option) == 1) {
+    o->quote_char = *StringValueCStr(option);
+    o->sniff_quote_char = false;
+  }
+  else if (option == ID2SYM(s_auto)) {
+    o->quote_char = '"';
+    o->sniff_quote_char = true;
+  }
+  else if (NIL_P(option)) {
+    o->quote_char = '"';
+    o->sniff_quote_char = false;
+  }
+  else {
+    rb_raise(rb_eArgError, ":quote_char has to be a single character String or :auto");
+  }
+
+  option = rb_hash_lookup2(opts, ID2SYM(s_col_sep), Qundef);
+  if (option == Qundef) {
+  }
+  else if (TYPE(option) == T_STRING && RSTRING_LEN(option) == 1) {
+    o->col_sep = *StringValueCStr(option);
+    o->sniff_col_sep = false;
+  }
+  else if (option == ID2SYM(s_auto)) {
+    o->col_sep = ',';
+    o->sniff_col_sep = true;
+  }
+  else if (NIL_P(option)) {
+    o->col_sep = ',';
+    o->sniff_col_sep = false;
+  }
+  else {
+    rb_raise(rb_eArgError, ":col_sep has to be a single character String or :auto");
+  }
+
+  option = rb_hash_lookup2(opts, ID2SYM(s_validate_encoding), Qundef);
+  if (option == Qundef) {
+  }
+  else if (option == Qtrue) {
+    o->validate_encoding = VALIDATE_RAISE;
+  }
+  else if (option == ID2SYM(s_replace)) {
+    o->validate_encoding = VALIDATE_REPLACE;
+  }
+  else if (!RTEST(option)) {
+    o->validate_encoding = VALIDATE_NONE;
+  }
+  else {
+    rb_raise(rb_eArgError, ":validate_encoding has to be true, false or :replace");
+  }
+
+  option = rb_hash_lookup2(opts, ID2SYM(s_compression), Qundef);
+  if (option == Qundef) {
+  }
+  else if (option == ID2SYM(s_gzip)) {
+    o->compression = COMPRESSION_GZIP;
+  }
+  else if (option == ID2SYM(s_zstd)) {
+    o->compression = COMPRESSION_ZSTD;
+  }
+  else if (option == ID2SYM(s_auto)) {
+    o->compression = COMPRESSION_AUTO;
+  }
+  else if (NIL_P(option)) {
+    o->compression = COMPRESSION_NONE;
+  }
+  else {
+    rb_raise(rb_eArgError, ":compression has to be :gzip, :zstd, :auto or nil");
+  }
+#ifndef HAVE_LIBZ
+  if (o->compression == COMPRESSION_GZIP) {
+    rb_raise(rb_eArgError, "gzip compression requires zlib, which was not found when FastCSV was built");
+  }
+#endif
+#ifndef HAVE_LIBZSTD
+  if (o->compression == COMPRESSION_ZSTD) {
+    rb_raise(rb_eArgError, "zstd compression requires libzstd, which was not found when FastCSV was built");
+  }
+#endif
+
+  option = rb_hash_lookup2(opts, ID2SYM(s_strict_width), Qundef);
+  if (option == Qundef) {
+  }
+  else if (option == Qtrue || !RTEST(option)) {
+    o->strict_width = option == Qtrue;
+  }
+  else {
+    rb_raise(rb_eArgError, ":strict_width has to be true or false");
+  }
+
+  option = rb_hash_lookup2(opts, ID2SYM(s_liberal_parsing), Qundef);
+  if (option == Qundef) {
+  }
+  else if (option == Qtrue || !RTEST(option)) {
+    o->liberal_parsing = option == Qtrue;
+  }
+  else {
+    rb_raise(rb_eArgError, ":liberal_parsing has to be true or false");
+  }
+
+  option = rb_hash_lookup2(opts, ID2SYM(s_read_ahead), Qundef);
+  if (option == Qundef) {
+  }
+  else if (option == Qtrue || !RTEST(option)) {
+    o->read_ahead = option == Qtrue;
+  }
+  else {
+    rb_raise(rb_eArgError, ":read_ahead has to be true or false");
+  }
+
+  // true strips whitespace, like String#strip, and a String strips its
+  // characters. Multibyte characters would be split, so they're not allowed.
+  option = rb_hash_lookup2(opts, ID2SYM(s_strip), Qundef);
+  if (option == Qundef) {
+  }
+  else if (option == Qtrue || (TYPE(option) == T_STRING && RSTRING_LEN(option) > 0 && rb_enc_str_asciionly_p(option))) {
+    const char *chars = option == Qtrue ? " \t\v\f" : RSTRING_PTR(option);
+    long i, len = option == Qtrue ? 4 : RSTRING_LEN(option);
+
+    o->strip = true;
+    memset(o->strip_set, 0, sizeof(o->strip_set));
+    for (i = 0; i < len; i++) {
+      o->strip_set[(unsigned char)chars[i] >> 5] |= UINT32_C(1) << ((unsigned char)chars[i] & 31);
+    }
+  }
+  else if (!RTEST(option)) {
+    o->strip = false;
+    memset(o->strip_set, 0, sizeof(o->strip_set));
+  }
+  else {
+    rb_raise(rb_eArgError, ":strip has to be true, false or a String of ASCII characters");
+  }
+
+  option = rb_hash_lookup2(opts, ID2SYM(s_skip_blanks), Qundef);
+  if (option == Qundef) {
+  }
+  else if (option == Qtrue || !RTEST(option)) {
+    o->skip_blanks = option == Qtrue;
+  }
+  else {
+    rb_raise(rb_eArgError, ":skip_blanks has to be true or false");
+  }
+
+  // Unlike CSV's :skip_lines, which is matched anywhere in the row, this is a
+  // prefix, so that rows are skipped before their fields are read.
+  option = rb_hash_lookup2(opts, ID2SYM(s_skip_lines), Qundef);
+  if (option == Qundef) {
+  }
+  else if (TYPE(option) == T_STRING && RSTRING_LEN(option) > 0 && !memchr(RSTRING_PTR(option), '\n', RSTRING_LEN(option)) && !memchr(RSTRING_PTR(option), '\r', RSTRING_LEN(option))) {
+    o->skip_lines = rb_str_new_frozen(option);
+  }
+  else if (NIL_P(option)) {
+    o->skip_lines = Qnil;
+  }
+  else {
+    rb_raise(rb_eArgError, ":skip_lines has to be a String without \\r or \\n");
+  }
+
+  // Like MySQL's and PostgreSQL's text formats, the escape character escapes
+  // the next byte, including a line break, like MySQL's INTO OUTFILE.
+  option = rb_hash_lookup2(opts, ID2SYM(s_escape_char), Qundef);
+  if (option == Qundef) {
+  }
+  else if (TYPE(option) == T_STRING && RSTRING_LEN(option) == 1 && strchr("\r\n", *RSTRING_PTR(option)) == NULL) {
+    o->escape_char = *RSTRING_PTR(option);
+  }
+  else if (NIL_P(option)) {
+    o->escape_char = 0;
+  }
+  else {
+    rb_raise(rb_eArgError, ":escape_char has to be a single character String other than \\r or \\n");
+  }
+
+  // :null_marker is one of :null_values. They're kept apart, so that one given
+  // to a call doesn't replace the other given to Parser.new, and are merged
+  // when the scan starts.
+  option = rb_hash_lookup2(opts, ID2SYM(s_null_marker), Qundef);
+  if (option == Qundef) {
+  }
+  else if (TYPE(option) == T_STRING && RSTRING_LEN(option) > 0) {
+    o->null_marker = rb_str_new_frozen(option);
+  }
+  else if (NIL_P(option)) {
+    o->null_marker = Qnil;
+  }
+  else {
+    rb_raise(rb_eArgError, ":null_marker has to be a non-empty String");
+  }
+
+  option = rb_hash_lookup2(opts, ID2SYM(s_null_values), Qundef);
+  if (option == Qundef) {
+  }
+  else if (TYPE(option) == T_ARRAY) {
+    VALUE values = rb_ary_new2(RARRAY_LEN(option));
+    long i;
+
+    for (i = 0; i < RARRAY_LEN(option); i++) {
+      VALUE value = RARRAY_AREF(option, i);
+      if (TYPE(value) != T_STRING || RSTRING_LEN(value) == 0) {
+        rb_raise(rb_eArgError, ":null_values has to be an Array of non-empty Strings");
+      }
+      rb_ary_push(values, rb_str_new_frozen(value));
+    }
+    o->null_values = RARRAY_LEN(values) ? rb_ary_freeze(values) : Qnil;
+  }
+  else if (NIL_P(option)) {
+    o->null_values = Qnil;
+  }
+  else {
+    rb_raise(rb_eArgError, ":null_values has to be an Array of non-empty Strings");
+  }
+
+  // Like CSV's options, but the value is frozen and shared by the fields,
+  // instead of converted per field.
+  option = rb_hash_lookup2(opts, ID2SYM(s_nil_value), Qundef);
+  if (option != Qundef) {
+    o->nil_value = TYPE(option) == T_STRING ? rb_str_new_frozen(option) : option;
+  }
+
+  option = rb_hash_lookup2(opts, ID2SYM(s_empty_value), Qundef);
+  if (option != Qundef) {
+    o->empty_value = TYPE(option) == T_STRING ? rb_str_new_frozen(option) : option;
+  }
+
+  option = rb_hash_lookup2(opts, ID2SYM(s_comment_char), Qundef);
+  if (option == Qundef) {
+  }
+  else if (TYPE(option) == T_STRING && RSTRING_LEN(option) == 1 && strchr("\r\n", *RSTRING_PTR(option)) == NULL) {
+    o->comment_char = *RSTRING_PTR(option);
+  }
+  else if (NIL_P(option)) {
+    o->comment_char = 0;
+  }
+  else {
+    rb_raise(rb_eArgError, ":comment_char has to be a single character String other than \\r or \\n");
+  }
+
+  option = rb_hash_lookup2(opts, ID2SYM(s_skip_rows), Qundef);
+  if (option == Qundef) {
+  }
+  else if (FIXNUM_P(option) && FIX2LONG(option) >= 0) {
+    o->skip_rows = FIX2LONG(option);
+  }
+  else if (NIL_P(option)) {
+    o->skip_rows = 0;
+  }
+  else {
+    rb_raise(rb_eArgError, ":skip_rows has to be a non-negative Integer");
+  }
+
+  // nil replaces with U+FFFD for Unicode encodings and "?" otherwise.
+  // @see http://ruby-doc.org/core-2.1.1/String.html#method-i-scrub
+  option = rb_hash_lookup2(opts, ID2SYM(s_replace), Qundef);
+  if (option == Qundef) {
+  }
+  else if (TYPE(option) == T_STRING || NIL_P(option)) {
+    o->replace = option;
+  }
+  else {
+    rb_raise(rb_eArgError, ":replace has to be a String");
+  }
+
+  // "enc" (internal) or "enc2:enc" (external:internal) or "enc:-" (external).
+  // We don't support binmode, which would force "ASCII-8BIT", or "BOM|UTF-*".
+  // @see http://ruby-doc.org/core-2.1.1/IO.html#method-c-new-label-Open+Mode
+  option = rb_hash_lookup2(opts, ID2SYM(s_encoding), Qundef);
+  if (option == Qundef) {
+  }
+  else if (TYPE(option) == T_STRING) {
+    // `parse_mode_enc` is not in header file.
+    const char *estr = StringValueCStr(option), *ptr;
+    char encname[ENCODING_MAXNAMELEN+1];
+    int idx, idx2;
+    rb_encoding *ext_enc, *int_enc;
+
+    /* parse estr as "enc" or "enc2:enc" or "enc:-" */
+
+    ptr = strrchr(estr, ':');
+    if (ptr) {
+      long len = (ptr++) - estr;
+      if (len == 0 || len > ENCODING_MAXNAMELEN) { // ":enc"
+        idx = -1;
+      }
+      else { // "enc2:enc" or "enc:-"
+        memcpy(encname, estr, len);
+        encname[len] = '\0';
+        estr = encname;
+        idx = rb_enc_find_index(encname);
+      }
+    }
+    else { // "enc"
+      idx = rb_enc_find_index(estr);
+    }
+
+    if (idx >= 0) {
+      ext_enc = rb_enc_from_index(idx);
+    }
+    else {
+      if (idx != -2) { // ":enc"
+        // `unsupported_encoding` is not in header file.
+        rb_warn("Unsupported encoding %s ignored", estr);
+      }
+      ext_enc = NULL;
+    }
+
+    int_enc = NULL;
+    if (ptr) {
+      if (*ptr == '-' && *(ptr+1) == '\0') { // "enc:-"
+        /* Special case - "-" => no transcoding */
+        int_enc = (rb_encoding *)Qnil;
+      }
+      else { // "enc2:enc"
+        idx2 = rb_enc_find_index(ptr);
+        if (idx2 < 0) {
+          // `unsupported_encoding` is not in header file.
+          rb_warn("Unsupported encoding %s ignored", ptr);
+        }
+        else if (idx2 == idx) {
+          int_enc = (rb_encoding *)Qnil;
+        }
+        else {
+          int_enc = rb_enc_from_index(idx2);
+        }
+      }
+    }
+
+    rb_io_ext_int_to_encs(ext_enc, int_enc, &o->enc, &o->enc2, 0);
+    o->has_encoding = true;
+  }
+  else if (NIL_P(option)) {
+    o->has_encoding = false;
+  }
+  else {
+    rb_raise(rb_eArgError, ":encoding has to be a String");
+  }
+}
+
+// A Dialect replaces all of `o`, and a Hash replaces the options that are its
+// keys.
+static void apply_options(VALUE opts, Options *o) {
+  if (NIL_P(opts)) {
+  }
+  else if (rb_obj_is_kind_of(opts, cDialect)) {
+    Options *dialect;
+    Data_Get_Struct(opts, Options, dialect);
+    *o = *dialect;
+  }
+  else if (TYPE(opts) == T_HASH) {
+    compile_options(opts, o);
+  }
+  else {
+    rb_raise(rb_eArgError, "options has to be a Hash, a FastCSV::Dialect or nil");
+  }
+}
+
+// Copies the scanner's state between a Scan and the locals of the same names.
+// The state is kept in locals while scanning, so that it can be kept in
+// registers.
+#define LOAD_SCAN \
+VALUE self = s->self, port = s->port, src = s->src, row = s->row, field = s->field, replace = s->replace, result = s->result; \
+Data *d = s->d; \
+Sink *sink = s->sink; \
+int mode = s->mode, cs = s->cs, act = s->act, have = s->have, curline = s->curline, io = s->io, fd_read = s->fd_read; \
+int in_place = s->in_place, compression = s->compression, done = s->done, unclosed_line = s->unclosed_line; \
+int buffer_size = s->buffer_size, buf_capa = s->buf_capa, taint = s->taint, len_row_sep = s->len_row_sep; \
+int validate_encoding = s->validate_encoding; \
+char *p = s->p, *pe = s->pe, *ts = s->ts, *te = s->te, *start = s->start, *mark_row_sep = s->mark_row_sep; \
+char *row_sep = s->row_sep, *src_start = s->src_start, *src_end = s->src_end, *window = s->window, *buf = s->buf; \
+char *field_ptr = s->field_ptr; \
+long consumed = s->consumed, column = s->column, rows = s->rows, width = s->width, field_len = s->field_len, skip_pos = s->skip_pos; \
+rb_encoding *enc = s->enc, *enc2 = s->enc2, *encoding = s->encoding; \
+Inflater *inflater = s->inflater; \
+ReadAhead *ahead = s->ahead; \
+char quote_char = s->quote_char, col_sep = s->col_sep, comment_char = s->comment_char, escape_char = s->escape_char; \
+bool in_quoted_field = s->in_quoted_field, stopped = s->stopped, suspended = s->suspended, strict_width = s->strict_width; \
+bool strip = s->strip, skip_blanks = s->skip_blanks, skip_row = s->skip_row, at_row_start = s->at_row_start; \
+bool liberal_parsing = s->liberal_parsing;
+
+#define SAVE_SCAN \
+s->self = self; s->port = port; s->src = src; s->row = row; s->field = field; s->replace = replace; s->result = result; \
+s->d = d; \
+s->sink = sink; \
+s->mode = mode; s->cs = cs; s->act = act; s->have = have; s->curline = curline; s->io = io; s->fd_read = fd_read; \
+s->in_place = in_place; s->compression = compression; s->done = done; s->unclosed_line = unclosed_line; \
+s->buffer_size = buffer_size; s->buf_capa = buf_capa; s->taint = taint; s->len_row_sep = len_row_sep; \
+s->validate_encoding = validate_encoding; \
+s->p = p; s->pe = pe; s->ts = ts; s->te = te; s->start = start; s->mark_row_sep = mark_row_sep; \
+s->row_sep = row_sep; s->src_start = src_start; s->src_end = src_end; s->window = window; s->buf = buf; \
+s->field_ptr = field_ptr; \
+s->consumed = consumed; s->column = column; s->rows = rows; s->width = width; s->field_len = field_len; s->skip_pos = skip_pos; \
+s->enc = enc; s->enc2 = enc2; s->encoding = encoding; \
+s->inflater = inflater; \
+s->ahead = ahead; \
+s->quote_char = quote_char; s->col_sep = col_sep; s->comment_char = comment_char; s->escape_char = escape_char; \
+s->in_quoted_field = in_quoted_field; s->stopped = stopped; s->suspended = suspended; s->strict_width = strict_width; \
+s->strip = strip; s->skip_blanks = skip_blanks; s->skip_row = skip_row; s->at_row_start = at_row_start; \
+s->liberal_parsing = liberal_parsing;
+
+// Counts row separators outside quoted fields, without running the machine.
+// memchr finds the next quote character or line break, and is vectorized by
+// the C library. An escaped quote character closes and reopens a quoted field,
+// which doesn't change whether a line break is quoted.
+static void count_rows_in(Counter *c, char quote_char, const char *p, const char *pe) {
+  const char *quote = NULL, *lf = NULL, *cr = NULL, *next;
+
+  if (c->cr && p < pe) {
+    c->cr = false;
+    if (*p == '\n') {
+      p++;
+    }
+  }
+
+  while (p < pe) {
+    if (c->quoted) {
+      next = memchr(p, quote_char, pe - p);
+      if (next == NULL) {
+        return;
+      }
+      c->quoted = false;
+      p = next + 1;
+      continue;
+    }
+
+    // The next of each byte is found again only once it's passed.
+    if (quote == NULL || quote < p) {
+      quote = memchr(p, quote_char, pe - p);
+      quote = quote == NULL ? pe : quote;
+    }
+    if (lf == NULL || lf < p) {
+      lf = memchr(p, '\n', pe - p);
+      lf = lf == NULL ? pe : lf;
+    }
+    if (cr == NULL || cr < p) {
+      cr = memchr(p, '\r', pe - p);
+      cr = cr == NULL ? pe : cr;
+    }
+    next = quote < lf ? quote : lf;
+    next = cr < next ? cr : next;
+
+    if (next > p) {
+      c->content = true;
+    }
+    if (next == pe) {
+      return;
+    }
+
+    p = next + 1;
+    if (next == quote) {
+      c->quoted = true;
+      c->content = true;
+      c->line = c->rows + 1;
+    }
+    else {
+      c->rows++;
+      c->content = false;
+      // "\r\n" is one row separator.
+      if (next == cr) {
+        if (p == pe) {
+          c->cr = true;
+        }
+        else if (*p == '\n') {
+          p++;
+        }
+      }
+    }
+  }
+}
+
+// Options that change which lines are rows, or how quote characters are read,
+// aren't known to count_rows_in. With them, the machine counts the rows, and
+// passes their fields to a sink that ignores them.
+static int count_field(void *data, const char *ptr, size_t len, int column, bool quoted) {
+  return 0;
+}
+
+static int count_row_end(void *data) {
+  return 0;
+}
+
+static Sink count_sink = {NULL, count_field, count_row_end, NULL};
+
+// Compares the bytes from `p` with the rest of the prefix, after `pos` bytes
+// matched. Returns the number of bytes matched, or -1 if a byte doesn't match.
+static long match_prefix(VALUE prefix, long pos, const char *p, const char *pe) {
+  const char *ptr = RSTRING_PTR(prefix);
+  long len = RSTRING_LEN(prefix);
+
+  for (; pos < len && p < pe; pos++, p++) {
+    if (*p != ptr[pos]) {
+      return -1;
+    }
+  }
+
+  return pos;
+}
+
+// Discards the lines that :skip_rows skips, from the start of the input.
+// Returns the start of the first row that isn't discarded or, if the chunk
+// ends first, `pe`, in which case the next chunk continues.
+static char *discard_lines(Scan *s, char *p, char *pe, int *curline) {
+  char *lf, *cr;
+
+  while (p < pe) {
+    if (s->discard_lf) {
+      s->discard_lf = false;
+      if (*p == '\n') {
+        p++;
+        continue;
+      }
+    }
+
+    if (!s->discarding) {
+      if (s->skip_rows == 0) {
+        s->at_row_start = false;
+        return p;
+      }
+      s->skip_rows--;
+      s->discarding = true;
+    }
+
+    // Quote characters in a discarded line are ignored.
+    lf = memchr(p, '\n', pe - p);
+    cr = memchr(p, '\r', (lf == NULL ? pe : lf) - p);
+    if (cr != NULL) {
+      lf = cr;
+      s->discard_lf = true;
+    }
+    if (lf == NULL) {
+      return pe;
+    }
+    s->discarding = false;
+    (*curline)++;
+    p = lf + 1;
+  }
+
+  return p;
+}
+
+// Releases the Scan's resources. The buffer is given back to the parser.
+static void scan_free(Scan *s) {
+  if (s->buf != NULL) {
+    release_buffer(s->d, s->buf, s->buf_capa);
+    s->buf = NULL;
+  }
+  if (s->inflater != NULL) {
+    inflater_free(s->inflater);
+    s->inflater = NULL;
+  }
+  if (s->ahead != NULL) {
+    read_ahead_stop(s->ahead);
+    s->ahead = NULL;
+  }
+  if (s->row_sep != NULL) {
+    free(s->row_sep);
+    s->row_sep = NULL;
+  }
+  if (s->scratch != NULL) {
+    free(s->scratch);
+    s->scratch = NULL;
+  }
+  s->finished = true;
+}
+
+// Prepares to scan the input, according to the options.
+static void scan_start(Scan *s, int argc, VALUE *argv, VALUE self, int mode, VALUE result, Sink *sink) {
+  int cs, act, have = 0, curline = 1, io = 0, fd_read = 0, in_place = 0, compression = COMPRESSION_NONE;
+  char *p = 0, *pe = 0, *ts = 0, *te = 0, *start = 0, *buf = 0, *mark_row_sep = 0, *row_sep = 0;
+  char *src_start = 0, *src_end = 0, *window = 0;
+
+  VALUE port, opts, r_encoding, src = Qnil;
+  VALUE row = rb_ary_new(), field = Qnil, bufsize = Qnil, replace = Qnil;
+  int done = 0, unclosed_line = 0, buffer_size = 0, buf_capa = 0, taint = 0, len_row_sep = 0, validate_encoding = VALIDATE_NONE;
+  long consumed = 0, column = 0, rows = 0, width = 0, field_len = 0, skip_pos = -1;
+  char *field_ptr = 0;
+  rb_encoding *enc = NULL, *enc2 = NULL, *encoding = NULL;
+  Inflater *inflater = NULL;
+  ReadAhead *ahead = NULL;
+  bool read_ahead = false;
+
+  Data *d;
+  Data_Get_Struct(self, Data, d);
+
+  Options options;
+  char quote_char = '"', col_sep = ',', comment_char = 0, escape_char = 0;
+
+  bool in_quoted_field = false, stopped = false, suspended = false, strict_width = false, strip = false;
+  bool skip_blanks = false, skip_row = false, at_row_start = false, liberal_parsing = false;
+
+  rb_scan_args(argc, argv, "11", &port, &opts);
+  taint = OBJ_TAINTED(port);
+  io = rb_respond_to(port, s_read);
+  // Duck-typed IOs, like StringIO, and subclasses that override #read are read
+  // with #read.
+  if (io && TYPE(port) == T_FILE && rb_method_basic_definition_p(CLASS_OF(port), s_read)) {
+    fd_read = 1;
+  }
+  if (!io) {
+    if (rb_respond_to(port, s_to_str)) {
+      port = rb_funcall(port, s_to_str, 0);
+      StringValue(port);
     }
     else {
-      p = RSTRING_PTR(port);
-      len = RSTRING_LEN(port);
-      p[len++] = 0;
+      rb_raise(rb_eArgError, "data has to respond to #read or #to_str");
+    }
+  }
+
+  // Options given to the call override the parser's.
+  options = d->options;
+  apply_options(opts, &options);
+  quote_char = options.quote_char;
+  col_sep = options.col_sep;
+  comment_char = options.comment_char;
+  escape_char = options.escape_char;
+  // :null_marker is added to :null_values.
+  s->null_values = options.null_values;
+  if (!NIL_P(options.null_marker)) {
+    s->null_values = rb_ary_new_from_args(1, options.null_marker);
+    if (!NIL_P(options.null_values)) {
+      rb_ary_concat(s->null_values, options.null_values);
+    }
+  }
+  s->nil_value = options.nil_value;
+  s->empty_value = options.empty_value;
+  // :auto is guessed when the first chunk is read.
+  s->sniff_quote_char = options.sniff_quote_char;
+  s->sniff_col_sep = options.sniff_col_sep;
+  validate_encoding = options.validate_encoding;
+  compression = options.compression;
+  strict_width = options.strict_width;
+  liberal_parsing = options.liberal_parsing;
+  read_ahead = options.read_ahead;
+  strip = options.strip;
+  memcpy(s->strip_set, options.strip_set, sizeof(s->strip_set));
+  skip_blanks = options.skip_blanks;
+  // The first lines are discarded when the first chunk is read.
+  s->skip_rows = options.skip_rows;
+  s->discarding = false;
+  s->discard_lf = false;
+  s->field_lines = 0;
+  at_row_start = s->skip_rows > 0;
+  // The first row's prefix is compared when the first chunk is read.
+  s->skip_lines = options.skip_lines;
+  if (!NIL_P(s->skip_lines)) {
+    skip_pos = 0;
+  }
+  replace = options.replace;
+  if (mode == MODE_COUNT && (comment_char || escape_char || liberal_parsing || skip_blanks || s->skip_rows || !NIL_P(s->skip_lines))) {
+    mode = MODE_SINK;
+    sink = &count_sink;
+  }
+
+  // Plain Strings are still scanned in place.
+  if (compression == COMPRESSION_AUTO && !io) {
+    compression = detect_compression(RSTRING_PTR(port), RSTRING_LEN(port));
+  }
+
+  // @see rb_io_extract_modeenc parse_mode_enc
+  if (options.has_encoding) {
+    enc = options.enc;
+    enc2 = options.enc2;
+  }
+  else {
+    /* Set to defaults */
+    rb_io_ext_int_to_encs(NULL, NULL, &enc, &enc2, 0);
+  }
+
+  // The input's encoding is looked up only if the options don't set one.
+  if (enc2 != NULL) {
+    encoding = enc2;
+  }
+  else if (enc != NULL) {
+    encoding = enc;
+  }
+  else if (!io) {
+    encoding = rb_enc_get(port);
+  }
+  else {
+    // @see CSV#raw_encoding
+    // @see https://github.com/ruby/ruby/blob/ab337e61ecb5f42384ba7d710c36faf96a454e5c/lib/csv.rb#L2290
+    if (rb_respond_to(port, s_internal_encoding)) {
+      r_encoding = rb_funcall(port, s_internal_encoding, 0);
+      if (NIL_P(r_encoding)) {
+        r_encoding = rb_funcall(port, s_external_encoding, 0);
+      }
+    }
+    else if (rb_respond_to(port, s_string)) {
+      r_encoding = rb_funcall(rb_funcall(port, s_string, 0), s_encoding, 0);
+    }
+    else if (rb_respond_to(port, s_encoding)) {
+      r_encoding = rb_funcall(port, s_encoding, 0);
+    }
+    else {
+      r_encoding = rb_enc_from_encoding(rb_ascii8bit_encoding());
+    }
+
+    // @see CSV#initialize
+    // @see https://github.com/ruby/ruby/blob/ab337e61ecb5f42384ba7d710c36faf96a454e5c/lib/csv.rb#L1510
+    if (NIL_P(r_encoding)) {
+      r_encoding = rb_enc_from_encoding(rb_default_internal_encoding());
+    }
+    if (NIL_P(r_encoding)) {
+      r_encoding = rb_enc_from_encoding(rb_default_external_encoding());
+    }
+    if (!NIL_P(r_encoding)) {
+      encoding = rb_enc_get(r_encoding);
+    }
+  }
+
+  // In case #raw_parse is called multiple times on the same parser. Note that
+  // using IO methods on a re-used parser can cause segmentation faults.
+  rb_ivar_set(self, s_row, Qnil);
+
+  buffer_size = BUFSIZE;
+  if (rb_ivar_defined(self, s_buffer_size) == Qtrue) {
+    bufsize = rb_ivar_get(self, s_buffer_size);
+    if (!NIL_P(bufsize)) {
+      buffer_size = NUM2INT(bufsize);
+      // buffer_size = 0 can cause segmentation faults.
+      if (buffer_size == 0) {
+        buffer_size = BUFSIZE;
+      }
+    }
+  }
+
+  // Strings and StringIOs are scanned in place, without copying. A frozen copy
+  // shares the String's buffer and protects it from changes while scanning.
+  if (compression == COMPRESSION_NONE && !io) {
+    src = rb_str_new_frozen(port);
+    in_place = 1;
+  }
+  else if (compression == COMPRESSION_NONE && rb_const_defined(rb_cObject, s_StringIO) && rb_obj_class(port) == rb_const_get(rb_cObject, s_StringIO) && rb_method_basic_definition_p(CLASS_OF(port), s_read)) {
+    // Raises IOError if the StringIO is not readable.
+    rb_funcall(port, s_read, 1, INT2FIX(0));
+    src = rb_str_new_frozen(rb_funcall(port, s_string, 0));
+    in_place = 1;
+  }
+  if (in_place) {
+    long pos = io ? NUM2LONG(rb_funcall(port, s_pos, 0)) : 0;
+    src_start = RSTRING_PTR(src) + (pos < RSTRING_LEN(src) ? pos : RSTRING_LEN(src));
+    src_end = RSTRING_PTR(src) + RSTRING_LEN(src);
+    window = src_start;
+  }
+
+  // Nothing that can raise follows, so the Scan owns what's allocated below.
+  if (compression != COMPRESSION_NONE) {
+    inflater = ALLOC(Inflater);
+    memset(inflater, 0, sizeof(Inflater));
+    inflater->format = compression;
+    if (io) {
+      inflater->in = ALLOC_N(char, buffer_size);
+      inflater->in_size = buffer_size;
+      inflater->own_in = true;
+    }
+    else {
+      // Decompress the String without copying it.
+      src = rb_str_new_frozen(port);
+      inflater->in = RSTRING_PTR(src);
+      inflater->in_len = RSTRING_LEN(src);
+      inflater->eof = true;
+      io = 1;
+    }
+  }
+
+  // The buffer is taken from the parser, so that a call from within the block
+  // on the same parser allocates its own.
+  buf = d->buf;
+  buf_capa = d->buf_capa;
+  d->buf = NULL;
+  d->buf_capa = 0;
+  if (io && buf_capa != buffer_size) {
+    REALLOC_N(buf, char, buffer_size);
+    buf_capa = buffer_size;
+  }
+
+  
+#line 1933 "ext/fastcsv/fastcsv.c"
+	{
+	cs = raw_parse_start;
+	ts = 0;
+	te = 0;
+	act = 0;
+	}
+
+#line 2103 "ext/fastcsv/fastcsv.rl"
+
+  SAVE_SCAN;
+  memset(&s->counter, 0, sizeof(Counter));
+  s->scratch = NULL;
+  s->scratch_size = 0;
+  s->ahead = NULL;
+  s->ahead_holder = Qnil;
+  s->finished = false;
+
+  // Only regular files are read ahead. Other inputs are read as usual.
+  if (read_ahead && fd_read) {
+    s->ahead = read_ahead_start(port, buffer_size, &s->ahead_holder);
+  }
+}
+
+// Scans until the input ends, a sink stops or, when returning one row at a
+// time, a row ends.
+static void scan(Scan *s) {
+  LOAD_SCAN;
+  char *eof = 0, *chunk_end;
+  long len;
+  int space, tokstart_diff, tokend_diff, start_diff, mark_row_sep_diff;
+
+  if (suspended) {
+    // Scan the rest of the chunk.
+    suspended = false;
+    goto resume;
+  }
+
+  while (!done) {
+    space = buffer_size - have;
+
+    if (in_place) {
+      // StringIOs are scanned one buffer at a time, so that #pos advances as if
+      // read with #read.
+      p = window;
+      len = src_end - window;
+      if (io && len > buffer_size) {
+        len = buffer_size;
+      }
+      window += len;
+      if (io) {
+        rb_funcall(port, s_pos_set, 1, LONG2NUM(window - RSTRING_PTR(src)));
+      }
+    }
+    else if (io) {
+      if (space == 0) {
+        // Not moving start will cause intermittent segmentation faults.
+        tokstart_diff = ts - buf;
+        tokend_diff = te - buf;
+        start_diff = start - buf;
+        mark_row_sep_diff = mark_row_sep - buf;
+
+        buffer_size += BUFSIZE;
+        REALLOC_N(buf, char, buffer_size);
+        buf_capa = buffer_size;
+        s->buf = buf;
+        s->buf_capa = buf_capa;
+
+        space = buffer_size - have;
+
+        ts = buf + tokstart_diff;
+        te = buf + tokend_diff;
+        start = buf + start_diff;
+        mark_row_sep = buf + mark_row_sep_diff;
+      }
+      p = buf + have;
+
+      if (inflater != NULL) {
+        len = inflate_port(inflater, port, fd_read, ahead, p, space);
+        if (len < 0) {
+          VALUE error = rb_exc_new_str(eError, rb_sprintf("Invalid %s data (%s).", compression_names[inflater->format], inflater->error));
+          FREE;
+          rb_exc_raise(error);
+        }
+      }
+      else {
+        len = read_port(port, fd_read, ahead, p, space);
+      }
+
+      // "The 1 to `length`-1 bytes string means it met EOF after reading the result."
+      if (len < space) {
+        // EOF actions don't work in scanners, so we add a sentinel value.
+        // @see http://www.complang.org/pipermail/ragel-users/2007-May/001516.html
+        // @see https://github.com/leeonix/lua-csv-ragel/blob/master/src/csv.rl
+        p[len++] = 0;
+        done = 1;
+      }
+    }
+    else {
+      // The String's pending bytes were carried to the buffer, leaving room for
+      // the sentinel value.
+      p = buf + have;
+      p[0] = 0;
+      len = 1;
       done = 1;
     }
 
-    if (d->start == 0) {
-      d->start = p;
+    if (start == 0) {
+      start = p;
     }
 
     pe = p + len;
-    
-#line 372 "ext/fastcsv/fastcsv.c"
+
+    // The first chunk is sniffed before it's scanned, so that it isn't read
+    // twice. The sample excludes the sentinel value.
+    if (s->sniff_quote_char || s->sniff_col_sep) {
+      Sniffed sniffed;
+      long sample = (done ? pe - 1 : pe) - p;
+      int complete = done || (in_place && window == src_end);
+
+      if (sample > BUFSIZE) {
+        sample = BUFSIZE;
+        complete = 0;
+      }
+      sniff(p, sample, complete, s->sniff_col_sep ? 0 : col_sep, s->sniff_quote_char ? 0 : quote_char, comment_char, s->skip_rows, &sniffed);
+      col_sep = sniffed.col_sep;
+      quote_char = sniffed.quote_char;
+      s->sniff_quote_char = false;
+      s->sniff_col_sep = false;
+    }
+
+resume:
+    chunk_end = pe;
+    if (mode == MODE_COUNT) {
+      // The sentinel value isn't counted.
+      count_rows_in(&s->counter, quote_char, p, done ? pe - 1 : pe);
+      p = pe;
+    }
+    else {
+      if (at_row_start) {
+        char *from = p;
+
+        s->at_row_start = at_row_start;
+        p = discard_lines(s, p, done ? pe - 1 : pe, &curline);
+        at_row_start = s->at_row_start;
+        // The first row starts after the discarded lines.
+        if (p != from) {
+          start = p;
+          skip_row = false;
+          skip_pos = NIL_P(s->skip_lines) ? -1 : 0;
+        }
+      }
+      MATCH_PREFIX(p);
+      
+#line 2087 "ext/fastcsv/fastcsv.c"
 	{
 	short _widec;
 	if ( p == pe )
@@ -386,186 +2101,502 @@ tr0:
 	break;
 	}
 	}
-	goto st4;
+	goto st7;
+tr3:
+#line 488 "ext/fastcsv/fastcsv.rl"
+	{
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
+    }
+
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
+    }
+    in_quoted_field = false;
+
+    if (column) {
+      END_ROW;
+    }
+  }
+#line 534 "ext/fastcsv/fastcsv.rl"
+	{te = p+1;}
+	goto st7;
 tr5:
-#line 52 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
+	{
+    if (in_quoted_field) {
+      READ_QUOTED;
+    }
+
+    PUSH_FIELD;
+    field = Qnil;
+    in_quoted_field = false;
+  }
+#line 532 "ext/fastcsv/fastcsv.rl"
+	{te = p+1;}
+	goto st7;
+tr6:
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
-    if (p == ts) {
+    if (in_quoted_field) {
+      READ_QUOTED;
+    }
+
+    PUSH_FIELD;
+    field = Qnil;
+    in_quoted_field = false;
+  }
+#line 532 "ext/fastcsv/fastcsv.rl"
+	{te = p+1;}
+#line 488 "ext/fastcsv/fastcsv.rl"
+	{
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
+    }
+
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
+    }
+    in_quoted_field = false;
+
+    if (column) {
+      END_ROW;
+    }
+  }
+	goto st7;
+tr22:
+#line 365 "ext/fastcsv/fastcsv.rl"
+	{
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
       // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
     }
   }
-#line 122 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (column) {
+      END_ROW;
     }
   }
-#line 154 "ext/fastcsv/fastcsv.rl"
+#line 534 "ext/fastcsv/fastcsv.rl"
 	{te = p+1;}
-	goto st4;
-tr6:
-#line 52 "ext/fastcsv/fastcsv.rl"
+	goto st7;
+tr23:
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (p == ts) {
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
       // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
     }
   }
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{te = p+1;}
-	goto st4;
-tr7:
-#line 52 "ext/fastcsv/fastcsv.rl"
+	goto st7;
+tr24:
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (p == ts) {
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
       // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
     }
   }
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{te = p+1;}
-#line 122 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (column) {
+      END_ROW;
     }
   }
-	goto st4;
-tr12:
-#line 122 "ext/fastcsv/fastcsv.rl"
+	goto st7;
+tr31:
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
+      field = Qnil;
+    }
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
     }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
+      ENCODE;
+    }
+  }
+#line 488 "ext/fastcsv/fastcsv.rl"
+	{
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (column) {
+      END_ROW;
     }
   }
-#line 154 "ext/fastcsv/fastcsv.rl"
+#line 534 "ext/fastcsv/fastcsv.rl"
 	{te = p+1;}
-	goto st4;
-tr18:
-#line 67 "ext/fastcsv/fastcsv.rl"
+	goto st7;
+tr32:
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
+      field = Qnil;
+    }
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
-      in_quoted_field = false;
+    }
+  }
+#line 421 "ext/fastcsv/fastcsv.rl"
+	{
+    if (in_quoted_field) {
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{te = p+1;}
-	goto st4;
-tr19:
-#line 67 "ext/fastcsv/fastcsv.rl"
+	goto st7;
+tr33:
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
+      field = Qnil;
+    }
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
-      in_quoted_field = false;
+    }
+  }
+#line 421 "ext/fastcsv/fastcsv.rl"
+	{
+    if (in_quoted_field) {
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{te = p+1;}
-#line 122 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (column) {
+      END_ROW;
     }
   }
-	goto st4;
-tr36:
-#line 154 "ext/fastcsv/fastcsv.rl"
-	{te = p;p--;}
-	goto st4;
-tr37:
-#line 78 "ext/fastcsv/fastcsv.rl"
+	goto st7;
+tr53:
+#line 431 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
+    start = p;
 
-    if (len_row_sep) {
+    if (stopped) {
+      // A sink stopped parsing, so the rest of the chunk is ignored.
+    }
+    else if (len_row_sep) {
       if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
         FREE;
 
@@ -576,9 +2607,15 @@ tr37:
       len_row_sep = p - mark_row_sep;
       row_sep = ALLOC_N(char, len_row_sep);
       memcpy(row_sep, mark_row_sep, len_row_sep);
+      s->row_sep = row_sep;
     }
 
     curline++;
+
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
+    }
   }
 #line 1 "NONE"
 	{	switch( act ) {
@@ -590,13 +2627,20 @@ tr37:
 	break;
 	}
 	}
-	goto st4;
-tr43:
-#line 78 "ext/fastcsv/fastcsv.rl"
+	goto st7;
+tr57:
+#line 534 "ext/fastcsv/fastcsv.rl"
+	{te = p;p--;}
+	goto st7;
+tr60:
+#line 431 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
+    start = p;
 
-    if (len_row_sep) {
+    if (stopped) {
+      // A sink stopped parsing, so the rest of the chunk is ignored.
+    }
+    else if (len_row_sep) {
       if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
         FREE;
 
@@ -607,23 +2651,32 @@ tr43:
       len_row_sep = p - mark_row_sep;
       row_sep = ALLOC_N(char, len_row_sep);
       memcpy(row_sep, mark_row_sep, len_row_sep);
+      s->row_sep = row_sep;
     }
 
     curline++;
+
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
+    }
   }
-#line 153 "ext/fastcsv/fastcsv.rl"
+#line 533 "ext/fastcsv/fastcsv.rl"
 	{te = p;p--;}
-	goto st4;
-tr44:
-#line 153 "ext/fastcsv/fastcsv.rl"
+	goto st7;
+tr61:
+#line 533 "ext/fastcsv/fastcsv.rl"
 	{te = p;p--;}
-	goto st4;
-tr45:
-#line 78 "ext/fastcsv/fastcsv.rl"
+	goto st7;
+tr62:
+#line 431 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
+    start = p;
 
-    if (len_row_sep) {
+    if (stopped) {
+      // A sink stopped parsing, so the rest of the chunk is ignored.
+    }
+    else if (len_row_sep) {
       if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
         FREE;
 
@@ -634,49 +2687,57 @@ tr45:
       len_row_sep = p - mark_row_sep;
       row_sep = ALLOC_N(char, len_row_sep);
       memcpy(row_sep, mark_row_sep, len_row_sep);
+      s->row_sep = row_sep;
     }
 
     curline++;
+
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
+    }
   }
-#line 122 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (column) {
+      END_ROW;
     }
   }
-#line 154 "ext/fastcsv/fastcsv.rl"
+#line 534 "ext/fastcsv/fastcsv.rl"
 	{te = p+1;}
-	goto st4;
-tr51:
-#line 67 "ext/fastcsv/fastcsv.rl"
+	goto st7;
+tr64:
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{te = p+1;}
-#line 78 "ext/fastcsv/fastcsv.rl"
+#line 431 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
+    start = p;
 
-    if (len_row_sep) {
+    if (stopped) {
+      // A sink stopped parsing, so the rest of the chunk is ignored.
+    }
+    else if (len_row_sep) {
       if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
         FREE;
 
@@ -687,30 +2748,38 @@ tr51:
       len_row_sep = p - mark_row_sep;
       row_sep = ALLOC_N(char, len_row_sep);
       memcpy(row_sep, mark_row_sep, len_row_sep);
+      s->row_sep = row_sep;
     }
 
     curline++;
+
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
+    }
   }
-	goto st4;
-tr52:
-#line 67 "ext/fastcsv/fastcsv.rl"
+	goto st7;
+tr65:
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{te = p+1;}
-#line 78 "ext/fastcsv/fastcsv.rl"
+#line 431 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
+    start = p;
 
-    if (len_row_sep) {
+    if (stopped) {
+      // A sink stopped parsing, so the rest of the chunk is ignored.
+    }
+    else if (len_row_sep) {
       if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
         FREE;
 
@@ -721,822 +2790,1410 @@ tr52:
       len_row_sep = p - mark_row_sep;
       row_sep = ALLOC_N(char, len_row_sep);
       memcpy(row_sep, mark_row_sep, len_row_sep);
+      s->row_sep = row_sep;
+    }
+
+    curline++;
+
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
+    }
+  }
+#line 488 "ext/fastcsv/fastcsv.rl"
+	{
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
+    }
+    in_quoted_field = false;
+
+    if (column) {
+      END_ROW;
+    }
+  }
+	goto st7;
+tr73:
+#line 459 "ext/fastcsv/fastcsv.rl"
+	{
+    start = p;
+    skip_row = false;
     curline++;
+
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
+    }
+  }
+#line 535 "ext/fastcsv/fastcsv.rl"
+	{te = p;p--;}
+	goto st7;
+st7:
+#line 1 "NONE"
+	{ts = 0;}
+#line 1 "NONE"
+	{act = 0;}
+	if ( ++p == pe )
+		goto _test_eof7;
+case 7:
+#line 1 "NONE"
+	{ts = p;}
+#line 2847 "ext/fastcsv/fastcsv.c"
+	_widec = (*p);
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(3712 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+			}
+		} else {
+			_widec = (short)(12928 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+			if ( 
+#line 519 "ext/fastcsv/fastcsv.rl"
+ comment_char && (*p) == comment_char && p == ts && !column  ) _widec += 2048;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(12928 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+				if ( 
+#line 519 "ext/fastcsv/fastcsv.rl"
+ comment_char && (*p) == comment_char && p == ts && !column  ) _widec += 2048;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(3712 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+		}
+	} else {
+		_widec = (short)(12928 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+		if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+		if ( 
+#line 519 "ext/fastcsv/fastcsv.rl"
+ comment_char && (*p) == comment_char && p == ts && !column  ) _widec += 2048;
+	}
+	switch( _widec ) {
+		case 3850: goto tr34;
+		case 3853: goto tr35;
+		case 4106: goto tr38;
+		case 4109: goto tr39;
+		case 4362: goto tr36;
+		case 4365: goto tr37;
+		case 4618: goto tr40;
+		case 4621: goto tr41;
+		case 4874: goto st5;
+		case 4877: goto st5;
+		case 5130: goto tr42;
+		case 5133: goto tr42;
+		case 5386: goto tr32;
+		case 5389: goto tr32;
+		case 5642: goto tr43;
+		case 5645: goto tr43;
+		case 13056: goto tr49;
+		case 13312: goto tr44;
+		case 13568: goto tr33;
+		case 13824: goto tr45;
+		case 14080: goto tr50;
+		case 14336: goto tr44;
+		case 14592: goto tr33;
+		case 14848: goto tr45;
+		case 15104: goto tr52;
+		case 15360: goto tr44;
+		case 15616: goto tr33;
+		case 15872: goto tr45;
+		case 16128: goto tr50;
+		case 16384: goto tr44;
+		case 16640: goto tr33;
+		case 16896: goto tr45;
+	}
+	if ( _widec < 14862 ) {
+		if ( _widec < 13838 ) {
+			if ( _widec < 13326 ) {
+				if ( _widec < 13070 ) {
+					if ( _widec > 13065 ) {
+						if ( 13067 <= _widec && _widec <= 13068 )
+							goto st5;
+					} else if ( _widec >= 12928 )
+						goto st5;
+				} else if ( _widec > 13183 ) {
+					if ( _widec > 13321 ) {
+						if ( 13323 <= _widec && _widec <= 13324 )
+							goto tr42;
+					} else if ( _widec >= 13184 )
+						goto tr42;
+				} else
+					goto st5;
+			} else if ( _widec > 13439 ) {
+				if ( _widec < 13582 ) {
+					if ( _widec > 13577 ) {
+						if ( 13579 <= _widec && _widec <= 13580 )
+							goto tr32;
+					} else if ( _widec >= 13440 )
+						goto tr32;
+				} else if ( _widec > 13695 ) {
+					if ( _widec > 13833 ) {
+						if ( 13835 <= _widec && _widec <= 13836 )
+							goto tr43;
+					} else if ( _widec >= 13696 )
+						goto tr43;
+				} else
+					goto tr32;
+			} else
+				goto tr42;
+		} else if ( _widec > 13951 ) {
+			if ( _widec < 14350 ) {
+				if ( _widec < 14094 ) {
+					if ( _widec > 14089 ) {
+						if ( 14091 <= _widec && _widec <= 14092 )
+							goto st6;
+					} else if ( _widec >= 13952 )
+						goto st6;
+				} else if ( _widec > 14207 ) {
+					if ( _widec > 14345 ) {
+						if ( 14347 <= _widec && _widec <= 14348 )
+							goto tr42;
+					} else if ( _widec >= 14208 )
+						goto tr42;
+				} else
+					goto st6;
+			} else if ( _widec > 14463 ) {
+				if ( _widec < 14606 ) {
+					if ( _widec > 14601 ) {
+						if ( 14603 <= _widec && _widec <= 14604 )
+							goto tr32;
+					} else if ( _widec >= 14464 )
+						goto tr32;
+				} else if ( _widec > 14719 ) {
+					if ( _widec > 14857 ) {
+						if ( 14859 <= _widec && _widec <= 14860 )
+							goto tr43;
+					} else if ( _widec >= 14720 )
+						goto tr43;
+				} else
+					goto tr32;
+			} else
+				goto tr42;
+		} else
+			goto tr43;
+	} else if ( _widec > 14975 ) {
+		if ( _widec < 15886 ) {
+			if ( _widec < 15374 ) {
+				if ( _widec < 15118 ) {
+					if ( _widec > 15113 ) {
+						if ( 15115 <= _widec && _widec <= 15116 )
+							goto tr51;
+					} else if ( _widec >= 14976 )
+						goto tr51;
+				} else if ( _widec > 15231 ) {
+					if ( _widec > 15369 ) {
+						if ( 15371 <= _widec && _widec <= 15372 )
+							goto tr42;
+					} else if ( _widec >= 15232 )
+						goto tr42;
+				} else
+					goto tr51;
+			} else if ( _widec > 15487 ) {
+				if ( _widec < 15630 ) {
+					if ( _widec > 15625 ) {
+						if ( 15627 <= _widec && _widec <= 15628 )
+							goto tr32;
+					} else if ( _widec >= 15488 )
+						goto tr32;
+				} else if ( _widec > 15743 ) {
+					if ( _widec > 15881 ) {
+						if ( 15883 <= _widec && _widec <= 15884 )
+							goto tr43;
+					} else if ( _widec >= 15744 )
+						goto tr43;
+				} else
+					goto tr32;
+			} else
+				goto tr42;
+		} else if ( _widec > 15999 ) {
+			if ( _widec < 16398 ) {
+				if ( _widec < 16142 ) {
+					if ( _widec > 16137 ) {
+						if ( 16139 <= _widec && _widec <= 16140 )
+							goto st6;
+					} else if ( _widec >= 16000 )
+						goto st6;
+				} else if ( _widec > 16255 ) {
+					if ( _widec > 16393 ) {
+						if ( 16395 <= _widec && _widec <= 16396 )
+							goto tr42;
+					} else if ( _widec >= 16256 )
+						goto tr42;
+				} else
+					goto st6;
+			} else if ( _widec > 16511 ) {
+				if ( _widec < 16654 ) {
+					if ( _widec > 16649 ) {
+						if ( 16651 <= _widec && _widec <= 16652 )
+							goto tr32;
+					} else if ( _widec >= 16512 )
+						goto tr32;
+				} else if ( _widec > 16767 ) {
+					if ( _widec < 16907 ) {
+						if ( 16768 <= _widec && _widec <= 16905 )
+							goto tr43;
+					} else if ( _widec > 16908 ) {
+						if ( 16910 <= _widec && _widec <= 17023 )
+							goto tr43;
+					} else
+						goto tr43;
+				} else
+					goto tr32;
+			} else
+				goto tr42;
+		} else
+			goto tr43;
+	} else
+		goto tr43;
+	goto st0;
+st0:
+cs = 0;
+	goto _out;
+tr12:
+#line 1 "NONE"
+	{te = p+1;}
+#line 470 "ext/fastcsv/fastcsv.rl"
+	{
+    mark_row_sep = p;
+
+    SET_ROW;
+
+    if (in_quoted_field) {
+      READ_QUOTED;
+    }
+
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
+      field = Qnil;
+    }
+    in_quoted_field = false;
+
+    END_ROW;
+  }
+#line 533 "ext/fastcsv/fastcsv.rl"
+	{act = 2;}
+	goto st8;
+tr16:
+#line 1 "NONE"
+	{te = p+1;}
+#line 421 "ext/fastcsv/fastcsv.rl"
+	{
+    if (in_quoted_field) {
+      READ_QUOTED;
+    }
+
+    PUSH_FIELD;
+    field = Qnil;
+    in_quoted_field = false;
+  }
+#line 532 "ext/fastcsv/fastcsv.rl"
+	{act = 1;}
+#line 470 "ext/fastcsv/fastcsv.rl"
+	{
+    mark_row_sep = p;
+
+    SET_ROW;
+
+    if (in_quoted_field) {
+      READ_QUOTED;
+    }
+
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
+      field = Qnil;
+    }
+    in_quoted_field = false;
+
+    END_ROW;
+  }
+	goto st8;
+tr25:
+#line 1 "NONE"
+	{te = p+1;}
+#line 365 "ext/fastcsv/fastcsv.rl"
+	{
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
+      field = Qnil;
+    }
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
+      ENCODE;
+    }
   }
-#line 122 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    mark_row_sep = p;
+
+    SET_ROW;
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    if (in_quoted_field) {
+      READ_QUOTED;
     }
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
+      field = Qnil;
     }
+    in_quoted_field = false;
+
+    END_ROW;
   }
-	goto st4;
-st4:
-#line 1 "NONE"
-	{ts = 0;}
-#line 1 "NONE"
-	{act = 0;}
-	if ( ++p == pe )
-		goto _test_eof4;
-case 4:
-#line 1 "NONE"
-	{ts = p;}
-#line 757 "ext/fastcsv/fastcsv.c"
-	_widec = (*p);
-	_widec = (short)(1152 + ((*p) - -128));
-	if ( 
-#line 140 "ext/fastcsv/fastcsv.rl"
- (*p) == quote_char  ) _widec += 256;
-	if ( 
-#line 141 "ext/fastcsv/fastcsv.rl"
- (*p) == col_sep  ) _widec += 512;
-	switch( _widec ) {
-		case 1280: goto tr27;
-		case 1290: goto tr3;
-		case 1293: goto tr4;
-		case 1536: goto tr29;
-		case 1546: goto tr30;
-		case 1549: goto tr31;
-		case 1792: goto tr7;
-		case 1802: goto tr8;
-		case 1805: goto tr9;
-		case 2048: goto tr33;
-		case 2058: goto tr34;
-		case 2061: goto tr35;
-	}
-	if ( _widec < 1408 ) {
-		if ( 1152 <= _widec && _widec <= 1407 )
-			goto st1;
-	} else if ( _widec > 1663 ) {
-		if ( _widec > 1919 ) {
-			if ( 1920 <= _widec && _widec <= 2175 )
-				goto tr32;
-		} else if ( _widec >= 1664 )
-			goto tr6;
-	} else
-		goto tr28;
-	goto st0;
-st0:
-cs = 0;
-	goto _out;
-st1:
-	if ( ++p == pe )
-		goto _test_eof1;
-case 1:
-	_widec = (*p);
-	_widec = (short)(1152 + ((*p) - -128));
-	if ( 
-#line 140 "ext/fastcsv/fastcsv.rl"
- (*p) == quote_char  ) _widec += 256;
-	if ( 
-#line 141 "ext/fastcsv/fastcsv.rl"
- (*p) == col_sep  ) _widec += 512;
-	switch( _widec ) {
-		case 1280: goto tr2;
-		case 1290: goto tr3;
-		case 1293: goto tr4;
-		case 1536: goto tr5;
-		case 1546: goto tr3;
-		case 1549: goto tr4;
-		case 1792: goto tr7;
-		case 1802: goto tr8;
-		case 1805: goto tr9;
-		case 2048: goto tr7;
-		case 2058: goto tr8;
-		case 2061: goto tr9;
-	}
-	if ( _widec > 1407 ) {
-		if ( 1664 <= _widec && _widec <= 2175 )
-			goto tr6;
-	} else if ( _widec >= 1152 )
-		goto st1;
-	goto tr0;
-tr2:
+#line 533 "ext/fastcsv/fastcsv.rl"
+	{act = 2;}
+	goto st8;
+tr27:
 #line 1 "NONE"
 	{te = p+1;}
-#line 52 "ext/fastcsv/fastcsv.rl"
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (p == ts) {
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
       // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
     }
   }
-#line 122 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    if (in_quoted_field) {
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    PUSH_FIELD;
+    field = Qnil;
+    in_quoted_field = false;
+  }
+#line 532 "ext/fastcsv/fastcsv.rl"
+	{act = 1;}
+#line 470 "ext/fastcsv/fastcsv.rl"
+	{
+    mark_row_sep = p;
+
+    SET_ROW;
+
+    if (in_quoted_field) {
+      READ_QUOTED;
     }
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
+      field = Qnil;
     }
+    in_quoted_field = false;
+
+    END_ROW;
   }
-#line 154 "ext/fastcsv/fastcsv.rl"
-	{act = 3;}
-	goto st5;
-st5:
-	if ( ++p == pe )
-		goto _test_eof5;
-case 5:
-#line 865 "ext/fastcsv/fastcsv.c"
-	_widec = (*p);
-	_widec = (short)(1152 + ((*p) - -128));
-	if ( 
-#line 140 "ext/fastcsv/fastcsv.rl"
- (*p) == quote_char  ) _widec += 256;
-	if ( 
-#line 141 "ext/fastcsv/fastcsv.rl"
- (*p) == col_sep  ) _widec += 512;
-	switch( _widec ) {
-		case 1280: goto tr2;
-		case 1290: goto tr3;
-		case 1293: goto tr4;
-		case 1536: goto tr5;
-		case 1546: goto tr3;
-		case 1549: goto tr4;
-		case 1792: goto tr7;
-		case 1802: goto tr8;
-		case 1805: goto tr9;
-		case 2048: goto tr7;
-		case 2058: goto tr8;
-		case 2061: goto tr9;
-	}
-	if ( _widec > 1407 ) {
-		if ( 1664 <= _widec && _widec <= 2175 )
-			goto tr6;
-	} else if ( _widec >= 1152 )
-		goto st1;
-	goto tr36;
-tr3:
+	goto st8;
+tr34:
 #line 1 "NONE"
 	{te = p+1;}
-#line 52 "ext/fastcsv/fastcsv.rl"
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (p == ts) {
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
       // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
     }
   }
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-#line 153 "ext/fastcsv/fastcsv.rl"
+#line 533 "ext/fastcsv/fastcsv.rl"
 	{act = 2;}
-	goto st6;
-tr8:
+	goto st8;
+tr36:
 #line 1 "NONE"
 	{te = p+1;}
-#line 52 "ext/fastcsv/fastcsv.rl"
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (p == ts) {
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
       // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
     }
   }
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{act = 1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-	goto st6;
+	goto st8;
+tr54:
+#line 1 "NONE"
+	{te = p+1;}
+#line 533 "ext/fastcsv/fastcsv.rl"
+	{act = 2;}
+	goto st8;
+st8:
+	if ( ++p == pe )
+		goto _test_eof8;
+case 8:
+#line 3479 "ext/fastcsv/fastcsv.c"
+	_widec = (*p);
+	if ( (*p) > 10 ) {
+		if ( 13 <= (*p) && (*p) <= 13 ) {
+			_widec = (short)(128 + ((*p) - -128));
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 256;
+		}
+	} else if ( (*p) >= 10 ) {
+		_widec = (short)(128 + ((*p) - -128));
+		if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 256;
+	}
+	goto tr53;
 tr13:
 #line 1 "NONE"
 	{te = p+1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-#line 153 "ext/fastcsv/fastcsv.rl"
+#line 533 "ext/fastcsv/fastcsv.rl"
 	{act = 2;}
-	goto st6;
-tr20:
+	goto st9;
+tr17:
 #line 1 "NONE"
 	{te = p+1;}
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{act = 1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-	goto st6;
-tr38:
-#line 1 "NONE"
-	{te = p+1;}
-#line 153 "ext/fastcsv/fastcsv.rl"
-	{act = 2;}
-	goto st6;
-tr46:
+	goto st9;
+tr26:
 #line 1 "NONE"
 	{te = p+1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    mark_row_sep = p;
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
+      field = Qnil;
+    }
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
     }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
+      ENCODE;
     }
+  }
+#line 470 "ext/fastcsv/fastcsv.rl"
+	{
+    mark_row_sep = p;
+
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-#line 78 "ext/fastcsv/fastcsv.rl"
+#line 533 "ext/fastcsv/fastcsv.rl"
+	{act = 2;}
+	goto st9;
+tr28:
+#line 1 "NONE"
+	{te = p+1;}
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
+    char *from = ts, *to = p;
 
-    if (len_row_sep) {
-      if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
-        FREE;
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
 
-        rb_raise(eError, "Unquoted fields do not allow \\r or \\n (line %d).", curline);
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
+      field = Qnil;
+    }
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
       }
     }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
     else {
-      len_row_sep = p - mark_row_sep;
-      row_sep = ALLOC_N(char, len_row_sep);
-      memcpy(row_sep, mark_row_sep, len_row_sep);
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
+      ENCODE;
     }
-
-    curline++;
   }
-#line 153 "ext/fastcsv/fastcsv.rl"
-	{act = 2;}
-	goto st6;
-tr53:
-#line 1 "NONE"
-	{te = p+1;}
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{act = 1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-#line 78 "ext/fastcsv/fastcsv.rl"
+	goto st9;
+tr35:
+#line 1 "NONE"
+	{te = p+1;}
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
-
-    if (len_row_sep) {
-      if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
-        FREE;
+    char *from = ts, *to = p;
 
-        rb_raise(eError, "Unquoted fields do not allow \\r or \\n (line %d).", curline);
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
       }
-    }
-    else {
-      len_row_sep = p - mark_row_sep;
-      row_sep = ALLOC_N(char, len_row_sep);
-      memcpy(row_sep, mark_row_sep, len_row_sep);
     }
 
-    curline++;
-  }
-	goto st6;
-st6:
-	if ( ++p == pe )
-		goto _test_eof6;
-case 6:
-#line 1183 "ext/fastcsv/fastcsv.c"
-	goto tr37;
-tr4:
-#line 1 "NONE"
-	{te = p+1;}
-#line 52 "ext/fastcsv/fastcsv.rl"
-	{
-    if (p == ts) {
+    if (to == from) {
       // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
     }
   }
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-#line 153 "ext/fastcsv/fastcsv.rl"
+#line 533 "ext/fastcsv/fastcsv.rl"
 	{act = 2;}
-	goto st7;
-tr9:
+	goto st9;
+tr37:
 #line 1 "NONE"
 	{te = p+1;}
-#line 52 "ext/fastcsv/fastcsv.rl"
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (p == ts) {
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
       // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
     }
   }
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{act = 1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-	goto st7;
+	goto st9;
+st9:
+	if ( ++p == pe )
+		goto _test_eof9;
+case 9:
+#line 3865 "ext/fastcsv/fastcsv.c"
+	_widec = (*p);
+	if ( (*p) > 10 ) {
+		if ( 13 <= (*p) && (*p) <= 13 ) {
+			_widec = (short)(128 + ((*p) - -128));
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 256;
+		}
+	} else if ( (*p) >= 10 ) {
+		_widec = (short)(128 + ((*p) - -128));
+		if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 256;
+	}
+	if ( _widec == 266 )
+		goto tr54;
+	goto tr53;
 tr14:
 #line 1 "NONE"
 	{te = p+1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-#line 153 "ext/fastcsv/fastcsv.rl"
+#line 533 "ext/fastcsv/fastcsv.rl"
 	{act = 2;}
-	goto st7;
-tr21:
+	goto st10;
+tr18:
 #line 1 "NONE"
 	{te = p+1;}
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{act = 1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-	goto st7;
-tr47:
+	goto st10;
+tr38:
 #line 1 "NONE"
 	{te = p+1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 356 "ext/fastcsv/fastcsv.rl"
 	{
-    mark_row_sep = p;
-
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    unclosed_line = curline;
+    in_quoted_field = true;
+  }
+#line 365 "ext/fastcsv/fastcsv.rl"
+	{
+    char *from = ts, *to = p;
 
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-
-    rb_yield(row);
-    row = rb_ary_new();
-  }
-#line 78 "ext/fastcsv/fastcsv.rl"
-	{
-    d->start = p;
-
-    if (len_row_sep) {
-      if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
-        FREE;
-
-        rb_raise(eError, "Unquoted fields do not allow \\r or \\n (line %d).", curline);
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
       }
     }
-    else {
-      len_row_sep = p - mark_row_sep;
-      row_sep = ALLOC_N(char, len_row_sep);
-      memcpy(row_sep, mark_row_sep, len_row_sep);
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
     }
-
-    curline++;
-  }
-#line 153 "ext/fastcsv/fastcsv.rl"
-	{act = 2;}
-	goto st7;
-tr54:
-#line 1 "NONE"
-	{te = p+1;}
-#line 67 "ext/fastcsv/fastcsv.rl"
-	{
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
-      in_quoted_field = false;
     }
-
-    rb_ary_push(row, field);
-    field = Qnil;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
-	{act = 1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-#line 78 "ext/fastcsv/fastcsv.rl"
+#line 533 "ext/fastcsv/fastcsv.rl"
+	{act = 2;}
+	goto st10;
+tr40:
+#line 1 "NONE"
+	{te = p+1;}
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
-
-    if (len_row_sep) {
-      if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
-        FREE;
+    char *from = ts, *to = p;
 
-        rb_raise(eError, "Unquoted fields do not allow \\r or \\n (line %d).", curline);
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
       }
-    }
-    else {
-      len_row_sep = p - mark_row_sep;
-      row_sep = ALLOC_N(char, len_row_sep);
-      memcpy(row_sep, mark_row_sep, len_row_sep);
     }
 
-    curline++;
-  }
-	goto st7;
-st7:
-	if ( ++p == pe )
-		goto _test_eof7;
-case 7:
-#line 1468 "ext/fastcsv/fastcsv.c"
-	if ( (*p) == 10 )
-		goto tr38;
-	goto tr37;
-tr27:
-#line 1 "NONE"
-	{te = p+1;}
-#line 52 "ext/fastcsv/fastcsv.rl"
-	{
-    if (p == ts) {
+    if (to == from) {
       // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
     }
   }
-#line 122 "ext/fastcsv/fastcsv.rl"
+#line 356 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    unclosed_line = curline;
+    in_quoted_field = true;
+  }
+#line 421 "ext/fastcsv/fastcsv.rl"
+	{
+    if (in_quoted_field) {
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    PUSH_FIELD;
+    field = Qnil;
+    in_quoted_field = false;
+  }
+#line 532 "ext/fastcsv/fastcsv.rl"
+	{act = 1;}
+#line 470 "ext/fastcsv/fastcsv.rl"
+	{
+    mark_row_sep = p;
+
+    SET_ROW;
+
+    if (in_quoted_field) {
+      READ_QUOTED;
     }
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
+      field = Qnil;
     }
+    in_quoted_field = false;
+
+    END_ROW;
   }
-#line 154 "ext/fastcsv/fastcsv.rl"
-	{act = 3;}
-	goto st8;
-st8:
+	goto st10;
+tr58:
+#line 1 "NONE"
+	{te = p+1;}
+#line 533 "ext/fastcsv/fastcsv.rl"
+	{act = 2;}
+	goto st10;
+st10:
 	if ( ++p == pe )
-		goto _test_eof8;
-case 8:
-#line 1510 "ext/fastcsv/fastcsv.c"
+		goto _test_eof10;
+case 10:
+#line 4115 "ext/fastcsv/fastcsv.c"
 	_widec = (*p);
-	_widec = (short)(1152 + ((*p) - -128));
-	if ( 
-#line 140 "ext/fastcsv/fastcsv.rl"
- (*p) == quote_char  ) _widec += 256;
-	if ( 
-#line 141 "ext/fastcsv/fastcsv.rl"
- (*p) == col_sep  ) _widec += 512;
-	if ( _widec < 1291 ) {
-		if ( 1152 <= _widec && _widec <= 1289 )
-			goto st1;
-	} else if ( _widec > 1292 ) {
-		if ( 1294 <= _widec && _widec <= 1407 )
-			goto st1;
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(1152 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 512;
+			}
+		} else {
+			_widec = (short)(640 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(640 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(1152 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 512;
+		}
+	} else {
+		_widec = (short)(640 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+	}
+	switch( _widec ) {
+		case 778: goto tr0;
+		case 781: goto tr0;
+		case 1034: goto tr0;
+		case 1037: goto tr0;
+		case 1290: goto st1;
+		case 1293: goto st1;
+		case 1546: goto tr2;
+		case 1549: goto tr2;
+		case 1802: goto st1;
+		case 1805: goto st1;
+		case 2058: goto tr2;
+		case 2061: goto tr2;
+	}
+	if ( _widec < 640 ) {
+			goto tr0;
+	} else if ( _widec > 767 ) {
+		if ( _widec > 895 ) {
+			if ( 896 <= _widec && _widec <= 1151 )
+				goto tr56;
+		} else if ( _widec >= 769 )
+			goto tr55;
 	} else
-		goto st1;
-	goto tr36;
-tr28:
-#line 43 "ext/fastcsv/fastcsv.rl"
+		goto tr55;
+	goto tr53;
+tr42:
+#line 356 "ext/fastcsv/fastcsv.rl"
 	{
     unclosed_line = curline;
     in_quoted_field = true;
   }
-	goto st2;
-tr39:
-#line 78 "ext/fastcsv/fastcsv.rl"
+	goto st1;
+tr55:
+#line 431 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
+    start = p;
 
-    if (len_row_sep) {
+    if (stopped) {
+      // A sink stopped parsing, so the rest of the chunk is ignored.
+    }
+    else if (len_row_sep) {
       if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
         FREE;
 
@@ -1547,54 +4204,63 @@ tr39:
       len_row_sep = p - mark_row_sep;
       row_sep = ALLOC_N(char, len_row_sep);
       memcpy(row_sep, mark_row_sep, len_row_sep);
+      s->row_sep = row_sep;
     }
 
     curline++;
+
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
+    }
   }
-	goto st2;
-st2:
+	goto st1;
+st1:
 	if ( ++p == pe )
-		goto _test_eof2;
-case 2:
-#line 1560 "ext/fastcsv/fastcsv.c"
+		goto _test_eof1;
+case 1:
+#line 4223 "ext/fastcsv/fastcsv.c"
 	_widec = (*p);
-	_widec = (short)(128 + ((*p) - -128));
+	_widec = (short)(640 + ((*p) - -128));
 	if ( 
-#line 140 "ext/fastcsv/fastcsv.rl"
- (*p) == quote_char  ) _widec += 256;
-	if ( _widec < 257 ) {
-		if ( 128 <= _widec && _widec <= 255 )
-			goto st2;
-	} else if ( _widec > 383 ) {
-		if ( 384 <= _widec && _widec <= 639 )
-			goto tr11;
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+	if ( _widec < 769 ) {
+		if ( 640 <= _widec && _widec <= 767 )
+			goto st1;
+	} else if ( _widec > 895 ) {
+		if ( 896 <= _widec && _widec <= 1151 )
+			goto tr2;
 	} else
-		goto st2;
+		goto st1;
 	goto tr0;
-tr11:
-#line 63 "ext/fastcsv/fastcsv.rl"
+tr2:
+#line 413 "ext/fastcsv/fastcsv.rl"
 	{
-    // intentionally blank - see parse_quoted_field
+    // intentionally blank - see unescape_quoted_field
   }
-#line 48 "ext/fastcsv/fastcsv.rl"
+#line 361 "ext/fastcsv/fastcsv.rl"
 	{
     unclosed_line = 0;
   }
-	goto st3;
-tr40:
-#line 63 "ext/fastcsv/fastcsv.rl"
+	goto st2;
+tr56:
+#line 413 "ext/fastcsv/fastcsv.rl"
 	{
-    // intentionally blank - see parse_quoted_field
+    // intentionally blank - see unescape_quoted_field
   }
-#line 48 "ext/fastcsv/fastcsv.rl"
+#line 361 "ext/fastcsv/fastcsv.rl"
 	{
     unclosed_line = 0;
   }
-#line 78 "ext/fastcsv/fastcsv.rl"
+#line 431 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
+    start = p;
 
-    if (len_row_sep) {
+    if (stopped) {
+      // A sink stopped parsing, so the rest of the chunk is ignored.
+    }
+    else if (len_row_sep) {
       if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
         FREE;
 
@@ -1605,251 +4271,597 @@ tr40:
       len_row_sep = p - mark_row_sep;
       row_sep = ALLOC_N(char, len_row_sep);
       memcpy(row_sep, mark_row_sep, len_row_sep);
+      s->row_sep = row_sep;
     }
 
     curline++;
+
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
+    }
   }
-	goto st3;
-st3:
+	goto st2;
+st2:
 	if ( ++p == pe )
-		goto _test_eof3;
-case 3:
-#line 1618 "ext/fastcsv/fastcsv.c"
+		goto _test_eof2;
+case 2:
+#line 4290 "ext/fastcsv/fastcsv.c"
 	_widec = (*p);
-	_widec = (short)(1152 + ((*p) - -128));
-	if ( 
-#line 140 "ext/fastcsv/fastcsv.rl"
- (*p) == quote_char  ) _widec += 256;
-	if ( 
-#line 141 "ext/fastcsv/fastcsv.rl"
- (*p) == col_sep  ) _widec += 512;
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(24704 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+				if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+			}
+		} else {
+			_widec = (short)(20608 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+			if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(20608 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+				if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(24704 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+			if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+		}
+	} else {
+		_widec = (short)(20608 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+		if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+		if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+	}
 	switch( _widec ) {
-		case 1280: goto tr12;
-		case 1290: goto tr13;
-		case 1293: goto tr14;
-		case 1536: goto tr15;
-		case 1546: goto tr16;
-		case 1549: goto tr17;
-		case 1792: goto tr19;
-		case 1802: goto tr20;
-		case 1805: goto tr21;
-		case 2048: goto tr23;
-		case 2058: goto tr24;
-		case 2061: goto tr25;
+		case 20736: goto tr3;
+		case 20992: goto tr4;
+		case 21248: goto tr6;
+		case 21504: goto tr8;
+		case 21760: goto tr10;
+		case 22016: goto tr4;
+		case 22272: goto tr6;
+		case 22528: goto tr8;
+		case 22784: goto tr3;
+		case 23040: goto tr4;
+		case 23296: goto tr6;
+		case 23552: goto tr8;
+		case 23808: goto tr10;
+		case 24064: goto tr4;
+		case 24320: goto tr6;
+		case 24576: goto tr8;
+		case 24842: goto tr12;
+		case 24845: goto tr13;
+		case 25098: goto tr14;
+		case 25101: goto tr15;
+		case 25354: goto tr16;
+		case 25357: goto tr17;
+		case 25610: goto tr18;
+		case 25613: goto tr19;
+		case 26122: goto st1;
+		case 26125: goto st1;
+		case 26378: goto tr5;
+		case 26381: goto tr5;
+		case 26634: goto tr7;
+		case 26637: goto tr7;
+		case 26890: goto tr12;
+		case 26893: goto tr13;
+		case 27146: goto tr14;
+		case 27149: goto tr15;
+		case 27402: goto tr16;
+		case 27405: goto tr17;
+		case 27658: goto tr18;
+		case 27661: goto tr19;
+		case 28170: goto st1;
+		case 28173: goto st1;
+		case 28426: goto tr5;
+		case 28429: goto tr5;
+		case 28682: goto tr7;
+		case 28685: goto tr7;
 	}
-	if ( _widec < 1664 ) {
-		if ( 1408 <= _widec && _widec <= 1663 )
-			goto st2;
-	} else if ( _widec > 1919 ) {
-		if ( 1920 <= _widec && _widec <= 2175 )
-			goto tr22;
+	if ( _widec < 22795 ) {
+		if ( _widec < 21771 ) {
+			if ( _widec < 21259 ) {
+				if ( _widec < 21003 ) {
+					if ( 20864 <= _widec && _widec <= 21001 )
+						goto st1;
+				} else if ( _widec > 21004 ) {
+					if ( _widec > 21119 ) {
+						if ( 21120 <= _widec && _widec <= 21257 )
+							goto tr5;
+					} else if ( _widec >= 21006 )
+						goto st1;
+				} else
+					goto st1;
+			} else if ( _widec > 21260 ) {
+				if ( _widec < 21515 ) {
+					if ( _widec > 21375 ) {
+						if ( 21376 <= _widec && _widec <= 21513 )
+							goto tr7;
+					} else if ( _widec >= 21262 )
+						goto tr5;
+				} else if ( _widec > 21516 ) {
+					if ( _widec > 21631 ) {
+						if ( 21632 <= _widec && _widec <= 21769 )
+							goto st3;
+					} else if ( _widec >= 21518 )
+						goto tr7;
+				} else
+					goto tr7;
+			} else
+				goto tr5;
+		} else if ( _widec > 21772 ) {
+			if ( _widec < 22283 ) {
+				if ( _widec < 22027 ) {
+					if ( _widec > 21887 ) {
+						if ( 21888 <= _widec && _widec <= 22025 )
+							goto st1;
+					} else if ( _widec >= 21774 )
+						goto st3;
+				} else if ( _widec > 22028 ) {
+					if ( _widec > 22143 ) {
+						if ( 22144 <= _widec && _widec <= 22281 )
+							goto tr5;
+					} else if ( _widec >= 22030 )
+						goto st1;
+				} else
+					goto st1;
+			} else if ( _widec > 22284 ) {
+				if ( _widec < 22539 ) {
+					if ( _widec > 22399 ) {
+						if ( 22400 <= _widec && _widec <= 22537 )
+							goto tr7;
+					} else if ( _widec >= 22286 )
+						goto tr5;
+				} else if ( _widec > 22540 ) {
+					if ( _widec > 22655 ) {
+						if ( 22656 <= _widec && _widec <= 22793 )
+							goto tr11;
+					} else if ( _widec >= 22542 )
+						goto tr7;
+				} else
+					goto tr7;
+			} else
+				goto tr5;
+		} else
+			goto st3;
+	} else if ( _widec > 22796 ) {
+		if ( _widec < 23680 ) {
+			if ( _widec < 23168 ) {
+				if ( _widec < 22912 ) {
+					if ( 22798 <= _widec && _widec <= 22911 )
+						goto tr11;
+				} else if ( _widec > 23049 ) {
+					if ( _widec > 23052 ) {
+						if ( 23054 <= _widec && _widec <= 23167 )
+							goto st1;
+					} else if ( _widec >= 23051 )
+						goto st1;
+				} else
+					goto st1;
+			} else if ( _widec > 23305 ) {
+				if ( _widec < 23424 ) {
+					if ( _widec > 23308 ) {
+						if ( 23310 <= _widec && _widec <= 23423 )
+							goto tr5;
+					} else if ( _widec >= 23307 )
+						goto tr5;
+				} else if ( _widec > 23561 ) {
+					if ( _widec > 23564 ) {
+						if ( 23566 <= _widec && _widec <= 23679 )
+							goto tr7;
+					} else if ( _widec >= 23563 )
+						goto tr7;
+				} else
+					goto tr7;
+			} else
+				goto tr5;
+		} else if ( _widec > 23817 ) {
+			if ( _widec < 24192 ) {
+				if ( _widec < 23936 ) {
+					if ( _widec > 23820 ) {
+						if ( 23822 <= _widec && _widec <= 23935 )
+							goto st3;
+					} else if ( _widec >= 23819 )
+						goto st3;
+				} else if ( _widec > 24073 ) {
+					if ( _widec > 24076 ) {
+						if ( 24078 <= _widec && _widec <= 24191 )
+							goto st1;
+					} else if ( _widec >= 24075 )
+						goto st1;
+				} else
+					goto st1;
+			} else if ( _widec > 24329 ) {
+				if ( _widec < 24448 ) {
+					if ( _widec > 24332 ) {
+						if ( 24334 <= _widec && _widec <= 24447 )
+							goto tr5;
+					} else if ( _widec >= 24331 )
+						goto tr5;
+				} else if ( _widec > 24585 ) {
+					if ( _widec > 24588 ) {
+						if ( 24590 <= _widec && _widec <= 24703 )
+							goto tr7;
+					} else if ( _widec >= 24587 )
+						goto tr7;
+				} else
+					goto tr7;
+			} else
+				goto tr5;
+		} else
+			goto st3;
 	} else
-		goto tr18;
+		goto tr11;
 	goto tr0;
-tr15:
+tr4:
 #line 1 "NONE"
 	{te = p+1;}
-#line 122 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (column) {
+      END_ROW;
     }
   }
-#line 154 "ext/fastcsv/fastcsv.rl"
+#line 534 "ext/fastcsv/fastcsv.rl"
 	{act = 3;}
-	goto st9;
-tr22:
+	goto st11;
+tr7:
 #line 1 "NONE"
 	{te = p+1;}
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{act = 1;}
-	goto st9;
-tr23:
+	goto st11;
+tr8:
 #line 1 "NONE"
 	{te = p+1;}
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{act = 1;}
-#line 122 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
+    }
+
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    in_quoted_field = false;
+
+    if (column) {
+      END_ROW;
     }
+  }
+	goto st11;
+tr43:
+#line 1 "NONE"
+	{te = p+1;}
+#line 365 "ext/fastcsv/fastcsv.rl"
+	{
+    char *from = ts, *to = p;
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
     }
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
+      field = Qnil;
+    }
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
+      ENCODE;
     }
   }
-	goto st9;
-tr29:
+#line 356 "ext/fastcsv/fastcsv.rl"
+	{
+    unclosed_line = curline;
+    in_quoted_field = true;
+  }
+#line 421 "ext/fastcsv/fastcsv.rl"
+	{
+    if (in_quoted_field) {
+      READ_QUOTED;
+    }
+
+    PUSH_FIELD;
+    field = Qnil;
+    in_quoted_field = false;
+  }
+#line 532 "ext/fastcsv/fastcsv.rl"
+	{act = 1;}
+	goto st11;
+tr44:
 #line 1 "NONE"
 	{te = p+1;}
-#line 43 "ext/fastcsv/fastcsv.rl"
+#line 356 "ext/fastcsv/fastcsv.rl"
 	{
     unclosed_line = curline;
     in_quoted_field = true;
   }
-#line 52 "ext/fastcsv/fastcsv.rl"
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (p == ts) {
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
       // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
     }
   }
-#line 122 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (column) {
+      END_ROW;
     }
   }
-#line 154 "ext/fastcsv/fastcsv.rl"
+#line 534 "ext/fastcsv/fastcsv.rl"
 	{act = 3;}
-	goto st9;
-tr32:
+	goto st11;
+tr45:
 #line 1 "NONE"
 	{te = p+1;}
-#line 52 "ext/fastcsv/fastcsv.rl"
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (p == ts) {
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
       // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
-      ENCODE;
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
     }
-  }
-#line 43 "ext/fastcsv/fastcsv.rl"
-	{
-    unclosed_line = curline;
-    in_quoted_field = true;
-  }
-#line 67 "ext/fastcsv/fastcsv.rl"
-	{
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
     }
-
-    rb_ary_push(row, field);
-    field = Qnil;
-  }
-#line 152 "ext/fastcsv/fastcsv.rl"
-	{act = 1;}
-	goto st9;
-tr33:
-#line 1 "NONE"
-	{te = p+1;}
-#line 52 "ext/fastcsv/fastcsv.rl"
-	{
-    if (p == ts) {
-      // Unquoted empty fields are nil, not "", in Ruby.
-      field = Qnil;
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
     }
   }
-#line 43 "ext/fastcsv/fastcsv.rl"
+#line 356 "ext/fastcsv/fastcsv.rl"
 	{
     unclosed_line = curline;
     in_quoted_field = true;
   }
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{act = 1;}
-#line 122 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (column) {
+      END_ROW;
     }
   }
-	goto st9;
-tr48:
+	goto st11;
+tr63:
 #line 1 "NONE"
 	{te = p+1;}
-#line 78 "ext/fastcsv/fastcsv.rl"
+#line 431 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
+    start = p;
 
-    if (len_row_sep) {
+    if (stopped) {
+      // A sink stopped parsing, so the rest of the chunk is ignored.
+    }
+    else if (len_row_sep) {
       if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
         FREE;
 
@@ -1860,51 +4872,59 @@ tr48:
       len_row_sep = p - mark_row_sep;
       row_sep = ALLOC_N(char, len_row_sep);
       memcpy(row_sep, mark_row_sep, len_row_sep);
+      s->row_sep = row_sep;
     }
 
     curline++;
+
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
+    }
   }
-#line 122 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (column) {
+      END_ROW;
     }
   }
-#line 154 "ext/fastcsv/fastcsv.rl"
+#line 534 "ext/fastcsv/fastcsv.rl"
 	{act = 3;}
-	goto st9;
-tr55:
+	goto st11;
+tr66:
 #line 1 "NONE"
 	{te = p+1;}
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{act = 1;}
-#line 78 "ext/fastcsv/fastcsv.rl"
+#line 431 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
+    start = p;
 
-    if (len_row_sep) {
+    if (stopped) {
+      // A sink stopped parsing, so the rest of the chunk is ignored.
+    }
+    else if (len_row_sep) {
       if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
         FREE;
 
@@ -1915,32 +4935,40 @@ tr55:
       len_row_sep = p - mark_row_sep;
       row_sep = ALLOC_N(char, len_row_sep);
       memcpy(row_sep, mark_row_sep, len_row_sep);
+      s->row_sep = row_sep;
     }
 
     curline++;
+
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
+    }
   }
-	goto st9;
-tr56:
+	goto st11;
+tr67:
 #line 1 "NONE"
 	{te = p+1;}
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{act = 1;}
-#line 78 "ext/fastcsv/fastcsv.rl"
+#line 431 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
+    start = p;
 
-    if (len_row_sep) {
+    if (stopped) {
+      // A sink stopped parsing, so the rest of the chunk is ignored.
+    }
+    else if (len_row_sep) {
       if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
         FREE;
 
@@ -1951,233 +4979,331 @@ tr56:
       len_row_sep = p - mark_row_sep;
       row_sep = ALLOC_N(char, len_row_sep);
       memcpy(row_sep, mark_row_sep, len_row_sep);
+      s->row_sep = row_sep;
     }
 
     curline++;
+
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
+    }
   }
-#line 122 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    if (d->start == 0 || p == d->start) { // same as new_row
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    SET_ROW; // same as new_row
+
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) {
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    if (RARRAY_LEN(row)) {
-      rb_yield(row);
+    if (column) {
+      END_ROW;
     }
   }
-	goto st9;
-st9:
+	goto st11;
+st11:
 	if ( ++p == pe )
-		goto _test_eof9;
-case 9:
-#line 1981 "ext/fastcsv/fastcsv.c"
+		goto _test_eof11;
+case 11:
+#line 5015 "ext/fastcsv/fastcsv.c"
 	_widec = (*p);
-	_widec = (short)(128 + ((*p) - -128));
+	_widec = (short)(640 + ((*p) - -128));
 	if ( 
-#line 140 "ext/fastcsv/fastcsv.rl"
- (*p) == quote_char  ) _widec += 256;
-	if ( _widec < 257 ) {
-		if ( 128 <= _widec && _widec <= 255 )
-			goto st2;
-	} else if ( _widec > 383 ) {
-		if ( 384 <= _widec && _widec <= 639 )
-			goto tr11;
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+	if ( _widec < 769 ) {
+		if ( 640 <= _widec && _widec <= 767 )
+			goto st1;
+	} else if ( _widec > 895 ) {
+		if ( 896 <= _widec && _widec <= 1151 )
+			goto tr2;
 	} else
-		goto st2;
+		goto st1;
 	goto tr0;
-tr16:
-#line 1 "NONE"
-	{te = p+1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+tr68:
+#line 431 "ext/fastcsv/fastcsv.rl"
 	{
-    mark_row_sep = p;
-
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
-
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
-    }
-
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
-      field = Qnil;
-    }
+    start = p;
 
-    rb_yield(row);
-    row = rb_ary_new();
-  }
-#line 153 "ext/fastcsv/fastcsv.rl"
-	{act = 2;}
-	goto st10;
-tr24:
-#line 1 "NONE"
-	{te = p+1;}
-#line 67 "ext/fastcsv/fastcsv.rl"
-	{
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+    if (stopped) {
+      // A sink stopped parsing, so the rest of the chunk is ignored.
     }
+    else if (len_row_sep) {
+      if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
+        FREE;
 
-    rb_ary_push(row, field);
-    field = Qnil;
-  }
-#line 152 "ext/fastcsv/fastcsv.rl"
-	{act = 1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
-	{
-    mark_row_sep = p;
-
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
+        rb_raise(eError, "Unquoted fields do not allow \\r or \\n (line %d).", curline);
+      }
     }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    else {
+      len_row_sep = p - mark_row_sep;
+      row_sep = ALLOC_N(char, len_row_sep);
+      memcpy(row_sep, mark_row_sep, len_row_sep);
+      s->row_sep = row_sep;
     }
 
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
-    }
+    curline++;
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
-      field = Qnil;
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
     }
-
-    rb_yield(row);
-    row = rb_ary_new();
   }
-	goto st10;
-tr30:
+	goto st3;
+st3:
+	if ( ++p == pe )
+		goto _test_eof3;
+case 3:
+#line 5064 "ext/fastcsv/fastcsv.c"
+	_widec = (*p);
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(24704 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+				if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+			}
+		} else {
+			_widec = (short)(20608 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+			if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(20608 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+				if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(24704 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+			if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+		}
+	} else {
+		_widec = (short)(20608 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+		if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+		if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+	}
+	switch( _widec ) {
+		case 20736: goto tr3;
+		case 20992: goto tr3;
+		case 21248: goto tr6;
+		case 21504: goto tr6;
+		case 21760: goto tr10;
+		case 22016: goto tr3;
+		case 22272: goto tr6;
+		case 22528: goto tr6;
+		case 22784: goto tr3;
+		case 23040: goto tr3;
+		case 23296: goto tr6;
+		case 23552: goto tr6;
+		case 23808: goto tr10;
+		case 24064: goto tr3;
+		case 24320: goto tr6;
+		case 24576: goto tr6;
+		case 24842: goto tr12;
+		case 24845: goto tr13;
+		case 25098: goto tr12;
+		case 25101: goto tr13;
+		case 25354: goto tr16;
+		case 25357: goto tr17;
+		case 25610: goto tr16;
+		case 25613: goto tr17;
+		case 26378: goto tr5;
+		case 26381: goto tr5;
+		case 26634: goto tr5;
+		case 26637: goto tr5;
+		case 26890: goto tr12;
+		case 26893: goto tr13;
+		case 27146: goto tr12;
+		case 27149: goto tr13;
+		case 27402: goto tr16;
+		case 27405: goto tr17;
+		case 27658: goto tr16;
+		case 27661: goto tr17;
+		case 28426: goto tr5;
+		case 28429: goto tr5;
+		case 28682: goto tr5;
+		case 28685: goto tr5;
+	}
+	if ( _widec < 22795 ) {
+		if ( _widec < 21771 ) {
+			if ( _widec < 21262 ) {
+				if ( _widec > 21257 ) {
+					if ( 21259 <= _widec && _widec <= 21260 )
+						goto tr5;
+				} else if ( _widec >= 21120 )
+					goto tr5;
+			} else if ( _widec > 21513 ) {
+				if ( _widec < 21518 ) {
+					if ( 21515 <= _widec && _widec <= 21516 )
+						goto tr5;
+				} else if ( _widec > 21631 ) {
+					if ( 21632 <= _widec && _widec <= 21769 )
+						goto st3;
+				} else
+					goto tr5;
+			} else
+				goto tr5;
+		} else if ( _widec > 21772 ) {
+			if ( _widec < 22286 ) {
+				if ( _widec < 22144 ) {
+					if ( 21774 <= _widec && _widec <= 21887 )
+						goto st3;
+				} else if ( _widec > 22281 ) {
+					if ( 22283 <= _widec && _widec <= 22284 )
+						goto tr5;
+				} else
+					goto tr5;
+			} else if ( _widec > 22537 ) {
+				if ( _widec < 22542 ) {
+					if ( 22539 <= _widec && _widec <= 22540 )
+						goto tr5;
+				} else if ( _widec > 22655 ) {
+					if ( 22656 <= _widec && _widec <= 22793 )
+						goto tr11;
+				} else
+					goto tr5;
+			} else
+				goto tr5;
+		} else
+			goto st3;
+	} else if ( _widec > 22796 ) {
+		if ( _widec < 23680 ) {
+			if ( _widec < 23307 ) {
+				if ( _widec > 22911 ) {
+					if ( 23168 <= _widec && _widec <= 23305 )
+						goto tr5;
+				} else if ( _widec >= 22798 )
+					goto tr11;
+			} else if ( _widec > 23308 ) {
+				if ( _widec < 23563 ) {
+					if ( 23310 <= _widec && _widec <= 23561 )
+						goto tr5;
+				} else if ( _widec > 23564 ) {
+					if ( 23566 <= _widec && _widec <= 23679 )
+						goto tr5;
+				} else
+					goto tr5;
+			} else
+				goto tr5;
+		} else if ( _widec > 23817 ) {
+			if ( _widec < 24331 ) {
+				if ( _widec < 23822 ) {
+					if ( 23819 <= _widec && _widec <= 23820 )
+						goto st3;
+				} else if ( _widec > 23935 ) {
+					if ( 24192 <= _widec && _widec <= 24329 )
+						goto tr5;
+				} else
+					goto st3;
+			} else if ( _widec > 24332 ) {
+				if ( _widec < 24587 ) {
+					if ( 24334 <= _widec && _widec <= 24585 )
+						goto tr5;
+				} else if ( _widec > 24588 ) {
+					if ( 24590 <= _widec && _widec <= 24703 )
+						goto tr5;
+				} else
+					goto tr5;
+			} else
+				goto tr5;
+		} else
+			goto st3;
+	} else
+		goto tr11;
+	goto tr0;
+tr10:
 #line 1 "NONE"
 	{te = p+1;}
-#line 43 "ext/fastcsv/fastcsv.rl"
-	{
-    unclosed_line = curline;
-    in_quoted_field = true;
-  }
-#line 52 "ext/fastcsv/fastcsv.rl"
-	{
-    if (p == ts) {
-      // Unquoted empty fields are nil, not "", in Ruby.
-      field = Qnil;
-    }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
-      ENCODE;
-    }
-  }
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    mark_row_sep = p;
+    SET_ROW; // same as new_row
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
-      field = Qnil;
+    if (column) {
+      END_ROW;
     }
-
-    rb_yield(row);
-    row = rb_ary_new();
   }
-#line 153 "ext/fastcsv/fastcsv.rl"
-	{act = 2;}
-	goto st10;
-tr34:
+#line 534 "ext/fastcsv/fastcsv.rl"
+	{act = 3;}
+	goto st12;
+tr69:
 #line 1 "NONE"
 	{te = p+1;}
-#line 52 "ext/fastcsv/fastcsv.rl"
-	{
-    if (p == ts) {
-      // Unquoted empty fields are nil, not "", in Ruby.
-      field = Qnil;
-    }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
-      ENCODE;
-    }
-  }
-#line 43 "ext/fastcsv/fastcsv.rl"
-	{
-    unclosed_line = curline;
-    in_quoted_field = true;
-  }
-#line 67 "ext/fastcsv/fastcsv.rl"
-	{
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
-    }
-
-    rb_ary_push(row, field);
-    field = Qnil;
-  }
-#line 152 "ext/fastcsv/fastcsv.rl"
-	{act = 1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 431 "ext/fastcsv/fastcsv.rl"
 	{
-    mark_row_sep = p;
-
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
-
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
-    }
+    start = p;
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
-      field = Qnil;
+    if (stopped) {
+      // A sink stopped parsing, so the rest of the chunk is ignored.
     }
-
-    rb_yield(row);
-    row = rb_ary_new();
-  }
-	goto st10;
-tr41:
-#line 1 "NONE"
-	{te = p+1;}
-#line 78 "ext/fastcsv/fastcsv.rl"
-	{
-    d->start = p;
-
-    if (len_row_sep) {
+    else if (len_row_sep) {
       if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
         FREE;
 
@@ -2188,46 +5314,269 @@ tr41:
       len_row_sep = p - mark_row_sep;
       row_sep = ALLOC_N(char, len_row_sep);
       memcpy(row_sep, mark_row_sep, len_row_sep);
+      s->row_sep = row_sep;
     }
 
     curline++;
+
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
+    }
   }
-#line 153 "ext/fastcsv/fastcsv.rl"
-	{act = 2;}
-	goto st10;
-tr49:
-#line 1 "NONE"
-	{te = p+1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    mark_row_sep = p;
+    SET_ROW; // same as new_row
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
-      field = Qnil;
+    if (column) {
+      END_ROW;
     }
-
-    rb_yield(row);
-    row = rb_ary_new();
   }
-#line 78 "ext/fastcsv/fastcsv.rl"
+#line 534 "ext/fastcsv/fastcsv.rl"
+	{act = 3;}
+	goto st12;
+st12:
+	if ( ++p == pe )
+		goto _test_eof12;
+case 12:
+#line 5352 "ext/fastcsv/fastcsv.c"
+	_widec = (*p);
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(24704 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+				if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+			}
+		} else {
+			_widec = (short)(20608 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+			if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(20608 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+				if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(24704 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+			if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+		}
+	} else {
+		_widec = (short)(20608 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+		if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+		if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+	}
+	switch( _widec ) {
+		case 20736: goto tr3;
+		case 20992: goto tr3;
+		case 21248: goto tr6;
+		case 21504: goto tr6;
+		case 21760: goto tr10;
+		case 22016: goto tr3;
+		case 22272: goto tr6;
+		case 22528: goto tr6;
+		case 22784: goto tr3;
+		case 23040: goto tr3;
+		case 23296: goto tr6;
+		case 23552: goto tr6;
+		case 23808: goto tr10;
+		case 24064: goto tr3;
+		case 24320: goto tr6;
+		case 24576: goto tr6;
+		case 24842: goto tr12;
+		case 24845: goto tr13;
+		case 25098: goto tr12;
+		case 25101: goto tr13;
+		case 25354: goto tr16;
+		case 25357: goto tr17;
+		case 25610: goto tr16;
+		case 25613: goto tr17;
+		case 26378: goto tr5;
+		case 26381: goto tr5;
+		case 26634: goto tr5;
+		case 26637: goto tr5;
+		case 26890: goto tr12;
+		case 26893: goto tr13;
+		case 27146: goto tr12;
+		case 27149: goto tr13;
+		case 27402: goto tr16;
+		case 27405: goto tr17;
+		case 27658: goto tr16;
+		case 27661: goto tr17;
+		case 28426: goto tr5;
+		case 28429: goto tr5;
+		case 28682: goto tr5;
+		case 28685: goto tr5;
+	}
+	if ( _widec < 22795 ) {
+		if ( _widec < 21771 ) {
+			if ( _widec < 21262 ) {
+				if ( _widec > 21257 ) {
+					if ( 21259 <= _widec && _widec <= 21260 )
+						goto tr5;
+				} else if ( _widec >= 21120 )
+					goto tr5;
+			} else if ( _widec > 21513 ) {
+				if ( _widec < 21518 ) {
+					if ( 21515 <= _widec && _widec <= 21516 )
+						goto tr5;
+				} else if ( _widec > 21631 ) {
+					if ( 21632 <= _widec && _widec <= 21769 )
+						goto st3;
+				} else
+					goto tr5;
+			} else
+				goto tr5;
+		} else if ( _widec > 21772 ) {
+			if ( _widec < 22286 ) {
+				if ( _widec < 22144 ) {
+					if ( 21774 <= _widec && _widec <= 21887 )
+						goto st3;
+				} else if ( _widec > 22281 ) {
+					if ( 22283 <= _widec && _widec <= 22284 )
+						goto tr5;
+				} else
+					goto tr5;
+			} else if ( _widec > 22537 ) {
+				if ( _widec < 22542 ) {
+					if ( 22539 <= _widec && _widec <= 22540 )
+						goto tr5;
+				} else if ( _widec > 22655 ) {
+					if ( 22656 <= _widec && _widec <= 22793 )
+						goto tr11;
+				} else
+					goto tr5;
+			} else
+				goto tr5;
+		} else
+			goto st3;
+	} else if ( _widec > 22796 ) {
+		if ( _widec < 23680 ) {
+			if ( _widec < 23307 ) {
+				if ( _widec > 22911 ) {
+					if ( 23168 <= _widec && _widec <= 23305 )
+						goto tr5;
+				} else if ( _widec >= 22798 )
+					goto tr11;
+			} else if ( _widec > 23308 ) {
+				if ( _widec < 23563 ) {
+					if ( 23310 <= _widec && _widec <= 23561 )
+						goto tr5;
+				} else if ( _widec > 23564 ) {
+					if ( 23566 <= _widec && _widec <= 23679 )
+						goto tr5;
+				} else
+					goto tr5;
+			} else
+				goto tr5;
+		} else if ( _widec > 23817 ) {
+			if ( _widec < 24331 ) {
+				if ( _widec < 23822 ) {
+					if ( 23819 <= _widec && _widec <= 23820 )
+						goto st3;
+				} else if ( _widec > 23935 ) {
+					if ( 24192 <= _widec && _widec <= 24329 )
+						goto tr5;
+				} else
+					goto st3;
+			} else if ( _widec > 24332 ) {
+				if ( _widec < 24587 ) {
+					if ( 24334 <= _widec && _widec <= 24585 )
+						goto tr5;
+				} else if ( _widec > 24588 ) {
+					if ( 24590 <= _widec && _widec <= 24703 )
+						goto tr5;
+				} else
+					goto tr5;
+			} else
+				goto tr5;
+		} else
+			goto st3;
+	} else
+		goto tr11;
+	goto tr57;
+tr11:
+#line 417 "ext/fastcsv/fastcsv.rl"
+	{
+    in_quoted_field = false;
+  }
+	goto st4;
+tr70:
+#line 417 "ext/fastcsv/fastcsv.rl"
+	{
+    in_quoted_field = false;
+  }
+#line 431 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
+    start = p;
 
-    if (len_row_sep) {
+    if (stopped) {
+      // A sink stopped parsing, so the rest of the chunk is ignored.
+    }
+    else if (len_row_sep) {
       if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
         FREE;
 
@@ -2238,517 +5587,2111 @@ tr49:
       len_row_sep = p - mark_row_sep;
       row_sep = ALLOC_N(char, len_row_sep);
       memcpy(row_sep, mark_row_sep, len_row_sep);
+      s->row_sep = row_sep;
     }
 
     curline++;
+
+    if (!NIL_P(s->skip_lines)) {
+      skip_pos = 0;
+      MATCH_PREFIX(p);
+    }
   }
-#line 153 "ext/fastcsv/fastcsv.rl"
-	{act = 2;}
-	goto st10;
-tr57:
+	goto st4;
+st4:
+	if ( ++p == pe )
+		goto _test_eof4;
+case 4:
+#line 5606 "ext/fastcsv/fastcsv.c"
+	_widec = (*p);
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(3712 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+			}
+		} else {
+			_widec = (short)(2688 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(2688 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(3712 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+		}
+	} else {
+		_widec = (short)(2688 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+	}
+	switch( _widec ) {
+		case 2816: goto tr21;
+		case 3072: goto tr22;
+		case 3328: goto tr24;
+		case 3584: goto tr24;
+		case 3850: goto tr25;
+		case 3853: goto tr26;
+		case 4106: goto tr25;
+		case 4109: goto tr26;
+		case 4362: goto tr27;
+		case 4365: goto tr28;
+		case 4618: goto tr27;
+		case 4621: goto tr28;
+		case 4874: goto st4;
+		case 4877: goto st4;
+		case 5386: goto tr23;
+		case 5389: goto tr23;
+		case 5642: goto tr23;
+		case 5645: goto tr23;
+	}
+	if ( _widec < 3200 ) {
+		if ( _widec < 2827 ) {
+			if ( 2688 <= _widec && _widec <= 2825 )
+				goto st4;
+		} else if ( _widec > 2828 ) {
+			if ( 2830 <= _widec && _widec <= 2943 )
+				goto st4;
+		} else
+			goto st4;
+	} else if ( _widec > 3337 ) {
+		if ( _widec < 3342 ) {
+			if ( 3339 <= _widec && _widec <= 3340 )
+				goto tr23;
+		} else if ( _widec > 3593 ) {
+			if ( _widec > 3596 ) {
+				if ( 3598 <= _widec && _widec <= 3711 )
+					goto tr23;
+			} else if ( _widec >= 3595 )
+				goto tr23;
+		} else
+			goto tr23;
+	} else
+		goto tr23;
+	goto tr0;
+tr21:
 #line 1 "NONE"
 	{te = p+1;}
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
-    }
+    char *from = ts, *to = p;
 
-    rb_ary_push(row, field);
-    field = Qnil;
-  }
-#line 152 "ext/fastcsv/fastcsv.rl"
-	{act = 1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
-	{
-    mark_row_sep = p;
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
+      field = Qnil;
+    }
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
     }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
     }
-
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
-      in_quoted_field = false;
     }
-
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
-      field = Qnil;
-    }
-
-    rb_yield(row);
-    row = rb_ary_new();
   }
-#line 78 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
-
-    if (len_row_sep) {
-      if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
-        FREE;
+    SET_ROW; // same as new_row
 
-        rb_raise(eError, "Unquoted fields do not allow \\r or \\n (line %d).", curline);
-      }
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
-    else {
-      len_row_sep = p - mark_row_sep;
-      row_sep = ALLOC_N(char, len_row_sep);
-      memcpy(row_sep, mark_row_sep, len_row_sep);
+
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    curline++;
+    if (column) {
+      END_ROW;
+    }
   }
-	goto st10;
-st10:
+#line 534 "ext/fastcsv/fastcsv.rl"
+	{act = 3;}
+	goto st13;
+st13:
 	if ( ++p == pe )
-		goto _test_eof10;
-case 10:
-#line 2314 "ext/fastcsv/fastcsv.c"
+		goto _test_eof13;
+case 13:
+#line 5782 "ext/fastcsv/fastcsv.c"
 	_widec = (*p);
-	_widec = (short)(128 + ((*p) - -128));
-	if ( 
-#line 140 "ext/fastcsv/fastcsv.rl"
- (*p) == quote_char  ) _widec += 256;
-	if ( _widec == 256 )
-		goto tr37;
-	if ( _widec > 127 ) {
-		if ( 128 <= _widec && _widec <= 383 )
-			goto tr39;
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(3712 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+			}
+		} else {
+			_widec = (short)(2688 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(2688 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(3712 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+		}
+	} else {
+		_widec = (short)(2688 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+	}
+	switch( _widec ) {
+		case 2816: goto tr21;
+		case 3072: goto tr22;
+		case 3328: goto tr24;
+		case 3584: goto tr24;
+		case 3850: goto tr25;
+		case 3853: goto tr26;
+		case 4106: goto tr25;
+		case 4109: goto tr26;
+		case 4362: goto tr27;
+		case 4365: goto tr28;
+		case 4618: goto tr27;
+		case 4621: goto tr28;
+		case 4874: goto st4;
+		case 4877: goto st4;
+		case 5386: goto tr23;
+		case 5389: goto tr23;
+		case 5642: goto tr23;
+		case 5645: goto tr23;
+	}
+	if ( _widec < 3200 ) {
+		if ( _widec < 2827 ) {
+			if ( 2688 <= _widec && _widec <= 2825 )
+				goto st4;
+		} else if ( _widec > 2828 ) {
+			if ( 2830 <= _widec && _widec <= 2943 )
+				goto st4;
+		} else
+			goto st4;
+	} else if ( _widec > 3337 ) {
+		if ( _widec < 3342 ) {
+			if ( 3339 <= _widec && _widec <= 3340 )
+				goto tr23;
+		} else if ( _widec > 3593 ) {
+			if ( _widec > 3596 ) {
+				if ( 3598 <= _widec && _widec <= 3711 )
+					goto tr23;
+			} else if ( _widec >= 3595 )
+				goto tr23;
+		} else
+			goto tr23;
 	} else
-		goto tr0;
-	goto tr40;
-tr17:
+		goto tr23;
+	goto tr57;
+tr15:
 #line 1 "NONE"
 	{te = p+1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-#line 153 "ext/fastcsv/fastcsv.rl"
+#line 533 "ext/fastcsv/fastcsv.rl"
 	{act = 2;}
-	goto st11;
-tr25:
+	goto st14;
+tr19:
 #line 1 "NONE"
 	{te = p+1;}
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{act = 1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-	goto st11;
-tr31:
+	goto st14;
+tr39:
 #line 1 "NONE"
 	{te = p+1;}
-#line 43 "ext/fastcsv/fastcsv.rl"
+#line 356 "ext/fastcsv/fastcsv.rl"
 	{
     unclosed_line = curline;
     in_quoted_field = true;
   }
-#line 52 "ext/fastcsv/fastcsv.rl"
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (p == ts) {
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
       // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
     }
   }
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-#line 153 "ext/fastcsv/fastcsv.rl"
+#line 533 "ext/fastcsv/fastcsv.rl"
 	{act = 2;}
-	goto st11;
-tr35:
+	goto st14;
+tr41:
 #line 1 "NONE"
 	{te = p+1;}
-#line 52 "ext/fastcsv/fastcsv.rl"
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (p == ts) {
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
       // Unquoted empty fields are nil, not "", in Ruby.
       field = Qnil;
     }
-    else if (p > ts) {
-      field = rb_enc_str_new(ts, p - ts, encoding);
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
     }
   }
-#line 43 "ext/fastcsv/fastcsv.rl"
+#line 356 "ext/fastcsv/fastcsv.rl"
 	{
     unclosed_line = curline;
     in_quoted_field = true;
   }
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 421 "ext/fastcsv/fastcsv.rl"
 	{
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    rb_ary_push(row, field);
+    PUSH_FIELD;
     field = Qnil;
+    in_quoted_field = false;
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
+#line 532 "ext/fastcsv/fastcsv.rl"
 	{act = 1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 470 "ext/fastcsv/fastcsv.rl"
 	{
     mark_row_sep = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
-    }
+    SET_ROW;
 
     if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+      READ_QUOTED;
     }
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
+    if (!NIL_P(field) || column) { // same as new_field
+      PUSH_FIELD;
       field = Qnil;
     }
+    in_quoted_field = false;
 
-    rb_yield(row);
-    row = rb_ary_new();
+    END_ROW;
   }
-	goto st11;
-tr50:
+	goto st14;
+st14:
+	if ( ++p == pe )
+		goto _test_eof14;
+case 14:
+#line 6109 "ext/fastcsv/fastcsv.c"
+	_widec = (*p);
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(1152 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 512;
+			}
+		} else {
+			_widec = (short)(640 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(640 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(1152 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 512;
+		}
+	} else {
+		_widec = (short)(640 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+	}
+	switch( _widec ) {
+		case 778: goto tr0;
+		case 781: goto tr0;
+		case 1034: goto tr0;
+		case 1037: goto tr0;
+		case 1290: goto tr58;
+		case 1293: goto st1;
+		case 1546: goto tr59;
+		case 1549: goto tr2;
+		case 1802: goto st1;
+		case 1805: goto st1;
+		case 2058: goto tr2;
+		case 2061: goto tr2;
+	}
+	if ( _widec < 640 ) {
+			goto tr0;
+	} else if ( _widec > 767 ) {
+		if ( _widec > 895 ) {
+			if ( 896 <= _widec && _widec <= 1151 )
+				goto tr56;
+		} else if ( _widec >= 769 )
+			goto tr55;
+	} else
+		goto tr55;
+	goto tr53;
+tr59:
 #line 1 "NONE"
 	{te = p+1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 413 "ext/fastcsv/fastcsv.rl"
 	{
-    mark_row_sep = p;
+    // intentionally blank - see unescape_quoted_field
+  }
+#line 361 "ext/fastcsv/fastcsv.rl"
+	{
+    unclosed_line = 0;
+  }
+#line 533 "ext/fastcsv/fastcsv.rl"
+	{act = 2;}
+	goto st15;
+st15:
+	if ( ++p == pe )
+		goto _test_eof15;
+case 15:
+#line 6194 "ext/fastcsv/fastcsv.c"
+	_widec = (*p);
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(24704 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+				if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+			}
+		} else {
+			_widec = (short)(20608 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+			if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(20608 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+				if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(24704 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+			if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+		}
+	} else {
+		_widec = (short)(20608 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+		if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+		if ( 
+#line 524 "ext/fastcsv/fastcsv.rl"
+ liberal_parsing  ) _widec += 2048;
+	}
+	switch( _widec ) {
+		case 18954: goto tr61;
+		case 18957: goto tr61;
+		case 19210: goto tr61;
+		case 19213: goto tr61;
+		case 19466: goto tr61;
+		case 19469: goto tr61;
+		case 19978: goto tr61;
+		case 19981: goto tr61;
+		case 20234: goto tr61;
+		case 20237: goto tr61;
+		case 20490: goto tr61;
+		case 20493: goto tr61;
+		case 20736: goto tr62;
+		case 20992: goto tr63;
+		case 21248: goto tr65;
+		case 21504: goto tr67;
+		case 21760: goto tr69;
+		case 22016: goto tr63;
+		case 22272: goto tr65;
+		case 22528: goto tr67;
+		case 22784: goto tr62;
+		case 23040: goto tr63;
+		case 23296: goto tr65;
+		case 23552: goto tr67;
+		case 23808: goto tr69;
+		case 24064: goto tr63;
+		case 24320: goto tr65;
+		case 24576: goto tr67;
+		case 24842: goto tr12;
+		case 24845: goto tr13;
+		case 25098: goto tr14;
+		case 25101: goto tr15;
+		case 25354: goto tr16;
+		case 25357: goto tr17;
+		case 25610: goto tr18;
+		case 25613: goto tr19;
+		case 26122: goto st1;
+		case 26125: goto st1;
+		case 26378: goto tr64;
+		case 26381: goto tr64;
+		case 26634: goto tr7;
+		case 26637: goto tr7;
+		case 26890: goto tr12;
+		case 26893: goto tr13;
+		case 27146: goto tr14;
+		case 27149: goto tr15;
+		case 27402: goto tr16;
+		case 27405: goto tr17;
+		case 27658: goto tr18;
+		case 27661: goto tr19;
+		case 28170: goto st1;
+		case 28173: goto st1;
+		case 28426: goto tr64;
+		case 28429: goto tr64;
+		case 28682: goto tr7;
+		case 28685: goto tr7;
+	}
+	if ( _widec < 22656 ) {
+		if ( _widec < 21632 ) {
+			if ( _widec < 21120 ) {
+				if ( _widec < 20864 ) {
+						goto tr61;
+				} else if ( _widec > 21001 ) {
+					if ( _widec > 21004 ) {
+						if ( 21006 <= _widec && _widec <= 21119 )
+							goto tr55;
+					} else if ( _widec >= 21003 )
+						goto tr55;
+				} else
+					goto tr55;
+			} else if ( _widec > 21257 ) {
+				if ( _widec < 21376 ) {
+					if ( _widec > 21260 ) {
+						if ( 21262 <= _widec && _widec <= 21375 )
+							goto tr64;
+					} else if ( _widec >= 21259 )
+						goto tr64;
+				} else if ( _widec > 21513 ) {
+					if ( _widec > 21516 ) {
+						if ( 21518 <= _widec && _widec <= 21631 )
+							goto tr66;
+					} else if ( _widec >= 21515 )
+						goto tr66;
+				} else
+					goto tr66;
+			} else
+				goto tr64;
+		} else if ( _widec > 21769 ) {
+			if ( _widec < 22144 ) {
+				if ( _widec < 21888 ) {
+					if ( _widec > 21772 ) {
+						if ( 21774 <= _widec && _widec <= 21887 )
+							goto tr68;
+					} else if ( _widec >= 21771 )
+						goto tr68;
+				} else if ( _widec > 22025 ) {
+					if ( _widec > 22028 ) {
+						if ( 22030 <= _widec && _widec <= 22143 )
+							goto tr55;
+					} else if ( _widec >= 22027 )
+						goto tr55;
+				} else
+					goto tr55;
+			} else if ( _widec > 22281 ) {
+				if ( _widec < 22400 ) {
+					if ( _widec > 22284 ) {
+						if ( 22286 <= _widec && _widec <= 22399 )
+							goto tr64;
+					} else if ( _widec >= 22283 )
+						goto tr64;
+				} else if ( _widec > 22537 ) {
+					if ( _widec > 22540 ) {
+						if ( 22542 <= _widec && _widec <= 22655 )
+							goto tr66;
+					} else if ( _widec >= 22539 )
+						goto tr66;
+				} else
+					goto tr66;
+			} else
+				goto tr64;
+		} else
+			goto tr68;
+	} else if ( _widec > 22793 ) {
+		if ( _widec < 23680 ) {
+			if ( _widec < 23168 ) {
+				if ( _widec < 22912 ) {
+					if ( _widec > 22796 ) {
+						if ( 22798 <= _widec && _widec <= 22911 )
+							goto tr70;
+					} else if ( _widec >= 22795 )
+						goto tr70;
+				} else if ( _widec > 23049 ) {
+					if ( _widec > 23052 ) {
+						if ( 23054 <= _widec && _widec <= 23167 )
+							goto tr55;
+					} else if ( _widec >= 23051 )
+						goto tr55;
+				} else
+					goto tr55;
+			} else if ( _widec > 23305 ) {
+				if ( _widec < 23424 ) {
+					if ( _widec > 23308 ) {
+						if ( 23310 <= _widec && _widec <= 23423 )
+							goto tr64;
+					} else if ( _widec >= 23307 )
+						goto tr64;
+				} else if ( _widec > 23561 ) {
+					if ( _widec > 23564 ) {
+						if ( 23566 <= _widec && _widec <= 23679 )
+							goto tr66;
+					} else if ( _widec >= 23563 )
+						goto tr66;
+				} else
+					goto tr66;
+			} else
+				goto tr64;
+		} else if ( _widec > 23817 ) {
+			if ( _widec < 24192 ) {
+				if ( _widec < 23936 ) {
+					if ( _widec > 23820 ) {
+						if ( 23822 <= _widec && _widec <= 23935 )
+							goto tr68;
+					} else if ( _widec >= 23819 )
+						goto tr68;
+				} else if ( _widec > 24073 ) {
+					if ( _widec > 24076 ) {
+						if ( 24078 <= _widec && _widec <= 24191 )
+							goto tr55;
+					} else if ( _widec >= 24075 )
+						goto tr55;
+				} else
+					goto tr55;
+			} else if ( _widec > 24329 ) {
+				if ( _widec < 24448 ) {
+					if ( _widec > 24332 ) {
+						if ( 24334 <= _widec && _widec <= 24447 )
+							goto tr64;
+					} else if ( _widec >= 24331 )
+						goto tr64;
+				} else if ( _widec > 24585 ) {
+					if ( _widec > 24588 ) {
+						if ( 24590 <= _widec && _widec <= 24703 )
+							goto tr66;
+					} else if ( _widec >= 24587 )
+						goto tr66;
+				} else
+					goto tr66;
+			} else
+				goto tr64;
+		} else
+			goto tr68;
+	} else
+		goto tr70;
+	goto tr60;
+st5:
+	if ( ++p == pe )
+		goto _test_eof5;
+case 5:
+	_widec = (*p);
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(3712 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+			}
+		} else {
+			_widec = (short)(2688 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(2688 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(3712 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+		}
+	} else {
+		_widec = (short)(2688 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+	}
+	switch( _widec ) {
+		case 2816: goto tr30;
+		case 3072: goto tr31;
+		case 3328: goto tr33;
+		case 3584: goto tr33;
+		case 3850: goto tr34;
+		case 3853: goto tr35;
+		case 4106: goto tr34;
+		case 4109: goto tr35;
+		case 4362: goto tr36;
+		case 4365: goto tr37;
+		case 4618: goto tr36;
+		case 4621: goto tr37;
+		case 4874: goto st5;
+		case 4877: goto st5;
+		case 5386: goto tr32;
+		case 5389: goto tr32;
+		case 5642: goto tr32;
+		case 5645: goto tr32;
+	}
+	if ( _widec < 3200 ) {
+		if ( _widec < 2827 ) {
+			if ( 2688 <= _widec && _widec <= 2825 )
+				goto st5;
+		} else if ( _widec > 2828 ) {
+			if ( 2830 <= _widec && _widec <= 2943 )
+				goto st5;
+		} else
+			goto st5;
+	} else if ( _widec > 3337 ) {
+		if ( _widec < 3342 ) {
+			if ( 3339 <= _widec && _widec <= 3340 )
+				goto tr32;
+		} else if ( _widec > 3593 ) {
+			if ( _widec > 3596 ) {
+				if ( 3598 <= _widec && _widec <= 3711 )
+					goto tr32;
+			} else if ( _widec >= 3595 )
+				goto tr32;
+		} else
+			goto tr32;
+	} else
+		goto tr32;
+	goto tr0;
+tr30:
+#line 1 "NONE"
+	{te = p+1;}
+#line 365 "ext/fastcsv/fastcsv.rl"
+	{
+    char *from = ts, *to = p;
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
-    }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
     }
 
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
+      field = Qnil;
+    }
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
       ENCODE;
-      in_quoted_field = false;
     }
+  }
+#line 488 "ext/fastcsv/fastcsv.rl"
+	{
+    SET_ROW; // same as new_row
 
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
-      field = Qnil;
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
 
-    rb_yield(row);
-    row = rb_ary_new();
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
+    }
+    in_quoted_field = false;
+
+    if (column) {
+      END_ROW;
+    }
   }
-#line 78 "ext/fastcsv/fastcsv.rl"
+#line 534 "ext/fastcsv/fastcsv.rl"
+	{act = 3;}
+	goto st16;
+st16:
+	if ( ++p == pe )
+		goto _test_eof16;
+case 16:
+#line 6649 "ext/fastcsv/fastcsv.c"
+	_widec = (*p);
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(3712 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+			}
+		} else {
+			_widec = (short)(2688 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(2688 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(3712 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+		}
+	} else {
+		_widec = (short)(2688 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+	}
+	switch( _widec ) {
+		case 2816: goto tr30;
+		case 3072: goto tr31;
+		case 3328: goto tr33;
+		case 3584: goto tr33;
+		case 3850: goto tr34;
+		case 3853: goto tr35;
+		case 4106: goto tr34;
+		case 4109: goto tr35;
+		case 4362: goto tr36;
+		case 4365: goto tr37;
+		case 4618: goto tr36;
+		case 4621: goto tr37;
+		case 4874: goto st5;
+		case 4877: goto st5;
+		case 5386: goto tr32;
+		case 5389: goto tr32;
+		case 5642: goto tr32;
+		case 5645: goto tr32;
+	}
+	if ( _widec < 3200 ) {
+		if ( _widec < 2827 ) {
+			if ( 2688 <= _widec && _widec <= 2825 )
+				goto st5;
+		} else if ( _widec > 2828 ) {
+			if ( 2830 <= _widec && _widec <= 2943 )
+				goto st5;
+		} else
+			goto st5;
+	} else if ( _widec > 3337 ) {
+		if ( _widec < 3342 ) {
+			if ( 3339 <= _widec && _widec <= 3340 )
+				goto tr32;
+		} else if ( _widec > 3593 ) {
+			if ( _widec > 3596 ) {
+				if ( 3598 <= _widec && _widec <= 3711 )
+					goto tr32;
+			} else if ( _widec >= 3595 )
+				goto tr32;
+		} else
+			goto tr32;
+	} else
+		goto tr32;
+	goto tr57;
+tr49:
+#line 1 "NONE"
+	{te = p+1;}
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
+    char *from = ts, *to = p;
 
-    if (len_row_sep) {
-      if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
-        FREE;
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
 
-        rb_raise(eError, "Unquoted fields do not allow \\r or \\n (line %d).", curline);
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
+      field = Qnil;
+    }
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
       }
     }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
     else {
-      len_row_sep = p - mark_row_sep;
-      row_sep = ALLOC_N(char, len_row_sep);
-      memcpy(row_sep, mark_row_sep, len_row_sep);
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
+      ENCODE;
     }
+  }
+#line 488 "ext/fastcsv/fastcsv.rl"
+	{
+    SET_ROW; // same as new_row
 
-    curline++;
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
+    }
+
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
+    }
+    in_quoted_field = false;
+
+    if (column) {
+      END_ROW;
+    }
   }
-#line 153 "ext/fastcsv/fastcsv.rl"
-	{act = 2;}
-	goto st11;
-tr58:
+#line 534 "ext/fastcsv/fastcsv.rl"
+	{act = 3;}
+	goto st17;
+st17:
+	if ( ++p == pe )
+		goto _test_eof17;
+case 17:
+#line 6825 "ext/fastcsv/fastcsv.c"
+	_widec = (*p);
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(3712 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+			}
+		} else {
+			_widec = (short)(2688 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(2688 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(3712 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+		}
+	} else {
+		_widec = (short)(2688 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+	}
+	switch( _widec ) {
+		case 4874: goto st5;
+		case 4877: goto st5;
+	}
+	if ( _widec < 2827 ) {
+		if ( 2688 <= _widec && _widec <= 2825 )
+			goto st5;
+	} else if ( _widec > 2828 ) {
+		if ( 2830 <= _widec && _widec <= 2943 )
+			goto st5;
+	} else
+		goto st5;
+	goto tr57;
+st6:
+	if ( ++p == pe )
+		goto _test_eof6;
+case 6:
+	_widec = (*p);
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(3712 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+			}
+		} else {
+			_widec = (short)(10880 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(10880 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(3712 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+		}
+	} else {
+		_widec = (short)(10880 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+		if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+	}
+	switch( _widec ) {
+		case 3850: goto tr34;
+		case 3853: goto tr35;
+		case 4106: goto tr38;
+		case 4109: goto tr39;
+		case 4362: goto tr36;
+		case 4365: goto tr37;
+		case 4618: goto tr40;
+		case 4621: goto tr41;
+		case 4874: goto st5;
+		case 4877: goto st5;
+		case 5130: goto tr42;
+		case 5133: goto tr42;
+		case 5386: goto tr32;
+		case 5389: goto tr32;
+		case 5642: goto tr43;
+		case 5645: goto tr43;
+		case 11008: goto tr30;
+		case 11264: goto tr44;
+		case 11520: goto tr33;
+		case 11776: goto tr45;
+		case 12032: goto tr47;
+		case 12288: goto tr44;
+		case 12544: goto tr33;
+		case 12800: goto tr45;
+	}
+	if ( _widec < 11790 ) {
+		if ( _widec < 11278 ) {
+			if ( _widec < 11022 ) {
+				if ( _widec > 11017 ) {
+					if ( 11019 <= _widec && _widec <= 11020 )
+						goto st5;
+				} else if ( _widec >= 10880 )
+					goto st5;
+			} else if ( _widec > 11135 ) {
+				if ( _widec > 11273 ) {
+					if ( 11275 <= _widec && _widec <= 11276 )
+						goto tr42;
+				} else if ( _widec >= 11136 )
+					goto tr42;
+			} else
+				goto st5;
+		} else if ( _widec > 11391 ) {
+			if ( _widec < 11534 ) {
+				if ( _widec > 11529 ) {
+					if ( 11531 <= _widec && _widec <= 11532 )
+						goto tr32;
+				} else if ( _widec >= 11392 )
+					goto tr32;
+			} else if ( _widec > 11647 ) {
+				if ( _widec > 11785 ) {
+					if ( 11787 <= _widec && _widec <= 11788 )
+						goto tr43;
+				} else if ( _widec >= 11648 )
+					goto tr43;
+			} else
+				goto tr32;
+		} else
+			goto tr42;
+	} else if ( _widec > 11903 ) {
+		if ( _widec < 12302 ) {
+			if ( _widec < 12046 ) {
+				if ( _widec > 12041 ) {
+					if ( 12043 <= _widec && _widec <= 12044 )
+						goto st6;
+				} else if ( _widec >= 11904 )
+					goto st6;
+			} else if ( _widec > 12159 ) {
+				if ( _widec > 12297 ) {
+					if ( 12299 <= _widec && _widec <= 12300 )
+						goto tr42;
+				} else if ( _widec >= 12160 )
+					goto tr42;
+			} else
+				goto st6;
+		} else if ( _widec > 12415 ) {
+			if ( _widec < 12558 ) {
+				if ( _widec > 12553 ) {
+					if ( 12555 <= _widec && _widec <= 12556 )
+						goto tr32;
+				} else if ( _widec >= 12416 )
+					goto tr32;
+			} else if ( _widec > 12671 ) {
+				if ( _widec < 12811 ) {
+					if ( 12672 <= _widec && _widec <= 12809 )
+						goto tr43;
+				} else if ( _widec > 12812 ) {
+					if ( 12814 <= _widec && _widec <= 12927 )
+						goto tr43;
+				} else
+					goto tr43;
+			} else
+				goto tr32;
+		} else
+			goto tr42;
+	} else
+		goto tr43;
+	goto tr0;
+tr47:
 #line 1 "NONE"
 	{te = p+1;}
-#line 67 "ext/fastcsv/fastcsv.rl"
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
     }
 
-    rb_ary_push(row, field);
-    field = Qnil;
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
+      field = Qnil;
+    }
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
+    }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
+      ENCODE;
+    }
   }
-#line 152 "ext/fastcsv/fastcsv.rl"
-	{act = 1;}
-#line 97 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    mark_row_sep = p;
+    SET_ROW; // same as new_row
 
-    if (d->start == 0 || p == d->start) {
-      rb_ivar_set(self, s_row, rb_str_new2(""));
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
-    else if (p > d->start) {
-      rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    if (in_quoted_field) {
-      parse_quoted_field(&field, encoding, quote_char, ts + 1, p - 1);
-      ENCODE;
-      in_quoted_field = false;
+    if (column) {
+      END_ROW;
+    }
+  }
+#line 534 "ext/fastcsv/fastcsv.rl"
+	{act = 3;}
+	goto st18;
+st18:
+	if ( ++p == pe )
+		goto _test_eof18;
+case 18:
+#line 7137 "ext/fastcsv/fastcsv.c"
+	_widec = (*p);
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(3712 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+			}
+		} else {
+			_widec = (short)(10880 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(10880 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(3712 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+		}
+	} else {
+		_widec = (short)(10880 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+		if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+	}
+	switch( _widec ) {
+		case 3850: goto tr34;
+		case 3853: goto tr35;
+		case 4106: goto tr38;
+		case 4109: goto tr39;
+		case 4362: goto tr36;
+		case 4365: goto tr37;
+		case 4618: goto tr40;
+		case 4621: goto tr41;
+		case 4874: goto st5;
+		case 4877: goto st5;
+		case 5130: goto tr42;
+		case 5133: goto tr42;
+		case 5386: goto tr32;
+		case 5389: goto tr32;
+		case 5642: goto tr43;
+		case 5645: goto tr43;
+		case 11008: goto tr30;
+		case 11264: goto tr44;
+		case 11520: goto tr33;
+		case 11776: goto tr45;
+		case 12032: goto tr47;
+		case 12288: goto tr44;
+		case 12544: goto tr33;
+		case 12800: goto tr45;
+	}
+	if ( _widec < 11790 ) {
+		if ( _widec < 11278 ) {
+			if ( _widec < 11022 ) {
+				if ( _widec > 11017 ) {
+					if ( 11019 <= _widec && _widec <= 11020 )
+						goto st5;
+				} else if ( _widec >= 10880 )
+					goto st5;
+			} else if ( _widec > 11135 ) {
+				if ( _widec > 11273 ) {
+					if ( 11275 <= _widec && _widec <= 11276 )
+						goto tr42;
+				} else if ( _widec >= 11136 )
+					goto tr42;
+			} else
+				goto st5;
+		} else if ( _widec > 11391 ) {
+			if ( _widec < 11534 ) {
+				if ( _widec > 11529 ) {
+					if ( 11531 <= _widec && _widec <= 11532 )
+						goto tr32;
+				} else if ( _widec >= 11392 )
+					goto tr32;
+			} else if ( _widec > 11647 ) {
+				if ( _widec > 11785 ) {
+					if ( 11787 <= _widec && _widec <= 11788 )
+						goto tr43;
+				} else if ( _widec >= 11648 )
+					goto tr43;
+			} else
+				goto tr32;
+		} else
+			goto tr42;
+	} else if ( _widec > 11903 ) {
+		if ( _widec < 12302 ) {
+			if ( _widec < 12046 ) {
+				if ( _widec > 12041 ) {
+					if ( 12043 <= _widec && _widec <= 12044 )
+						goto st6;
+				} else if ( _widec >= 11904 )
+					goto st6;
+			} else if ( _widec > 12159 ) {
+				if ( _widec > 12297 ) {
+					if ( 12299 <= _widec && _widec <= 12300 )
+						goto tr42;
+				} else if ( _widec >= 12160 )
+					goto tr42;
+			} else
+				goto st6;
+		} else if ( _widec > 12415 ) {
+			if ( _widec < 12558 ) {
+				if ( _widec > 12553 ) {
+					if ( 12555 <= _widec && _widec <= 12556 )
+						goto tr32;
+				} else if ( _widec >= 12416 )
+					goto tr32;
+			} else if ( _widec > 12671 ) {
+				if ( _widec < 12811 ) {
+					if ( 12672 <= _widec && _widec <= 12809 )
+						goto tr43;
+				} else if ( _widec > 12812 ) {
+					if ( 12814 <= _widec && _widec <= 12927 )
+						goto tr43;
+				} else
+					goto tr43;
+			} else
+				goto tr32;
+		} else
+			goto tr42;
+	} else
+		goto tr43;
+	goto tr57;
+tr50:
+#line 1 "NONE"
+	{te = p+1;}
+#line 365 "ext/fastcsv/fastcsv.rl"
+	{
+    char *from = ts, *to = p;
+
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
+
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
+      field = Qnil;
+    }
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
+      }
     }
-
-    if (!NIL_P(field) || RARRAY_LEN(row)) { // same as new_field
-      rb_ary_push(row, field);
-      field = Qnil;
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
+    else {
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
+      ENCODE;
     }
-
-    rb_yield(row);
-    row = rb_ary_new();
   }
-#line 78 "ext/fastcsv/fastcsv.rl"
+#line 488 "ext/fastcsv/fastcsv.rl"
 	{
-    d->start = p;
-
-    if (len_row_sep) {
-      if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
-        FREE;
+    SET_ROW; // same as new_row
 
-        rb_raise(eError, "Unquoted fields do not allow \\r or \\n (line %d).", curline);
-      }
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
     }
-    else {
-      len_row_sep = p - mark_row_sep;
-      row_sep = ALLOC_N(char, len_row_sep);
-      memcpy(row_sep, mark_row_sep, len_row_sep);
+
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
     }
+    in_quoted_field = false;
 
-    curline++;
+    if (column) {
+      END_ROW;
+    }
   }
-	goto st11;
-st11:
+#line 534 "ext/fastcsv/fastcsv.rl"
+	{act = 3;}
+	goto st19;
+st19:
 	if ( ++p == pe )
-		goto _test_eof11;
-case 11:
-#line 2621 "ext/fastcsv/fastcsv.c"
+		goto _test_eof19;
+case 19:
+#line 7376 "ext/fastcsv/fastcsv.c"
 	_widec = (*p);
-	_widec = (short)(128 + ((*p) - -128));
-	if ( 
-#line 140 "ext/fastcsv/fastcsv.rl"
- (*p) == quote_char  ) _widec += 256;
+	if ( (*p) < 11 ) {
+		if ( (*p) > 9 ) {
+			if ( 10 <= (*p) && (*p) <= 10 ) {
+				_widec = (short)(3712 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+			}
+		} else {
+			_widec = (short)(10880 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+		}
+	} else if ( (*p) > 12 ) {
+		if ( (*p) > 13 ) {
+			if ( 14 <= (*p) )
+ {				_widec = (short)(10880 + ((*p) - -128));
+				if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+				if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+				if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+			}
+		} else if ( (*p) >= 13 ) {
+			_widec = (short)(3712 + ((*p) - -128));
+			if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+			if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+			if ( 
+#line 511 "ext/fastcsv/fastcsv.rl"
+ ESCAPED(p)  ) _widec += 1024;
+		}
+	} else {
+		_widec = (short)(10880 + ((*p) - -128));
+		if ( 
+#line 509 "ext/fastcsv/fastcsv.rl"
+ (*p) == quote_char && (in_quoted_field || p == ts || !liberal_parsing || STRIPPED(p)) && !ESCAPED(p)  ) _widec += 256;
+		if ( 
+#line 510 "ext/fastcsv/fastcsv.rl"
+ (*p) == col_sep && !ESCAPED(p)  ) _widec += 512;
+		if ( 
+#line 516 "ext/fastcsv/fastcsv.rl"
+ strip && STRIP_P(s->strip_set, (*p))  ) _widec += 1024;
+	}
 	switch( _widec ) {
-		case 256: goto tr37;
-		case 266: goto tr41;
-		case 522: goto tr42;
+		case 4106: goto tr42;
+		case 4109: goto tr42;
+		case 4618: goto tr42;
+		case 4621: goto tr42;
+		case 4874: goto st5;
+		case 4877: goto st5;
+		case 5130: goto tr42;
+		case 5133: goto tr42;
+		case 5642: goto tr42;
+		case 5645: goto tr42;
 	}
-	if ( _widec > 383 ) {
-		if ( 384 <= _widec && _widec <= 639 )
-			goto tr40;
-	} else if ( _widec >= 128 )
-		goto tr39;
-	goto tr0;
-tr42:
+	if ( _widec < 11790 ) {
+		if ( _widec < 11136 ) {
+			if ( _widec < 11019 ) {
+				if ( 10880 <= _widec && _widec <= 11017 )
+					goto st5;
+			} else if ( _widec > 11020 ) {
+				if ( 11022 <= _widec && _widec <= 11135 )
+					goto st5;
+			} else
+				goto st5;
+		} else if ( _widec > 11273 ) {
+			if ( _widec < 11278 ) {
+				if ( 11275 <= _widec && _widec <= 11276 )
+					goto tr42;
+			} else if ( _widec > 11391 ) {
+				if ( _widec > 11785 ) {
+					if ( 11787 <= _widec && _widec <= 11788 )
+						goto tr42;
+				} else if ( _widec >= 11648 )
+					goto tr42;
+			} else
+				goto tr42;
+		} else
+			goto tr42;
+	} else if ( _widec > 11903 ) {
+		if ( _widec < 12299 ) {
+			if ( _widec < 12043 ) {
+				if ( 11904 <= _widec && _widec <= 12041 )
+					goto st6;
+			} else if ( _widec > 12044 ) {
+				if ( _widec > 12159 ) {
+					if ( 12160 <= _widec && _widec <= 12297 )
+						goto tr42;
+				} else if ( _widec >= 12046 )
+					goto st6;
+			} else
+				goto st6;
+		} else if ( _widec > 12300 ) {
+			if ( _widec < 12672 ) {
+				if ( 12302 <= _widec && _widec <= 12415 )
+					goto tr42;
+			} else if ( _widec > 12809 ) {
+				if ( _widec > 12812 ) {
+					if ( 12814 <= _widec && _widec <= 12927 )
+						goto tr42;
+				} else if ( _widec >= 12811 )
+					goto tr42;
+			} else
+				goto tr42;
+		} else
+			goto tr42;
+	} else
+		goto tr42;
+	goto tr57;
+tr52:
 #line 1 "NONE"
 	{te = p+1;}
-#line 63 "ext/fastcsv/fastcsv.rl"
-	{
-    // intentionally blank - see parse_quoted_field
-  }
-#line 48 "ext/fastcsv/fastcsv.rl"
+#line 365 "ext/fastcsv/fastcsv.rl"
 	{
-    unclosed_line = 0;
-  }
-#line 78 "ext/fastcsv/fastcsv.rl"
-	{
-    d->start = p;
+    char *from = ts, *to = p;
 
-    if (len_row_sep) {
-      if (p - mark_row_sep != len_row_sep || row_sep[0] != *mark_row_sep || (len_row_sep == 2 && row_sep[1] != *(mark_row_sep + 1))) {
-        FREE;
+    // Stripping only moves the field's bounds, so no String is created.
+    if (strip) {
+      while (from < to && STRIP_P(s->strip_set, *from)) {
+        from++;
+      }
+      while (to > from && STRIP_P(s->strip_set, *(to - 1))) {
+        to--;
+      }
+    }
 
-        rb_raise(eError, "Unquoted fields do not allow \\r or \\n (line %d).", curline);
+    if (to == from) {
+      // Unquoted empty fields are nil, not "", in Ruby.
+      field = Qnil;
+    }
+    else if (!NIL_P(s->null_values) && null_value_p(s->null_values, from, to - from)) {
+      field = Qundef;
+    }
+    else if (escape_char) {
+      field_len = unescape_escaped_field(&field_ptr, &s->scratch, &s->scratch_size, escape_char, 0, from, to);
+      if (mode == MODE_SINK) {
+        field = Qtrue;
+        VALIDATE(from, to);
+      }
+      else {
+        field = rb_enc_str_new(field_ptr, field_len, encoding);
+        VALIDATE(from, to);
+        ENCODE;
+      }
+      if (validate_encoding) {
+        s->field_lines += count_line_breaks(from, to);
       }
     }
+    else if (mode == MODE_SINK) {
+      field_ptr = from;
+      field_len = to - from;
+      field = Qtrue;
+      VALIDATE(from, to);
+    }
     else {
-      len_row_sep = p - mark_row_sep;
-      row_sep = ALLOC_N(char, len_row_sep);
-      memcpy(row_sep, mark_row_sep, len_row_sep);
+      field = rb_enc_str_new(from, to - from, encoding);
+      VALIDATE(from, to);
+      ENCODE;
     }
+  }
+#line 488 "ext/fastcsv/fastcsv.rl"
+	{
+    SET_ROW; // same as new_row
 
-    curline++;
+    if (in_quoted_field) { // same as new_row
+      READ_QUOTED;
+    }
+
+    if (!NIL_P(field) || column) {
+      PUSH_FIELD;
+    }
+    in_quoted_field = false;
+
+    if (column) {
+      END_ROW;
+    }
   }
-#line 153 "ext/fastcsv/fastcsv.rl"
-	{act = 2;}
-	goto st12;
-st12:
+#line 534 "ext/fastcsv/fastcsv.rl"
+	{act = 3;}
+	goto st20;
+tr51:
+#line 1 "NONE"
+	{te = p+1;}
+#line 535 "ext/fastcsv/fastcsv.rl"
+	{act = 4;}
+	goto st20;
+st20:
 	if ( ++p == pe )
-		goto _test_eof12;
-case 12:
-#line 2675 "ext/fastcsv/fastcsv.c"
-	_widec = (*p);
-	_widec = (short)(1152 + ((*p) - -128));
-	if ( 
-#line 140 "ext/fastcsv/fastcsv.rl"
- (*p) == quote_char  ) _widec += 256;
-	if ( 
-#line 141 "ext/fastcsv/fastcsv.rl"
- (*p) == col_sep  ) _widec += 512;
-	switch( _widec ) {
-		case 1280: goto tr45;
-		case 1290: goto tr46;
-		case 1293: goto tr47;
-		case 1536: goto tr48;
-		case 1546: goto tr49;
-		case 1549: goto tr50;
-		case 1792: goto tr52;
-		case 1802: goto tr53;
-		case 1805: goto tr54;
-		case 2048: goto tr56;
-		case 2058: goto tr57;
-		case 2061: goto tr58;
+		goto _test_eof20;
+case 20:
+#line 7589 "ext/fastcsv/fastcsv.c"
+	switch( (*p) ) {
+		case 10: goto tr71;
+		case 13: goto tr72;
 	}
-	if ( _widec < 1408 ) {
-		if ( 1152 <= _widec && _widec <= 1407 )
-			goto tr43;
-	} else if ( _widec > 1663 ) {
-		if ( _widec > 1919 ) {
-			if ( 1920 <= _widec && _widec <= 2175 )
-				goto tr55;
-		} else if ( _widec >= 1664 )
-			goto tr51;
-	} else
-		goto tr39;
-	goto tr44;
+	goto tr51;
+tr71:
+#line 1 "NONE"
+	{te = p+1;}
+#line 535 "ext/fastcsv/fastcsv.rl"
+	{act = 4;}
+	goto st21;
+st21:
+	if ( ++p == pe )
+		goto _test_eof21;
+case 21:
+#line 7605 "ext/fastcsv/fastcsv.c"
+	goto tr73;
+tr72:
+#line 1 "NONE"
+	{te = p+1;}
+#line 535 "ext/fastcsv/fastcsv.rl"
+	{act = 4;}
+	goto st22;
+st22:
+	if ( ++p == pe )
+		goto _test_eof22;
+case 22:
+#line 7617 "ext/fastcsv/fastcsv.c"
+	if ( (*p) == 10 )
+		goto tr71;
+	goto tr73;
 	}
-	_test_eof4: cs = 4; goto _test_eof; 
-	_test_eof1: cs = 1; goto _test_eof; 
-	_test_eof5: cs = 5; goto _test_eof; 
-	_test_eof6: cs = 6; goto _test_eof; 
 	_test_eof7: cs = 7; goto _test_eof; 
 	_test_eof8: cs = 8; goto _test_eof; 
-	_test_eof2: cs = 2; goto _test_eof; 
-	_test_eof3: cs = 3; goto _test_eof; 
 	_test_eof9: cs = 9; goto _test_eof; 
 	_test_eof10: cs = 10; goto _test_eof; 
+	_test_eof1: cs = 1; goto _test_eof; 
+	_test_eof2: cs = 2; goto _test_eof; 
 	_test_eof11: cs = 11; goto _test_eof; 
+	_test_eof3: cs = 3; goto _test_eof; 
 	_test_eof12: cs = 12; goto _test_eof; 
+	_test_eof4: cs = 4; goto _test_eof; 
+	_test_eof13: cs = 13; goto _test_eof; 
+	_test_eof14: cs = 14; goto _test_eof; 
+	_test_eof15: cs = 15; goto _test_eof; 
+	_test_eof5: cs = 5; goto _test_eof; 
+	_test_eof16: cs = 16; goto _test_eof; 
+	_test_eof17: cs = 17; goto _test_eof; 
+	_test_eof6: cs = 6; goto _test_eof; 
+	_test_eof18: cs = 18; goto _test_eof; 
+	_test_eof19: cs = 19; goto _test_eof; 
+	_test_eof20: cs = 20; goto _test_eof; 
+	_test_eof21: cs = 21; goto _test_eof; 
+	_test_eof22: cs = 22; goto _test_eof; 
 
 	_test_eof: {}
 	if ( p == eof )
 	{
 	switch ( cs ) {
+	case 8: goto tr53;
+	case 9: goto tr53;
+	case 10: goto tr53;
 	case 1: goto tr0;
-	case 5: goto tr36;
-	case 6: goto tr37;
-	case 7: goto tr37;
-	case 8: goto tr36;
 	case 2: goto tr0;
+	case 11: goto tr0;
 	case 3: goto tr0;
-	case 9: goto tr0;
-	case 10: goto tr37;
-	case 11: goto tr37;
-	case 12: goto tr43;
+	case 12: goto tr57;
+	case 4: goto tr0;
+	case 13: goto tr57;
+	case 14: goto tr53;
+	case 15: goto tr60;
+	case 5: goto tr0;
+	case 16: goto tr57;
+	case 17: goto tr57;
+	case 6: goto tr0;
+	case 18: goto tr57;
+	case 19: goto tr57;
+	case 20: goto tr0;
+	case 21: goto tr73;
+	case 22: goto tr73;
 	}
 	}
 
 	_out: {}
 	}
 
-#line 465 "ext/fastcsv/fastcsv.rl"
+#line 2248 "ext/fastcsv/fastcsv.rl"
+    }
+
+    // The machine exited after a row, and resumes at `p` on the next call.
+    if (suspended) {
+      pe = chunk_end;
+      SAVE_SCAN;
+      return;
+    }
+
+    if (stopped) {
+      break;
+    }
 
-    if (done && cs < raw_parse_first_final) {
-      if (d->start == 0 || p == d->start) { // same as new_row
+    if (cs == raw_parse_error || (done && cs < raw_parse_first_final)) {
+      if (start == 0 || p == start) { // same as new_row
         rb_ivar_set(self, s_row, rb_str_new2(""));
       }
-      else if (p > d->start) {
-        rb_ivar_set(self, s_row, rb_str_new(d->start, p - d->start));
+      else if (p > start) {
+        rb_ivar_set(self, s_row, rb_str_new(start, p - start));
       }
 
       FREE;
@@ -2761,38 +7704,473 @@ case 12:
       }
     }
 
-    if (ts == 0) {
-      have = 0;
+    if (in_place && window < src_end) {
+      // The rest of the String follows, so tokens can span windows.
     }
-    else if (io) {
-      have = pe - ts;
-      memmove(buf, ts, have);
+    else if (io || in_place) {
+      // Carry the pending token, if any, to the start of the buffer. When
+      // leaving a String, carry the current row, too, for #row.
+      char *from = ts == 0 ? pe : ts;
+      if (in_place && start >= src_start && start < from) {
+        from = start;
+      }
+
+      consumed += from - (in_place ? src_start : buf);
+      have = pe - from;
+      if (in_place) {
+        if (!io) {
+          if (have + 1 > buf_capa) {
+            buf_capa = have + 1;
+            REALLOC_N(buf, char, buf_capa);
+          }
+        }
+        else if (have >= buffer_size) {
+          buffer_size = have + BUFSIZE;
+          REALLOC_N(buf, char, buffer_size);
+          buf_capa = buffer_size;
+        }
+        s->buf = buf;
+        s->buf_capa = buf_capa;
+      }
+
+      memmove(buf, from, have);
       // @see https://github.com/hpricot/hpricot/blob/master/ext/hpricot_scan/hpricot_scan.rl#L92
-      if (d->start > ts) {
-        d->start = buf + (d->start - ts);
+      if (start >= from) {
+        start = buf + (start - from);
+      }
+      if (mark_row_sep >= from) {
+        mark_row_sep = buf + (mark_row_sep - from);
       }
-      if (mark_row_sep >= ts) {
-        mark_row_sep = buf + (mark_row_sep - ts);
+      if (ts != 0) {
+        te = buf + (te - from);
+        ts = buf + (ts - from);
       }
-      te = buf + (te - ts);
-      ts = buf;
+      in_place = 0;
+    }
+  }
+
+  if (mode == MODE_COUNT) {
+    rows = s->counter.rows + s->counter.content;
+    if (s->counter.quoted) {
+      FREE;
+      rb_raise(eError, "Unclosed quoted field on line %ld.", s->counter.line);
     }
   }
 
-  FREE;
+  SAVE_SCAN;
+  scan_free(s);
+}
+
+static VALUE scan_body(VALUE s) {
+  scan((Scan *)s);
+  return Qnil;
+}
+
+// Frees the Scan if the block breaks or an error is raised.
+static VALUE scan_ensure(VALUE s) {
+  if (!((Scan *)s)->finished) {
+    scan_free((Scan *)s);
+  }
+  return Qnil;
+}
+
+// Yields rows, or appends them to `result`, returns the first row, appends
+// fields to the columns in `result` or passes fields to `sink`, depending on
+// the mode. Returns `result`, or the number of rows if counting or passing
+// fields to `sink`.
+static VALUE parse(int argc, VALUE *argv, VALUE self, int mode, VALUE result, Sink *sink) {
+  Scan s;
+
+  scan_start(&s, argc, argv, self, mode, result, sink);
+  rb_ensure(scan_body, (VALUE)&s, scan_ensure, (VALUE)&s);
+
+  RB_GC_GUARD(s.src);
+  RB_GC_GUARD(s.ahead_holder);
+  RB_GC_GUARD(s.skip_lines);
+  RB_GC_GUARD(s.null_values);
+  RB_GC_GUARD(s.nil_value);
+  RB_GC_GUARD(s.empty_value);
+
+  return mode == MODE_COUNT || mode == MODE_SINK ? LONG2NUM(s.rows) : s.result;
+}
+
+static VALUE rows_new(int argc, VALUE *argv, VALUE self);
+
+// Without a block, returns a Rows.
+static VALUE raw_parse(int argc, VALUE *argv, VALUE self) {
+  if (!rb_block_given_p()) {
+    return rows_new(argc, argv, self);
+  }
+  return parse(argc, argv, self, MODE_ROWS, Qnil, NULL);
+}
+
+// Yields each row or, without a block, returns an Array of rows.
+static VALUE parse_rows(int argc, VALUE *argv, VALUE self) {
+  VALUE rows;
+
+  if (rb_block_given_p()) {
+    return parse(argc, argv, self, MODE_ROWS, Qnil, NULL);
+  }
+
+  rows = rb_ary_new();
+  return parse(argc, argv, self, MODE_ROWS, rows, NULL);
+}
+
+// Returns the first row, without reading the rest of the input, or nil if the
+// input is empty.
+static VALUE parse_line(int argc, VALUE *argv, VALUE self) {
+  return parse(argc, argv, self, MODE_SHIFT, Qnil, NULL);
+}
+
+static void rows_mark(void *data) {
+  Scan *s = data;
+
+  rb_gc_mark(s->self);
+  rb_gc_mark(s->port);
+  rb_gc_mark(s->src);
+  rb_gc_mark(s->ahead_holder);
+  rb_gc_mark(s->row);
+  rb_gc_mark(s->field);
+  rb_gc_mark(s->replace);
+  rb_gc_mark(s->result);
+  rb_gc_mark(s->skip_lines);
+  rb_gc_mark(s->null_values);
+  rb_gc_mark(s->nil_value);
+  rb_gc_mark(s->empty_value);
+}
+
+// The parser may have been freed already, so the buffer isn't given back, and
+// the read-ahead thread is stopped by its own holder.
+static void rows_free(void *data) {
+  Scan *s = data;
+
+  if (s->buf != NULL) {
+    free(s->buf);
+  }
+  if (s->inflater != NULL) {
+    inflater_free(s->inflater);
+  }
+  if (s->row_sep != NULL) {
+    free(s->row_sep);
+  }
+  if (s->scratch != NULL) {
+    free(s->scratch);
+  }
+  free(s);
+}
+
+// Returns the rows, to be read one at a time without a Fiber.
+static VALUE rows_new(int argc, VALUE *argv, VALUE self) {
+  Scan *s = ALLOC(Scan);
+  VALUE rows;
+
+  memset(s, 0, sizeof(Scan));
+  s->self = s->port = s->src = s->ahead_holder = s->row = s->field = s->replace = s->result = s->skip_lines = s->null_values = s->nil_value = Qnil;
+  s->empty_value = Qundef;
+  s->finished = true;
+  rows = Data_Wrap_Struct(cRows, rows_mark, rows_free, s);
+  scan_start(s, argc, argv, self, MODE_SHIFT, Qnil, NULL);
+
+  return rows;
+}
+
+static VALUE rows_scan(VALUE s) {
+  scan((Scan *)s);
+  ((Scan *)s)->busy = false;
+  return Qnil;
+}
 
+// Frees the Scan if an error is raised.
+static VALUE rows_ensure(VALUE s) {
+  if (((Scan *)s)->busy) {
+    ((Scan *)s)->busy = false;
+    scan_free((Scan *)s);
+  }
   return Qnil;
 }
 
+// Returns the next row, or nil at the end of the input.
+static VALUE rows_shift(VALUE self) {
+  Scan *s;
+  Data_Get_Struct(self, Scan, s);
+
+  if (s->finished || s->busy) {
+    return Qnil;
+  }
+
+  s->result = Qnil;
+  s->busy = true;
+  rb_ensure(rows_scan, (VALUE)s, rows_ensure, (VALUE)s);
+
+  return s->result;
+}
+
+// Like Enumerator#next.
+static VALUE rows_next(VALUE self) {
+  VALUE row = rows_shift(self);
+
+  if (NIL_P(row)) {
+    rb_raise(rb_eStopIteration, "iteration reached an end");
+  }
+
+  return row;
+}
+
+// Yields the rows that haven't been read.
+static VALUE rows_each(VALUE self) {
+  VALUE row;
+
+  RETURN_ENUMERATOR(self, 0, 0);
+  while (!NIL_P(row = rows_shift(self))) {
+    rb_yield(row);
+  }
+
+  return self;
+}
+
+// Returns the number of rows, without parsing fields.
+static VALUE count_rows(int argc, VALUE *argv, VALUE self) {
+  return parse(argc, argv, self, MODE_COUNT, Qnil, NULL);
+}
+
+// Compiles the options, which are used by each call that doesn't override them.
+static VALUE initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE opts;
+  Data *d;
+
+  rb_scan_args(argc, argv, "01", &opts);
+  Data_Get_Struct(self, Data, d);
+  apply_options(opts, &d->options);
+
+  return self;
+}
+
+// Returns one Array per column, without building an Array per row. Short rows
+// are padded with nil.
+static VALUE read_columns(int argc, VALUE *argv, VALUE self) {
+  VALUE columns = rb_ary_new();
+  parse(argc, argv, self, MODE_COLUMNS, columns, NULL);
+  return columns;
+}
+
+// Writes the input to `output` in the Arrow IPC streaming format, with the
+// columns and types given by the :schema option. Returns the number of rows.
+static VALUE to_arrow(int argc, VALUE *argv, VALUE self) {
+  VALUE port, output, opts, option, holder, args[2];
+  ArrowWriter *writer;
+  Sink sink;
+  long batch_size = 65536;
+
+  rb_scan_args(argc, argv, "21", &port, &output, &opts);
+  if (NIL_P(opts)) {
+    opts = rb_hash_new();
+  }
+  else if (TYPE(opts) != T_HASH) {
+    rb_raise(rb_eArgError, "options has to be a Hash or nil");
+  }
+
+  option = rb_hash_aref(opts, ID2SYM(s_batch_size));
+  if (!NIL_P(option)) {
+    batch_size = NUM2LONG(option);
+    if (batch_size <= 0) {
+      rb_raise(rb_eArgError, ":batch_size has to be a positive Integer");
+    }
+  }
+
+  holder = arrow_writer_new(rb_hash_aref(opts, ID2SYM(s_schema)), output, batch_size, RTEST(rb_hash_aref(opts, ID2SYM(s_headers))), &writer);
+  sink.data = writer;
+  sink.on_field = arrow_writer_field;
+  sink.on_row_end = arrow_writer_row_end;
+  sink.error = arrow_writer_error(writer);
+
+  arrow_writer_start(writer);
+  args[0] = port;
+  args[1] = opts;
+  parse(2, args, self, MODE_SINK, Qnil, &sink);
+
+  RB_GC_GUARD(holder);
+  RB_GC_GUARD(output);
+
+  return LONG2NUM(arrow_writer_finish(writer));
+}
+
+// Infers each column's type from the first :sample_rows rows.
+static VALUE infer_schema(int argc, VALUE *argv, VALUE self) {
+  VALUE port, opts, option, holder, args[2];
+  SchemaInferrer *inferrer;
+  Sink sink;
+  long sample_rows = 10000;
+
+  rb_scan_args(argc, argv, "11", &port, &opts);
+  if (NIL_P(opts)) {
+    opts = rb_hash_new();
+  }
+  else if (TYPE(opts) != T_HASH) {
+    rb_raise(rb_eArgError, "options has to be a Hash or nil");
+  }
+
+  option = rb_hash_aref(opts, ID2SYM(s_sample_rows));
+  if (!NIL_P(option)) {
+    sample_rows = NUM2LONG(option);
+    if (sample_rows <= 0) {
+      rb_raise(rb_eArgError, ":sample_rows has to be a positive Integer");
+    }
+  }
+
+  holder = schema_inferrer_new(sample_rows, &inferrer);
+  sink.data = inferrer;
+  sink.on_field = schema_inferrer_field;
+  sink.on_row_end = schema_inferrer_row_end;
+  sink.error = NULL;
+
+  args[0] = port;
+  args[1] = opts;
+  // The header row is shifted like #raw_parse's rows, so that the names are
+  // encoded like fields, and the same scan passes the other rows to the sink.
+  if (RTEST(rb_hash_aref(opts, ID2SYM(s_headers)))) {
+    VALUE rows = rows_new(2, args, self), names;
+    Scan *s;
+
+    names = rows_shift(rows);
+    schema_inferrer_names(inferrer, NIL_P(names) ? rb_ary_new() : names);
+    Data_Get_Struct(rows, Scan, s);
+    s->mode = MODE_SINK;
+    s->sink = &sink;
+    rows_shift(rows);
+
+    RB_GC_GUARD(rows);
+  }
+  else {
+    parse(2, args, self, MODE_SINK, Qnil, &sink);
+  }
+
+  RB_GC_GUARD(holder);
+
+  return schema_inferrer_result(inferrer);
+}
+
+long fastcsv_parse(VALUE port, VALUE opts, FastCSVSink *sink) {
+  VALUE args[2];
+
+  args[0] = port;
+  args[1] = opts;
+  return NUM2LONG(parse(2, args, rb_class_new_instance(0, NULL, cParser), MODE_SINK, Qnil, sink));
+}
+
+// Guesses the column separator, quote character and row separator of the
+// input, and whether its first row is a header, from its first chunk. The
+// column separator and quote character are kept only if `opts` gives them. An
+// IO's position is restored, so it has to be seekable.
+static VALUE sniff_dialect(int argc, VALUE *argv, VALUE self) {
+  VALUE port, opts, sample, pos = Qnil, result;
+  Options options;
+  Sniffed sniffed;
+  Data *d;
+  int complete = 1;
+  char quote_char[2] = {0}, col_sep[2] = {0};
+
+  rb_scan_args(argc, argv, "11", &port, &opts);
+  Data_Get_Struct(self, Data, d);
+  options = d->options;
+  options.sniff_quote_char = true;
+  options.sniff_col_sep = true;
+  apply_options(opts, &options);
+
+  if (rb_respond_to(port, s_read)) {
+    pos = rb_funcall(port, s_pos, 0);
+    sample = rb_funcall(port, s_read, 1, INT2FIX(BUFSIZE));
+    rb_funcall(port, s_pos_set, 1, pos);
+    if (NIL_P(sample)) {
+      sample = rb_str_new(0, 0);
+    }
+    StringValue(sample);
+    complete = RSTRING_LEN(sample) < BUFSIZE;
+  }
+  else if (rb_respond_to(port, s_to_str)) {
+    sample = rb_funcall(port, s_to_str, 0);
+    StringValue(sample);
+    if (RSTRING_LEN(sample) > BUFSIZE) {
+      complete = 0;
+    }
+  }
+  else {
+    rb_raise(rb_eArgError, "data has to respond to #read or #to_str");
+  }
+
+  sniff(RSTRING_PTR(sample), RSTRING_LEN(sample) < BUFSIZE ? RSTRING_LEN(sample) : BUFSIZE, complete,
+    options.sniff_col_sep ? 0 : options.col_sep, options.sniff_quote_char ? 0 : options.quote_char,
+    options.comment_char, options.skip_rows, &sniffed);
+  RB_GC_GUARD(sample);
+
+  col_sep[0] = sniffed.col_sep;
+  quote_char[0] = sniffed.quote_char;
+  result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(s_col_sep), rb_str_new2(col_sep));
+  rb_hash_aset(result, ID2SYM(s_quote_char), rb_str_new2(quote_char));
+  rb_hash_aset(result, ID2SYM(s_row_sep), sniffed.row_sep == NULL ? Qnil : rb_str_new2(sniffed.row_sep));
+  rb_hash_aset(result, ID2SYM(s_headers), sniffed.headers ? Qtrue : Qfalse);
+
+  return result;
+}
+
+static void dialect_mark(void *data) {
+  rb_gc_mark(((Options *)data)->replace);
+  rb_gc_mark(((Options *)data)->skip_lines);
+  rb_gc_mark(((Options *)data)->null_marker);
+  rb_gc_mark(((Options *)data)->null_values);
+  rb_gc_mark(((Options *)data)->nil_value);
+  rb_gc_mark(((Options *)data)->empty_value);
+}
+
+static VALUE dialect_allocate(VALUE class) {
+  Options *o = ALLOC(Options);
+  default_options(o);
+  return Data_Wrap_Struct(class, dialect_mark, free, o);
+}
+
+// Compiles the options once, so that parsing with the dialect doesn't look up
+// options or encodings.
+static VALUE dialect_initialize(int argc, VALUE *argv, VALUE self) {
+  VALUE opts;
+  Options *o;
+
+  rb_scan_args(argc, argv, "01", &opts);
+  Data_Get_Struct(self, Options, o);
+  if (!NIL_P(opts) && TYPE(opts) != T_HASH) {
+    rb_raise(rb_eArgError, "options has to be a Hash or nil");
+  }
+  apply_options(opts, o);
+
+  return self;
+}
+
+static void mark(void *data) {
+  rb_gc_mark(((Data *)data)->options.replace);
+  rb_gc_mark(((Data *)data)->options.skip_lines);
+  rb_gc_mark(((Data *)data)->options.null_marker);
+  rb_gc_mark(((Data *)data)->options.null_values);
+  rb_gc_mark(((Data *)data)->options.nil_value);
+  rb_gc_mark(((Data *)data)->options.empty_value);
+}
+
+static void deallocate(void *data) {
+  Data *d = data;
+
+  if (d->buf != NULL) {
+    free(d->buf);
+  }
+  free(d);
+}
+
 // @see https://github.com/ruby/ruby/blob/trunk/README.EXT#L616
 static VALUE allocate(VALUE class) {
   // @see https://github.com/nofxx/georuby_c/blob/b3b91fd90980d7c295ac8f6012d89878ea7cd569/ext/line.c#L66
   Data *d = ALLOC(Data);
-  d->start = 0;
+  d->buf = NULL;
+  d->buf_capa = 0;
+  default_options(&d->options);
   // @see https://github.com/nofxx/georuby_c/blob/b3b91fd90980d7c295ac8f6012d89878ea7cd569/ext/point.h#L26
-  // rb_gc_mark(d->start) or rb_gc_mark(d) cause warning "passing argument 1 of ‘rb_gc_mark’ makes integer from pointer without a cast"
-  // free(d->start) causes error "pointer being freed was not allocated"
-  return Data_Wrap_Struct(class, NULL, free, d);
+  return Data_Wrap_Struct(class, mark, deallocate, d);
 }
 
 // @see http://tenderlovemaking.com/2009/12/18/writing-ruby-c-extensions-part-1.html
@@ -2800,14 +8178,70 @@ static VALUE allocate(VALUE class) {
 void Init_fastcsv() {
   s_read = rb_intern("read");
   s_row = rb_intern("@row");
+  s_scrub = rb_intern("scrub");
+  s_string = rb_intern("string");
+  s_pos = rb_intern("pos");
+  s_pos_set = rb_intern("pos=");
+  s_StringIO = rb_intern("StringIO");
+  s_to_str = rb_intern("to_str");
+  s_encoding = rb_intern("encoding");
+  s_internal_encoding = rb_intern("internal_encoding");
+  s_external_encoding = rb_intern("external_encoding");
+  s_buffer_size = rb_intern("@buffer_size");
+  s_quote_char = rb_intern("quote_char");
+  s_col_sep = rb_intern("col_sep");
+  s_validate_encoding = rb_intern("validate_encoding");
+  s_replace = rb_intern("replace");
+  s_compression = rb_intern("compression");
+  s_gzip = rb_intern("gzip");
+  s_zstd = rb_intern("zstd");
+  s_auto = rb_intern("auto");
+  s_strict_width = rb_intern("strict_width");
+  s_liberal_parsing = rb_intern("liberal_parsing");
+  s_escape_char = rb_intern("escape_char");
+  s_null_marker = rb_intern("null_marker");
+  s_null_values = rb_intern("null_values");
+  s_nil_value = rb_intern("nil_value");
+  s_empty_value = rb_intern("empty_value");
+  s_read_ahead = rb_intern("read_ahead");
+  s_strip = rb_intern("strip");
+  s_skip_blanks = rb_intern("skip_blanks");
+  s_skip_lines = rb_intern("skip_lines");
+  s_comment_char = rb_intern("comment_char");
+  s_skip_rows = rb_intern("skip_rows");
+  s_batch_size = rb_intern("batch_size");
+  s_schema = rb_intern("schema");
+  s_headers = rb_intern("headers");
+  s_sample_rows = rb_intern("sample_rows");
+  s_row_sep = rb_intern("row_sep");
+  schema_inferrer_init();
 
   cClass = rb_define_class("FastCSV", rb_const_get(rb_cObject, rb_intern("CSV"))); // class FastCSV < CSV
   cParser = rb_define_class_under(cClass, "Parser", rb_cObject);                   //   class Parser
   rb_define_alloc_func(cParser, allocate);                                         //
+  rb_define_method(cParser, "initialize", initialize, -1);                         //     def initialize(opts_or_dialect = nil); end
+  rb_define_method(cParser, "parse", parse_rows, -1);                              //     def parse(port, opts = nil); end
   rb_define_method(cParser, "raw_parse", raw_parse, -1);                           //     def raw_parse(port, opts = nil); end
+  rb_define_method(cParser, "parse_line", parse_line, -1);                         //     def parse_line(port, opts = nil); end
+  rb_define_method(cParser, "read_columns", read_columns, -1);                     //     def read_columns(port, opts = nil); end
+  rb_define_method(cParser, "count_rows", count_rows, -1);                         //     def count_rows(port, opts = nil); end
+  rb_define_method(cParser, "to_arrow", to_arrow, -1);                             //     def to_arrow(port, output, opts = nil); end
+  rb_define_method(cParser, "infer_schema", infer_schema, -1);                     //     def infer_schema(port, opts = nil); end
+  rb_define_method(cParser, "sniff", sniff_dialect, -1);                           //     def sniff(port, opts = nil); end
   rb_define_attr(cParser, "row", 1, 0);                                            //     attr_reader :row
   rb_define_attr(cParser, "buffer_size", 1, 1);                                    //     attr_accessor :buffer_size
                                                                                    //   end
+  cRows = rb_define_class_under(cClass, "Rows", rb_cObject);                       //   class Rows
+  rb_include_module(cRows, rb_mEnumerable);                                        //     include Enumerable
+  rb_undef_alloc_func(cRows);                                                      //
+  rb_define_method(cRows, "shift", rows_shift, 0);                                 //     def shift; end
+  rb_define_method(cRows, "next", rows_next, 0);                                   //     def next; end
+  rb_define_method(cRows, "each", rows_each, 0);                                   //     def each; end
+                                                                                   //   end
+  cDialect = rb_define_class_under(cClass, "Dialect", rb_cObject);                 //   class Dialect
+  rb_define_alloc_func(cDialect, dialect_allocate);                                //
+  rb_define_method(cDialect, "initialize", dialect_initialize, -1);                //     def initialize(opts = nil); end
+                                                                                   //   end
   eError = rb_define_class_under(cClass, "MalformedCSVError", rb_eRuntimeError);   //   class MalformedCSVError < RuntimeError
                                                                                    // end
 }
@@ -0,0 +1,32 @@
+#ifndef FASTCSV_H
+#define FASTCSV_H
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// FastCSV's C API, for native extensions that consume fields as bytes, without
+// a String being created per field or an Array per row. The extension finds
+// this header with `find_header('fastcsv.h', FastCSV.include_dir)` in its
+// extconf.rb, and has to `require 'fastcsv'` before calling `fastcsv_parse`,
+// whose symbol is resolved when the extension is loaded.
+
+// Receives fields and row ends. `ptr` is valid only during the call and is NULL
+// if the field is nil. `column` counts from 0 in each row. `quoted` is whether
+// the field was enclosed in quote characters. A callback returns 0 to continue,
+// 1 to stop parsing or -1 to raise FastCSV::MalformedCSVError with `error`, or
+// with "Invalid field" if `error` is NULL.
+typedef struct {
+  void *data;
+  int (*on_field)(void *data, const char *ptr, size_t len, int column, bool quoted);
+  int (*on_row_end)(void *data);
+  const char *error;
+} FastCSVSink;
+
+// Parses `port`, a String or an IO, with `opts`, a Hash, a FastCSV::Dialect or
+// nil, like FastCSV::Parser#raw_parse, and passes its fields and row ends to
+// `sink`. Returns the number of rows whose ends were passed to `sink`. Raises
+// like #raw_parse, so the caller frees its resources with rb_ensure if need be.
+RUBY_FUNC_EXPORTED long fastcsv_parse(VALUE port, VALUE opts, FastCSVSink *sink);
+
+#endif
@@ -0,0 +1,291 @@
+#include "schema.h"
+#include "arrow.h"
+#include <stdint.h>
+#include <string.h>
+
+// A column starts with every type as a candidate. Each value removes the types
+// that it isn't, and the most specific remaining type is inferred.
+enum {
+  TYPE_BOOL = 1,
+  TYPE_INTEGER = 2,
+  TYPE_FLOAT = 4,
+  TYPE_DATE = 8,
+  TYPE_TIMESTAMP = 16,
+  TYPE_ALL = 31
+};
+
+typedef struct {
+  long nulls;
+  long width;       // in bytes, not characters
+  int candidates;
+} Column;
+
+struct SchemaInferrer {
+  Column *columns;
+  long ncolumns, capa;
+  long column;      // next column in the current row
+  long rows;        // rows sampled
+  long sample_rows;
+  VALUE names;
+};
+
+static ID s_name, s_type, s_null_ratio, s_max_width, s_string, s_bool, s_integer, s_float, s_date, s_timestamp;
+
+// Reads `n` digits as a number, or returns -1.
+static int digits(const char *ptr, int n) {
+  int value = 0, i;
+
+  for (i = 0; i < n; i++) {
+    if (ptr[i] < '0' || ptr[i] > '9') {
+      return -1;
+    }
+    value = value * 10 + ptr[i] - '0';
+  }
+
+  return value;
+}
+
+// YYYY-MM-DD
+static int is_date(const char *ptr, long len) {
+  static const int days[] = {31, 29, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+  int year, month, day;
+
+  if (len < 10 || ptr[4] != '-' || ptr[7] != '-') {
+    return 0;
+  }
+  year = digits(ptr, 4);
+  month = digits(ptr + 5, 2);
+  day = digits(ptr + 8, 2);
+  if (year < 0 || month < 1 || month > 12 || day < 1 || day > days[month - 1]) {
+    return 0;
+  }
+  if (month == 2 && day == 29 && (year % 4 != 0 || (year % 100 == 0 && year % 400 != 0))) {
+    return 0;
+  }
+
+  return 1;
+}
+
+// YYYY-MM-DD[T ]HH:MM[:SS[.fraction]][Z|+HH[:MM]|-HH[:MM]]
+static int is_timestamp(const char *ptr, long len) {
+  const char *end = ptr + len;
+  int hour, minute;
+
+  if (len < 16 || !is_date(ptr, 10) || (ptr[10] != 'T' && ptr[10] != ' ') || ptr[13] != ':') {
+    return 0;
+  }
+  hour = digits(ptr + 11, 2);
+  minute = digits(ptr + 14, 2);
+  if (hour < 0 || hour > 23 || minute < 0 || minute > 59) {
+    return 0;
+  }
+  ptr += 16;
+
+  // Allows leap seconds.
+  if (ptr < end && *ptr == ':') {
+    int second = end - ptr >= 3 ? digits(ptr + 1, 2) : -1;
+    if (second < 0 || second > 60) {
+      return 0;
+    }
+    ptr += 3;
+    if (ptr < end && *ptr == '.') {
+      const char *fraction = ++ptr;
+      while (ptr < end && *ptr >= '0' && *ptr <= '9') {
+        ptr++;
+      }
+      if (ptr == fraction) {
+        return 0;
+      }
+    }
+  }
+
+  if (ptr < end && *ptr == 'Z') {
+    ptr++;
+  }
+  else if (ptr < end && (*ptr == '+' || *ptr == '-')) {
+    int offset = end - ptr >= 3 ? digits(ptr + 1, 2) : -1;
+    if (offset < 0 || offset > 23) {
+      return 0;
+    }
+    ptr += 3;
+    if (ptr < end && *ptr == ':') {
+      ptr++;
+    }
+    if (ptr < end) {
+      offset = end - ptr >= 2 ? digits(ptr, 2) : -1;
+      if (offset < 0 || offset > 59) {
+        return 0;
+      }
+      ptr += 2;
+    }
+  }
+
+  return ptr == end;
+}
+
+// Returns the candidate types that the value can be.
+static int value_types(const char *ptr, long len, int candidates) {
+  int types = 0;
+  int64_t integer;
+  double number;
+
+  if ((candidates & TYPE_BOOL) && arrow_parse_bool(ptr, len) >= 0) {
+    types |= TYPE_BOOL;
+  }
+  if ((candidates & TYPE_INTEGER) && arrow_parse_int64(ptr, len, &integer)) {
+    types |= TYPE_INTEGER | TYPE_FLOAT;
+  }
+  else if ((candidates & TYPE_FLOAT) && arrow_parse_float64(ptr, len, &number)) {
+    types |= TYPE_FLOAT;
+  }
+  if ((candidates & (TYPE_DATE | TYPE_TIMESTAMP)) && len == 10 && is_date(ptr, len)) {
+    types |= TYPE_DATE | TYPE_TIMESTAMP;
+  }
+  else if ((candidates & TYPE_TIMESTAMP) && is_timestamp(ptr, len)) {
+    types |= TYPE_TIMESTAMP;
+  }
+
+  return types;
+}
+
+// Columns that first appear after the first row are null in earlier rows.
+static Column *column_at(SchemaInferrer *s, long index) {
+  if (index == s->ncolumns) {
+    if (s->ncolumns == s->capa) {
+      s->capa = s->capa ? 2 * s->capa : 16;
+      REALLOC_N(s->columns, Column, s->capa);
+    }
+    s->columns[index].nulls = s->rows;
+    s->columns[index].width = 0;
+    s->columns[index].candidates = TYPE_ALL;
+    s->ncolumns++;
+  }
+
+  return &s->columns[index];
+}
+
+int schema_inferrer_field(void *data, const char *ptr, size_t size, int column, bool quoted) {
+  SchemaInferrer *s = data;
+  long len = (long)size;
+  int null = ptr == NULL;
+  Column *c;
+
+  c = column_at(s, s->column++);
+  if (null || len == 0) {
+    c->nulls++;
+  }
+  else {
+    if (c->candidates) {
+      c->candidates &= value_types(ptr, len, c->candidates);
+    }
+    if (len > c->width) {
+      c->width = len;
+    }
+  }
+
+  return 0;
+}
+
+int schema_inferrer_row_end(void *data) {
+  SchemaInferrer *s = data;
+
+  // Blank rows are skipped.
+  if (s->column == 0) {
+    return 0;
+  }
+  // Short rows are padded with nulls.
+  for (; s->column < s->ncolumns; s->column++) {
+    s->columns[s->column].nulls++;
+  }
+  s->column = 0;
+  s->rows++;
+
+  return s->rows == s->sample_rows;
+}
+
+VALUE schema_inferrer_result(SchemaInferrer *s) {
+  VALUE result = rb_ary_new2(s->ncolumns > RARRAY_LEN(s->names) ? s->ncolumns : RARRAY_LEN(s->names));
+  long i;
+
+  for (i = 0; i < s->ncolumns || i < RARRAY_LEN(s->names); i++) {
+    VALUE column = rb_hash_new();
+    ID type = s_string;
+    long nulls = s->rows, width = 0;
+
+    if (i < s->ncolumns) {
+      Column *c = &s->columns[i];
+      nulls = c->nulls;
+      width = c->width;
+      // A column of nulls is a string column.
+      if (c->nulls < s->rows) {
+        if (c->candidates & TYPE_BOOL) {
+          type = s_bool;
+        }
+        else if (c->candidates & TYPE_INTEGER) {
+          type = s_integer;
+        }
+        else if (c->candidates & TYPE_FLOAT) {
+          type = s_float;
+        }
+        else if (c->candidates & TYPE_DATE) {
+          type = s_date;
+        }
+        else if (c->candidates & TYPE_TIMESTAMP) {
+          type = s_timestamp;
+        }
+      }
+    }
+
+    rb_hash_aset(column, ID2SYM(s_name), rb_ary_entry(s->names, i));
+    rb_hash_aset(column, ID2SYM(s_type), ID2SYM(type));
+    rb_hash_aset(column, ID2SYM(s_null_ratio), DBL2NUM(s->rows ? (double)nulls / s->rows : 0.0));
+    rb_hash_aset(column, ID2SYM(s_max_width), LONG2NUM(width));
+    rb_ary_push(result, column);
+  }
+
+  return result;
+}
+
+static void schema_inferrer_mark(void *data) {
+  rb_gc_mark(((SchemaInferrer *)data)->names);
+}
+
+static void schema_inferrer_free(void *data) {
+  SchemaInferrer *s = data;
+
+  if (s->columns != NULL) {
+    free(s->columns);
+  }
+  free(s);
+}
+
+VALUE schema_inferrer_new(long sample_rows, SchemaInferrer **inferrer) {
+  SchemaInferrer *s = ALLOC(SchemaInferrer);
+  VALUE holder;
+
+  memset(s, 0, sizeof(SchemaInferrer));
+  s->names = Qnil;
+  s->sample_rows = sample_rows;
+  holder = Data_Wrap_Struct(0, schema_inferrer_mark, schema_inferrer_free, s);
+  s->names = rb_ary_new();
+
+  *inferrer = s;
+  return holder;
+}
+
+void schema_inferrer_names(SchemaInferrer *s, VALUE names) {
+  s->names = names;
+}
+
+void schema_inferrer_init(void) {
+  s_name = rb_intern("name");
+  s_type = rb_intern("type");
+  s_null_ratio = rb_intern("null_ratio");
+  s_max_width = rb_intern("max_width");
+  s_string = rb_intern("string");
+  s_bool = rb_intern("bool");
+  s_integer = rb_intern("integer");
+  s_float = rb_intern("float");
+  s_date = rb_intern("date");
+  s_timestamp = rb_intern("timestamp");
+}
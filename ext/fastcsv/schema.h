@@ -0,0 +1,29 @@
+#ifndef FASTCSV_SCHEMA_H
+#define FASTCSV_SCHEMA_H
+
+#include <ruby.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// Infers each column's type from a sample of rows, without creating a Ruby
+// object per field.
+typedef struct SchemaInferrer SchemaInferrer;
+
+// Interns the result's keys and types, once.
+void schema_inferrer_init(void);
+
+// Returns an object that frees the inferrer when garbage collected.
+VALUE schema_inferrer_new(long sample_rows, SchemaInferrer **inferrer);
+
+// Names the columns with an Array of Strings, like a header row from #raw_parse.
+void schema_inferrer_names(SchemaInferrer *s, VALUE names);
+
+// FastCSVSink callbacks. Return 1 once the sample is complete.
+int schema_inferrer_field(void *data, const char *ptr, size_t size, int column, bool quoted);
+int schema_inferrer_row_end(void *data);
+
+// Returns an Array with a Hash per column, with its :name, :type, :null_ratio
+// and :max_width, the longest value's length in bytes.
+VALUE schema_inferrer_result(SchemaInferrer *s);
+
+#endif
@@ -0,0 +1,248 @@
+#include "sniff.h"
+#include "arrow.h"
+#include <stdint.h>
+#include <string.h>
+
+// Enough lines to outvote a few ragged ones, few enough to keep sniffing cheap.
+#define MAX_LINES 64
+#define MAX_COLUMNS 64
+
+// In order of preference, if the counts tie.
+static const char col_seps[] = {',', ';', '\t', '|'};
+#define NCOL_SEPS ((int)sizeof(col_seps))
+
+typedef struct {
+  const char *ptr, *end;
+} Line;
+
+// Returns the end of the line that starts at `ptr`, not following line breaks
+// in quoted fields if `quote_char` is nonzero.
+static const char *line_end(const char *ptr, const char *pe, char quote_char) {
+  int quoted = 0;
+
+  for (; ptr < pe; ptr++) {
+    if (*ptr == quote_char && quote_char) {
+      quoted = !quoted;
+    }
+    else if (!quoted && (*ptr == '\n' || *ptr == '\r')) {
+      break;
+    }
+  }
+
+  return ptr;
+}
+
+// Skips a line break.
+static const char *next_line(const char *ptr, const char *pe) {
+  if (ptr < pe && *ptr++ == '\r' && ptr < pe && *ptr == '\n') {
+    ptr++;
+  }
+  return ptr;
+}
+
+// A quote character is usually at the start or the end of a field, that is,
+// next to a line break, a column separator or the end of the sample.
+static char sniff_quote_char(const char *ptr, const char *pe) {
+  static const char quote_chars[] = {'"', '\''};
+  long scores[2] = {0, 0};
+  const char *p;
+  int i;
+
+  for (p = ptr; p < pe; p++) {
+    for (i = 0; i < 2; i++) {
+      if (*p == quote_chars[i]) {
+        char before = p > ptr ? p[-1] : '\n', after = p + 1 < pe ? p[1] : '\n';
+        if (before == '\n' || before == '\r' || memchr(col_seps, before, NCOL_SEPS) ||
+            after == '\n' || after == '\r' || memchr(col_seps, after, NCOL_SEPS)) {
+          scores[i]++;
+        }
+      }
+    }
+  }
+
+  // Apostrophes are common in text, so a single quote must clearly win.
+  return scores[1] > 2 * scores[0] && scores[1] >= 2 ? '\'' : '"';
+}
+
+// Counts the column separators outside quoted fields.
+static long count_outside_quotes(const Line *line, char c, char quote_char) {
+  const char *p;
+  long count = 0;
+  int quoted = 0;
+
+  for (p = line->ptr; p < line->end; p++) {
+    if (*p == quote_char) {
+      quoted = !quoted;
+    }
+    else if (*p == c && !quoted) {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+// The best column separator occurs the same nonzero number of times on the
+// most lines and, of those, the most times.
+static char sniff_col_sep(const Line *lines, int nlines, char quote_char) {
+  long counts[MAX_LINES], best_count = 0;
+  int best = 0, best_score = 0, i, j, k;
+
+  for (i = 0; i < NCOL_SEPS; i++) {
+    long count = 0;
+    int score = 0;
+    for (j = 0; j < nlines; j++) {
+      counts[j] = count_outside_quotes(&lines[j], col_seps[i], quote_char);
+    }
+    // The score is the frequency of the most frequent nonzero count.
+    for (j = 0; j < nlines; j++) {
+      int frequency = 0;
+      if (counts[j] == 0) {
+        continue;
+      }
+      for (k = 0; k < nlines; k++) {
+        frequency += counts[k] == counts[j];
+      }
+      if (frequency > score || (frequency == score && counts[j] > count)) {
+        score = frequency;
+        count = counts[j];
+      }
+    }
+    if (score > best_score || (score == best_score && count > best_count)) {
+      best = i;
+      best_score = score;
+      best_count = count;
+    }
+  }
+
+  return col_seps[best];
+}
+
+// Splits a line into at most MAX_COLUMNS fields, without their quotes.
+static int split(const Line *line, char col_sep, char quote_char, Line *fields) {
+  const char *p = line->ptr;
+  int n = 0;
+
+  while (n < MAX_COLUMNS) {
+    const char *start = p;
+    int quoted = 0;
+    for (; p < line->end && (quoted || *p != col_sep); p++) {
+      if (*p == quote_char) {
+        quoted = !quoted;
+      }
+    }
+    fields[n].ptr = start;
+    fields[n].end = p;
+    if (p - start >= 2 && *start == quote_char && p[-1] == quote_char) {
+      fields[n].ptr++;
+      fields[n].end--;
+    }
+    n++;
+    if (p == line->end) {
+      break;
+    }
+    p++;
+  }
+
+  return n;
+}
+
+static int is_number(const Line *field) {
+  int64_t integer;
+  double number;
+  long len = field->end - field->ptr;
+
+  return len > 0 && (arrow_parse_int64(field->ptr, len, &integer) || arrow_parse_float64(field->ptr, len, &number));
+}
+
+// Like Python's csv.Sniffer: the first row is a header if, in more columns
+// than not, it has text where the other rows have numbers, or a value of a
+// different length where the other rows' values all have the same length.
+static int sniff_headers(const Line *lines, int nlines, char col_sep, char quote_char) {
+  Line header[MAX_COLUMNS], fields[MAX_COLUMNS];
+  int numeric[MAX_COLUMNS];
+  long length[MAX_COLUMNS];
+  int ncolumns, votes = 0, i, j;
+
+  if (nlines < 2) {
+    return 0;
+  }
+
+  ncolumns = split(&lines[0], col_sep, quote_char, header);
+  for (j = 0; j < ncolumns; j++) {
+    numeric[j] = 1;
+    length[j] = -1;
+  }
+
+  // A column is numeric if every value is, and has a length if every value does.
+  for (i = 1; i < nlines; i++) {
+    if (split(&lines[i], col_sep, quote_char, fields) != ncolumns) {
+      continue;
+    }
+    for (j = 0; j < ncolumns; j++) {
+      long len = fields[j].end - fields[j].ptr;
+      if (numeric[j] && !is_number(&fields[j])) {
+        numeric[j] = 0;
+      }
+      if (length[j] == -1) {
+        length[j] = len;
+      }
+      else if (length[j] != len) {
+        length[j] = -2;
+      }
+    }
+  }
+
+  for (j = 0; j < ncolumns; j++) {
+    if (length[j] == -1) {
+      // No other row has as many columns.
+      return 0;
+    }
+    if (numeric[j]) {
+      votes += is_number(&header[j]) ? -1 : 1;
+    }
+    else if (length[j] >= 0) {
+      votes += header[j].end - header[j].ptr == length[j] ? -1 : 1;
+    }
+  }
+
+  return votes > 0;
+}
+
+void sniff(const char *ptr, long len, int eof, char col_sep, char quote_char, char comment_char, long skip_rows, Sniffed *sniffed) {
+  const char *p = ptr, *pe = ptr + len;
+  Line lines[MAX_LINES];
+  int nlines = 0;
+
+  sniffed->row_sep = NULL;
+  sniffed->headers = 0;
+  sniffed->quote_char = quote_char ? quote_char : sniff_quote_char(ptr, pe);
+
+  // Skips the preamble, which needn't be CSV.
+  for (; skip_rows > 0 && p < pe; skip_rows--) {
+    p = line_end(p, pe, 0);
+    p = next_line(p, pe);
+  }
+
+  while (p < pe && nlines < MAX_LINES) {
+    // Comments are skipped like the preamble.
+    int comment = comment_char && *p == comment_char;
+    const char *end = line_end(p, pe, comment ? 0 : sniffed->quote_char);
+    if (end == pe && !eof && nlines > 0) {
+      // The line may continue in the next chunk.
+      break;
+    }
+    if (end < pe && sniffed->row_sep == NULL) {
+      sniffed->row_sep = *end == '\n' ? "\n" : end + 1 < pe && end[1] == '\n' ? "\r\n" : "\r";
+    }
+    if (end > p && !comment) {
+      lines[nlines].ptr = p;
+      lines[nlines].end = end;
+      nlines++;
+    }
+    p = next_line(end, pe);
+  }
+
+  sniffed->col_sep = col_sep ? col_sep : sniff_col_sep(lines, nlines, sniffed->quote_char);
+  sniffed->headers = sniff_headers(lines, nlines, sniffed->col_sep, sniffed->quote_char);
+}
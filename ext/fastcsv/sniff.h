@@ -0,0 +1,18 @@
+#ifndef FASTCSV_SNIFF_H
+#define FASTCSV_SNIFF_H
+
+// Guesses the dialect of CSV from a sample, like the first chunk of the input.
+typedef struct {
+  char col_sep;
+  char quote_char;
+  const char *row_sep; // "\n", "\r\n", "\r" or NULL if the sample has one row
+  int headers;         // whether the first row looks like a header
+} Sniffed;
+
+// Sniffs the first `len` bytes at `ptr`. A nonzero `col_sep` or `quote_char`
+// is kept instead of guessed. The first `skip_rows` lines and the lines that
+// begin with a nonzero `comment_char` are ignored. If not `eof`, the sample's
+// last line may be incomplete, and is ignored.
+void sniff(const char *ptr, long len, int eof, char col_sep, char quote_char, char comment_char, long skip_rows, Sniffed *sniffed);
+
+#endif
@@ -0,0 +1,49 @@
+# Trains an extension built for profile-guided optimization. See extconf.rb.
+#
+# Usage: ruby train.rb path/to/fastcsv.so [file.csv ...]
+require 'csv'
+require 'stringio'
+require 'tempfile'
+require ARGV.shift
+
+parser = FastCSV::Parser.new
+dialect = FastCSV::Dialect.new(col_sep: ';')
+
+# Mixes unquoted, quoted and escaped fields, blank rows and line endings, so
+# that the profile isn't skewed toward one kind of input.
+random = Random.new(0)
+rows = 20_000.times.map do |i|
+  case i % 4
+  when 0
+    [i, random.rand, 'x' * random.rand(20), nil].join(',')
+  when 1
+    [%("#{'y' * random.rand(40)}"), %("a ""b"" c"), %("line\nbreak"), i].join(',')
+  when 2
+    ''
+  else
+    (1..random.rand(1..30)).map{|j| j.to_s * random.rand(8)}.join(',')
+  end
+end
+corpora = ["\n", "\r\n", "\r"].map{|row_sep| rows.join(row_sep) + row_sep}
+
+3.times do
+  corpora.each do |csv|
+    parser.raw_parse(csv){|row| row}
+    parser.raw_parse(StringIO.new(csv)){|row| row}
+    parser.raw_parse(csv.tr(',', ';'), dialect){|row| row}
+    parser.raw_parse(csv).first(10)
+    parser.read_columns(csv)
+    parser.count_rows(csv)
+  end
+  Tempfile.open('fastcsv') do |tempfile|
+    tempfile.write(corpora[0])
+    tempfile.flush
+    File.open(tempfile.path, 'rb'){|io| parser.raw_parse(io){|row| row}}
+  end
+  1_000.times{|i| parser.parse_line(%(#{i},"x",y\n))}
+end
+
+ARGV.each do |path|
+  File.open(path, 'rb'){|io| parser.raw_parse(io){|row| row}}
+  File.open(path, 'rb'){|io| parser.count_rows(io)}
+end
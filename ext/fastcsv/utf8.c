@@ -0,0 +1,80 @@
+#include "utf8.h"
+#include <stdint.h>
+#include <string.h>
+
+// A function that benefits from wider vectors is compiled for each target, and
+// the dynamic loader picks the version for the CPU. See extconf.rb.
+#ifdef HAVE_TARGET_CLONES
+#define DISPATCH __attribute__((target_clones("avx2", "default")))
+#else
+#define DISPATCH
+#endif
+
+// Returns a pointer to the first byte that doesn't begin a valid UTF-8
+// character, or NULL. Runs of ASCII are skipped 32 bytes at a time, by OR-ing
+// four 64-bit words, and then 8 bytes at a time. The loops are plain C, which
+// the compiler may or may not vectorize in the AVX2 clone.
+DISPATCH const char *find_invalid_utf8(const char *start, const char *end) {
+  const unsigned char *p = (const unsigned char *)start, *pe = (const unsigned char *)end;
+
+  while (p < pe) {
+    uint64_t word;
+    unsigned char lower = 0x80, upper = 0xBF;
+    int n;
+
+    while (pe - p >= 32) {
+      uint64_t words[4];
+      memcpy(words, p, 32);
+      if ((words[0] | words[1] | words[2] | words[3]) & UINT64_C(0x8080808080808080)) {
+        break;
+      }
+      p += 32;
+    }
+    while (pe - p >= 8) {
+      memcpy(&word, p, 8);
+      if (word & UINT64_C(0x8080808080808080)) {
+        break;
+      }
+      p += 8;
+    }
+    if (p == pe) {
+      break;
+    }
+    if (*p < 0x80) {
+      p++;
+      continue;
+    }
+
+    if (*p >= 0xC2 && *p <= 0xDF) {
+      n = 1;
+    }
+    else if (*p >= 0xE0 && *p <= 0xEF) {
+      n = 2;
+      if (*p == 0xE0) {
+        lower = 0xA0; // overlong
+      }
+      else if (*p == 0xED) {
+        upper = 0x9F; // surrogate
+      }
+    }
+    else if (*p >= 0xF0 && *p <= 0xF4) {
+      n = 3;
+      if (*p == 0xF0) {
+        lower = 0x90; // overlong
+      }
+      else if (*p == 0xF4) {
+        upper = 0x8F; // > U+10FFFF
+      }
+    }
+    else {
+      return (const char *)p;
+    }
+
+    if (pe - p <= n || p[1] < lower || p[1] > upper || (n > 1 && (p[2] & 0xC0) != 0x80) || (n > 2 && (p[3] & 0xC0) != 0x80)) {
+      return (const char *)p;
+    }
+    p += n + 1;
+  }
+
+  return NULL;
+}
@@ -0,0 +1,8 @@
+#ifndef FASTCSV_UTF8_H
+#define FASTCSV_UTF8_H
+
+// Returns a pointer to the first byte that doesn't begin a valid UTF-8
+// character, or NULL. Used to validate fields and Arrow utf8 columns.
+const char *find_invalid_utf8(const char *start, const char *end);
+
+#endif
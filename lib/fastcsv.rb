@@ -8,6 +8,117 @@ class FastCSV < CSV
     Parser.new.raw_parse(*args, &block)
   end
 
+  def self.read_columns(*args)
+    Parser.new.read_columns(*args)
+  end
+
+  def self.infer_schema(*args)
+    Parser.new.infer_schema(*args)
+  end
+
+  # Guesses the `:col_sep`, `:quote_char` and `:row_sep` of a String or a
+  # seekable IO, and whether its first row is a header, from its first chunk.
+  def self.sniff(input, options = Hash.new)
+    Parser.new.sniff(input, options)
+  end
+
+  # The directory of `fastcsv.h`, for native extensions that use FastCSV's C
+  # API.
+  def self.include_dir
+    File.expand_path('../ext/fastcsv', __dir__)
+  end
+
+  # Counts the rows in the CSV file at `path`, without parsing fields.
+  def self.count_rows(path, options = Hash.new)
+    File.open(path, 'rb') do |f|
+      Parser.new.count_rows(f, path_options(path, options))
+    end
+  end
+
+  # Returns the first row of the CSV file at `path`, reading no further than
+  # the chunk that contains it.
+  def self.headers(path, options = Hash.new)
+    File.open(path) do |f|
+      Parser.new.parse_line(f, path_options(path, options))
+    end
+  end
+
+  # Parses the first row in C, without creating a FastCSV instance, unless
+  # given options that only CSV implements, like `:converters`.
+  def self.parse_line(line, options = Hash.new)
+    if Dialect === options || (options.keys - PARSE_LINE_OPTIONS).empty?
+      Parser.new.parse_line(line, options)
+    else
+      super(line, **options)
+    end
+  end
+
+  # Writes the CSV file at `input_path` to `output_path` in the Arrow IPC
+  # streaming format. The `:schema` option maps column names to types, in
+  # order. Returns the number of rows written. The stream is written to a
+  # temporary file that replaces `output_path` once the input is parsed, so
+  # that an error doesn't leave a truncated stream.
+  def self.to_arrow(input_path, output_path, options = Hash.new)
+    options = path_options(input_path, options)
+    temp_path = "#{output_path}.#{Process.pid}.tmp"
+    begin
+      rows = File.open(input_path, 'rb') do |input|
+        File.open(temp_path, 'wb') do |output|
+          Parser.new.to_arrow(input, output, options)
+        end
+      end
+      File.rename(temp_path, output_path)
+      rows
+    ensure
+      File.unlink(temp_path) if File.exist?(temp_path)
+    end
+  end
+
+  # Decompresses files whose names end in `.gz` or `.zst`, unless the
+  # `:compression` option is given.
+  def self.foreach(path, options = Hash.new, &block)
+    super(path, **path_options(path, options), &block)
+  end
+
+  def self.path_options(path, options)
+    if path.to_s[/\.(?:gz|zst)\z/] && !options.key?(:compression)
+      options = options.merge(compression: :auto)
+    end
+    options
+  end
+  private_class_method :path_options
+
+  # Adds `String#parse_fastcsv`, like `String#parse_csv`.
+  #
+  #     using FastCSV::StringRefinement
+  #     "foo,bar\n".parse_fastcsv # => ["foo", "bar"]
+  module StringRefinement
+    refine String do
+      def parse_fastcsv(options = Hash.new)
+        FastCSV.parse_line(self, options)
+      end
+    end
+  end
+
+  # Options that are passed to `raw_parse` instead of to CSV, which doesn't
+  # accept them or, like `:strip` and `:nil_value`, implements them in Ruby, in
+  # the parser that `#shift` replaces.
+  RAW_PARSE_OPTIONS = [:compression, :read_ahead, :strict_width, :strip, :comment_char, :skip_rows, :escape_char, :null_marker, :null_values,
+                       :validate_encoding, :replace, :nil_value, :empty_value]
+
+  # Options that `parse_line` passes to the parser. Like `#shift`, it ignores
+  # `:row_sep`.
+  PARSE_LINE_OPTIONS = [:col_sep, :quote_char, :row_sep, :liberal_parsing] + RAW_PARSE_OPTIONS
+
+  def initialize(data, options = Hash.new)
+    options = options.dup
+    @raw_parse_options = {}
+    RAW_PARSE_OPTIONS.each do |key|
+      @raw_parse_options[key] = options.delete(key) if options.key?(key)
+    end
+    super(data, **options)
+  end
+
   def row
     parser && parser.row
   end
@@ -27,11 +138,7 @@ class FastCSV < CSV
 
     # The CSV library wraps File objects, whereas `FastCSV.raw_parse` accepts
     # IO-like objects that implement `#read(length)`.
-    begin
-      unless csv = fiber.resume # was unless parse = @io.gets(@row_sep)
-        return nil
-      end
-    rescue FiberError
+    unless csv = rows.shift # was unless parse = @io.gets(@row_sep)
       return nil
     end
 
@@ -58,7 +165,7 @@ class FastCSV < CSV
     end
     # PASTE
 
-    return shift if @skip_lines and @skip_lines.match row # was next if @skip_lines and @skip_lines.match parse
+    return shift if @skip_lines and !skip_lines_prefix and @skip_lines.match row # was next if @skip_lines and @skip_lines.match parse
 
     # COPY
     @lineno += 1
@@ -81,28 +188,28 @@ class FastCSV < CSV
   end
 
   # CSV's delegated and overwritten IO methods move the pointer within the file,
-  # but FastCSV doesn't notice, so we need to recreate the fiber. The old fiber
-  # is garbage collected.
+  # but FastCSV doesn't notice, so we need to recreate the rows. The old rows
+  # are garbage collected.
 
   def pos=(*args)
     super
     @parser = nil
-    @fiber = nil
+    @rows = nil
   end
   def reopen(*args)
     super
     @parser = nil
-    @fiber = nil
+    @rows = nil
   end
   def seek(*args)
     super
     @parser = nil
-    @fiber = nil
+    @rows = nil
   end
   def rewind
     super
     @parser = nil
-    @fiber = nil
+    @rows = nil
   end
 
 private
@@ -111,9 +218,11 @@ private
     @parser ||= Parser.new
   end
 
-  def fiber
-    # @see http://www.ruby-doc.org/core-2.1.4/Fiber.html
-    @fiber ||= Fiber.new do
+  # `raw_parse` returns the rows one at a time without a block. If `:skip_lines`
+  # is a literal prefix, the parser skips the rows that it matches. Blank rows
+  # are skipped in `#shift`, because they count toward `#lineno`.
+  def rows
+    @rows ||= begin
       if @io.respond_to?(:internal_encoding)
         enc2 = @io.external_encoding
         enc = @io.internal_encoding || '-'
@@ -123,10 +232,22 @@ private
           encoding = enc
         end
       end
-      parser.raw_parse(@io, encoding: encoding, quote_char: quote_char, col_sep: col_sep, row_sep: row_sep) do |row|
-        Fiber.yield(row)
+      options = @raw_parse_options.merge(encoding: encoding, quote_char: quote_char, col_sep: col_sep, row_sep: row_sep)
+      options[:skip_lines] = skip_lines_prefix if skip_lines_prefix
+      options[:liberal_parsing] = true if respond_to?(:liberal_parsing?) && liberal_parsing?
+      parser.raw_parse(@io, options)
+    end
+  end
+
+  # Returns the prefix if `:skip_lines` is a Regexp like /\A#/, or nil.
+  def skip_lines_prefix
+    unless defined?(@skip_lines_prefix)
+      @skip_lines_prefix = nil
+      if Regexp === @skip_lines && @skip_lines.options & (Regexp::IGNORECASE | Regexp::EXTENDED) == 0 && @skip_lines.source =~ /\A\\A((?:[^\\^$.|?*+()\[\]{}\r\n]|\\[^A-Za-z0-9\r\n])+)\z/
+        @skip_lines_prefix = $1.gsub(/\\(.)/, '\1')
       end
     end
+    @skip_lines_prefix
   end
 end
 
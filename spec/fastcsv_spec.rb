@@ -1,8 +1,15 @@
 # coding: utf-8
 require 'spec_helper'
 
+require 'fileutils'
+require 'tempfile'
+require 'tmpdir'
+require 'zlib'
+
 $ORIGINAL_VERBOSE = $VERBOSE
 
+using FastCSV::StringRefinement
+
 RSpec.shared_examples 'a CSV parser' do
   let :simple do
     "foo\nbar\nbaz"
@@ -158,16 +165,16 @@ RSpec.shared_examples 'a CSV parser' do
   end
 
   context 'when initializing' do
-    it 'should raise an error if no block is given' do
-      expect{parse_without_block('x')}.to raise_error(LocalJumpError, 'no block given')
+    it 'should return the rows if no block is given' do
+      expect(parse_without_block(simple)).to eq(CSV.parse(simple))
     end
 
-    it 'should not raise an error if no block and empty input' do
-      expect{parse_without_block('')}.to_not raise_error
+    it 'should return no rows if no block and empty input' do
+      expect(parse_without_block('')).to eq([])
     end
 
     it 'should raise an error if the options are not a Hash or nil' do
-      expect{parse('', '')}.to raise_error(ArgumentError, 'options has to be a Hash or nil')
+      expect{parse('', '')}.to raise_error(ArgumentError, 'options has to be a Hash, a FastCSV::Dialect or nil')
     end
   end
 
@@ -252,6 +259,14 @@ RSpec.shared_examples 'with encoded strings' do
 end
 
 RSpec.describe FastCSV do
+  # Parses a String with a block, like #shift. The contexts for each kind of
+  # input define their own.
+  def parse(csv, options)
+    rows = []
+    FastCSV.raw_parse(csv, options){|row| rows << row}
+    rows
+  end
+
   context "with String" do
     def parse(csv, options = nil, parser = FastCSV)
       rows = []
@@ -260,11 +275,25 @@ RSpec.describe FastCSV do
     end
 
     def parse_without_block(csv, options = nil)
-      FastCSV.raw_parse(csv, options)
+      FastCSV.raw_parse(csv, options).to_a
     end
 
     include_examples 'a CSV parser'
 
+    it 'should parse a frozen String' do
+      expect(parse(simple.freeze)).to eq(CSV.parse(simple))
+    end
+
+    it 'should not be affected by changes to the String' do
+      csv = "foo\nbar\nbaz"
+      rows = []
+      FastCSV.raw_parse(csv) do |row|
+        rows << row
+        csv.replace('x')
+      end
+      expect(rows).to eq(CSV.parse(simple))
+    end
+
     it 'should not raise an error on negative buffer size' do
       parser = FastCSV::Parser.new
       parser.buffer_size = -1
@@ -281,11 +310,25 @@ RSpec.describe FastCSV do
     end
 
     def parse_without_block(csv, options = nil)
-      FastCSV.raw_parse(StringIO.new(csv), options)
+      FastCSV.raw_parse(StringIO.new(csv), options).to_a
     end
 
     include_examples 'a CSV parser'
 
+    it 'should read from the current position' do
+      io = StringIO.new(simple)
+      io.gets
+      rows = []
+      FastCSV.raw_parse(io){|row| rows << row}
+      expect(rows).to eq([["bar"], ["baz"]])
+      expect(io.eof?).to eq(true)
+    end
+
+    it 'should raise an error on illegal quoting before the last buffer' do
+      csv = %(x"x\n) + "x,y\n" * 5_000
+      expect{parse(csv)}.to raise_error(FastCSV::MalformedCSVError, 'Illegal quoting in line 1.')
+    end
+
     it 'should raise an error on negative buffer size' do
       parser = FastCSV::Parser.new
       parser.buffer_size = -1
@@ -294,6 +337,83 @@ RSpec.describe FastCSV do
     end
   end
 
+  context "with File" do
+    def open_file(csv)
+      Tempfile.open('fastcsv') do |tempfile|
+        tempfile.write(csv)
+        tempfile.close
+        File.open(tempfile.path) do |f|
+          yield f
+        end
+      end
+    end
+
+    def parse(csv, options = nil, parser = FastCSV)
+      rows = []
+      open_file(csv) do |f|
+        parser.raw_parse(f, options){|row| rows << row}
+      end
+      rows
+    end
+
+    def parse_without_block(csv, options = nil)
+      open_file(csv) do |f|
+        FastCSV.raw_parse(f, options).to_a
+      end
+    end
+
+    include_examples 'a CSV parser'
+
+    it 'should read data buffered by the IO' do
+      rows = []
+      open_file("foo\nbar\nbaz") do |f|
+        f.gets
+        FastCSV.raw_parse(f){|row| rows << row}
+      end
+      expect(rows).to eq([["bar"], ["baz"]])
+    end
+
+    it 'should read ahead' do
+      csv = "foo,\"bar\nbaz\"\n" * 5_000
+      expect(parse(csv, read_ahead: true)).to eq(CSV.parse(csv))
+    end
+
+    it 'should read ahead with a small buffer' do
+      parser = FastCSV::Parser.new
+      parser.buffer_size = 5
+      expect(parse(simple, {read_ahead: true}, parser)).to eq(CSV.parse(simple))
+    end
+
+    it 'should read ahead after data buffered by the IO' do
+      rows = []
+      open_file("foo\nbar\nbaz") do |f|
+        f.gets
+        FastCSV.raw_parse(f, read_ahead: true){|row| rows << row}
+      end
+      expect(rows).to eq([["bar"], ["baz"]])
+    end
+
+    it 'should stop reading ahead if the block breaks' do
+      open_file("foo\n" * 10_000) do |f|
+        FastCSV.raw_parse(f, read_ahead: true){|row| break}
+      end
+    end
+
+    it 'should raise an error if the read ahead option is invalid' do
+      expect{parse(simple, read_ahead: 'x')}.to raise_error(ArgumentError, ':read_ahead has to be true or false')
+    end
+
+    it 'should read from a pipe' do
+      rows = []
+      IO.pipe do |r, w|
+        w.write(simple)
+        w.close
+        FastCSV.raw_parse(r){|row| rows << row}
+      end
+      expect(rows).to eq(CSV.parse(simple))
+    end
+  end
+
   context 'with encoded unquoted fields' do
     def suffix
       ''
@@ -310,6 +430,850 @@ RSpec.describe FastCSV do
     include_examples 'with encoded strings'
   end
 
+  context 'when validating encoding' do
+    it 'should not validate by default' do
+      expect(parse("x,\xFF\n", nil)).to eq([["x", "\xFF"]])
+    end
+
+    it 'should raise an error with the line number and byte offset' do
+      expect{parse("x,y\nx,\"y\xC3(\"\n", validate_encoding: true)}.to raise_error(FastCSV::MalformedCSVError, 'Invalid byte sequence in line 2 (byte offset 8).')
+    end
+
+    it 'should report the line of an invalid byte in a multiline field' do
+      expect{parse("x\n\"a\nb\",\"c\r\nd\xFF\"\n", validate_encoding: true)}.to raise_error(FastCSV::MalformedCSVError, 'Invalid byte sequence in line 4 (byte offset 13).')
+      expect{parse("\"a\nb\"\nc\xFF\n", validate_encoding: true)}.to raise_error(FastCSV::MalformedCSVError, 'Invalid byte sequence in line 3 (byte offset 7).')
+    end
+
+    it 'should raise an error after a buffer boundary' do
+      csv = StringIO.new("x,y\n" * 5_000 + "\xF0\x28\n")
+      expect{parse(csv, validate_encoding: true)}.to raise_error(FastCSV::MalformedCSVError, 'Invalid byte sequence in line 5001 (byte offset 20000).')
+    end
+
+    it 'should replace invalid bytes' do
+      expect(parse("\xED\xA0\x80,\"\xC0\x80\"\n", validate_encoding: :replace)).to eq([["\uFFFD\uFFFD\uFFFD", "\uFFFD\uFFFD"]])
+    end
+
+    it 'should replace invalid bytes with a custom replacement' do
+      expect(parse("\xE2\x82,\u20AC\n", validate_encoding: :replace, replace: '')).to eq([["", "\u20AC"]])
+    end
+
+    it 'should validate the external encoding when transcoding' do
+      expect(parse("\xE9".force_encoding('iso-8859-1'), validate_encoding: true, encoding: 'iso-8859-1:utf-8')).to eq([["\u00E9"]])
+    end
+
+    it 'should raise an error if the option is invalid' do
+      expect{parse('', validate_encoding: 'x')}.to raise_error(ArgumentError, ':validate_encoding has to be true, false or :replace')
+    end
+  end
+
+  context 'when checking row widths' do
+    it 'should allow rows of other widths by default' do
+      expect(parse("a,b\n1\n1,2,3\n", nil)).to eq([["a", "b"], ["1"], ["1", "2", "3"]])
+    end
+
+    it 'should allow blank rows' do
+      expect(parse("\na,b\n\n1,2\n", strict_width: true)).to eq([[], ["a", "b"], [], ["1", "2"]])
+    end
+
+    it 'should raise an error on a short row' do
+      expect{parse("a,b\n1,2\n1\n", strict_width: true)}.to raise_error(FastCSV::MalformedCSVError, 'Expected 2 fields but found 1 in line 3.')
+    end
+
+    it 'should raise an error on a long row' do
+      expect{parse("a,b\n1,2,\"3\"", strict_width: true)}.to raise_error(FastCSV::MalformedCSVError, 'Expected 2 fields but found 3 in line 2.')
+    end
+
+    it 'should raise an error if the option is invalid' do
+      expect{parse('', strict_width: 'x')}.to raise_error(ArgumentError, ':strict_width has to be true or false')
+    end
+  end
+
+  context 'when stripping' do
+    [
+      "a , ,b ,\t c\t\n",
+      "  \n\v1\f,\"2 \"\n",
+      " x\r\n",
+      " \"a\" ,b\n",
+      "\"a\nb\"\t, \"c\"\n",
+    ].each do |csv|
+      it "should strip like CSV: #{csv.inspect.gsub('\"', '"')}" do
+        expect(parse(csv, strip: true)).to eq(CSV.parse(csv, strip: true))
+      end
+    end
+
+    it 'should strip around quoted fields with :liberal_parsing' do
+      expect(parse(%( "a" ,"b"c\n), strip: true, liberal_parsing: true)).to eq([["a", %("b"c)]])
+    end
+
+    it 'should strip the characters of a String' do
+      expect(parse("xa x,xbx,xx\n", strip: 'x')).to eq([["a ", "b", nil]])
+    end
+
+    it 'should strip fields in Arrays of columns' do
+      expect(FastCSV.read_columns(" a , b \n 1,2 ", strip: true)).to eq([["a", "1"], ["b", "2"]])
+    end
+
+    it 'should raise an error if the option is invalid' do
+      expect{parse('', strip: 1)}.to raise_error(ArgumentError, ':strip has to be true, false or a String of ASCII characters')
+      expect{parse('', strip: "\u00A0")}.to raise_error(ArgumentError, ':strip has to be true, false or a String of ASCII characters')
+    end
+  end
+
+  context 'when skipping rows' do
+    let(:csv) { "#x,y\n\na,b\n#\n\n1,\"2\n#3\"\n#last" }
+
+    it 'should skip blank rows' do
+      expect(parse(csv, skip_blanks: true)).to eq([["#x", "y"], ["a", "b"], ["#"], ["1", "2\n#3"], ["#last"]])
+    end
+
+    it 'should skip rows that begin with a prefix' do
+      expect(parse(csv, skip_lines: '#')).to eq([[], ["a", "b"], [], ["1", "2\n#3"]])
+      expect(parse("//x\n/y\n", skip_lines: '//')).to eq([["/y"]])
+    end
+
+    it 'should skip rows across chunks' do
+      (1..6).each do |buffer_size|
+        parser = FastCSV::Parser.new
+        parser.buffer_size = buffer_size
+        expect(parser.raw_parse(StringIO.new(csv), skip_blanks: true, skip_lines: '#').to_a).to eq([["a", "b"], ["1", "2\n#3"]])
+      end
+    end
+
+    it 'should skip rows in Arrays of columns' do
+      expect(FastCSV.read_columns(csv, skip_blanks: true, skip_lines: '#')).to eq([["a", "1"], ["b", "2\n#3"]])
+    end
+
+    it 'should not check the widths of skipped rows' do
+      expect(parse(csv, skip_blanks: true, skip_lines: '#', strict_width: true)).to eq([["a", "b"], ["1", "2\n#3"]])
+    end
+
+    it 'should raise an error if the option is invalid' do
+      expect{parse('', skip_blanks: 'x')}.to raise_error(ArgumentError, ':skip_blanks has to be true or false')
+      expect{parse('', skip_lines: /#/)}.to raise_error(ArgumentError, ":skip_lines has to be a String without \\r or \\n")
+      expect{parse('', skip_lines: "#\n")}.to raise_error(ArgumentError, ":skip_lines has to be a String without \\r or \\n")
+    end
+  end
+
+  context 'when discarding lines' do
+    let(:csv) { %(Exported "daily\r\nby: x, y\r\na,b\r\n# it's "1"\r\n1,"2\r\n#3"\r\n#last) }
+
+    it 'should discard the first lines and comment lines, without parsing them' do
+      expect(parse(csv, skip_rows: 2, comment_char: '#')).to eq([["a", "b"], ["1", "2\r\n#3"]])
+    end
+
+    it 'should discard lines across chunks' do
+      (1..6).each do |buffer_size|
+        parser = FastCSV::Parser.new
+        parser.buffer_size = buffer_size
+        expect(parser.raw_parse(StringIO.new(csv), skip_rows: 2, comment_char: '#').to_a).to eq([["a", "b"], ["1", "2\r\n#3"]])
+      end
+    end
+
+    it 'should discard lines in Arrays of columns' do
+      expect(FastCSV.read_columns(csv, skip_rows: 2, comment_char: '#')).to eq([["a", "1"], ["b", "2\r\n#3"]])
+    end
+
+    it 'should count discarded lines in error messages' do
+      expect{parse(%(#"\n#\na"b\n), comment_char: '#')}.to raise_error(FastCSV::MalformedCSVError, 'Illegal quoting in line 3.')
+    end
+
+    it 'should raise an error if the option is invalid' do
+      expect{parse('', comment_char: '##')}.to raise_error(ArgumentError, ":comment_char has to be a single character String other than \\r or \\n")
+      expect{parse('', skip_rows: -1)}.to raise_error(ArgumentError, ':skip_rows has to be a non-negative Integer')
+    end
+  end
+
+  context 'when parsing liberally' do
+    [
+      %(ab"c,d\n),
+      %("ab"c,d\n),
+      %(a,"b"c"d",e\n),
+      %(x""y,z\n),
+      %("a" ,b\n),
+      %("a"b"\nc"\n),
+      %(""x,y\n),
+      %(a,b"),
+    ].each do |csv|
+      it "should parse #{csv.inspect} like CSV" do
+        expect(parse(csv, liberal_parsing: true)).to eq(CSV.parse(csv, liberal_parsing: true))
+      end
+    end
+
+    it 'should parse valid CSV as usual' do
+      csv = %(a,"b ""c""",\n"d\ne",f\n)
+      expect(parse(csv, liberal_parsing: true)).to eq(parse(csv, {}))
+    end
+
+    it 'should parse across chunks' do
+      csv = %(a"b,"c"d\n"e"f"\ng"\n)
+      (1..6).each do |buffer_size|
+        parser = FastCSV::Parser.new
+        parser.buffer_size = buffer_size
+        expect(parser.raw_parse(StringIO.new(csv), liberal_parsing: true).to_a).to eq([[%(a"b), %("c"d)], [%("e"f")], [%(g")]])
+      end
+    end
+
+    it 'should raise an error if a quoted field is unclosed' do
+      expect{parse(%(a\n"b), liberal_parsing: true)}.to raise_error(FastCSV::MalformedCSVError, 'Unclosed quoted field on line 2.')
+    end
+
+    it 'should raise an error if the option is invalid' do
+      expect{parse('', liberal_parsing: 'x')}.to raise_error(ArgumentError, ':liberal_parsing has to be true or false')
+    end
+  end
+
+  context 'with an escape character' do
+    it 'should unescape unquoted and quoted fields' do
+      csv = %(a\\,b,c\\"d,\\\\,"e\\"f",\\n\\t\\0\\Z\n)
+      expect(parse(csv, escape_char: '\\')).to eq([["a,b", %(c"d), "\\", %(e"f), "\n\t\0\x1A"]])
+    end
+
+    it 'should read doubled quote characters in quoted fields' do
+      expect(parse(%("a""b\\"",c\n), escape_char: '\\')).to eq([[%(a"b"), "c"]])
+    end
+
+    it 'should read escaped line breaks in quoted fields' do
+      expect(parse(%("a\\\nb",c\n), escape_char: '\\')).to eq([["a\nb", "c"]])
+    end
+
+    it 'should read escaped line breaks in unquoted fields' do
+      expect(parse("a\\\nb,c\n", escape_char: '\\')).to eq([["a\nb", "c"]])
+      expect(parse("a\\\r\nb\n", escape_char: '\\')).to eq([["a\r"], ["b"]])
+    end
+
+    it 'should read a trailing escape character as itself' do
+      expect(parse("a\nb\\", escape_char: '\\')).to eq([["a"], ["b\\"]])
+    end
+
+    it 'should read the null marker as nil' do
+      csv = %(1\t\\N\t"\\N"\tN\n)
+      expect(parse(csv, col_sep: "\t", escape_char: '\\', null_marker: '\\N')).to eq([["1", nil, "N", "N"]])
+      expect(parse("NULL,a\n", null_marker: 'NULL')).to eq([[nil, "a"]])
+    end
+
+    it 'should unescape across chunks' do
+      csv = %(a\\,b,"c\\"d"\n\\N,\\\\\n)
+      (1..6).each do |buffer_size|
+        parser = FastCSV::Parser.new
+        parser.buffer_size = buffer_size
+        expect(parser.raw_parse(StringIO.new(csv), escape_char: '\\', null_marker: '\\N').to_a).to eq([["a,b", %(c"d)], [nil, "\\"]])
+      end
+    end
+
+    it 'should unescape in Arrays of columns' do
+      expect(FastCSV.read_columns(%(a\\,b,\\N\n), escape_char: '\\', null_marker: '\\N')).to eq([["a,b"], [nil]])
+    end
+
+    it 'should raise an error if the option is invalid' do
+      expect{parse('', escape_char: '\\\\')}.to raise_error(ArgumentError, ":escape_char has to be a single character String other than \\r or \\n")
+      expect{parse('', null_marker: '')}.to raise_error(ArgumentError, ':null_marker has to be a non-empty String')
+    end
+  end
+
+  context 'with null and empty values' do
+    let(:csv) { %(a,,""\nNULL\n\n"NA",NA,x\n) }
+
+    it 'should return the values for empty fields' do
+      expect(parse(csv, nil_value: '', empty_value: :empty)).to eq([["a", "", :empty], ["NULL"], [], ["NA", "NA", "x"]])
+      expect(parse(csv, empty_value: nil)).to eq([["a", nil, nil], ["NULL"], [], ["NA", "NA", "x"]])
+    end
+
+    it 'should return nil for unquoted null values' do
+      expect(parse(csv, null_values: ["NULL", "NA"], nil_value: '')).to eq([["a", "", ""], [nil], [], ["NA", nil, "x"]])
+    end
+
+    it 'should add the null marker to the null values' do
+      expect(parse(%(\\N,NULL\n), escape_char: '\\', null_marker: '\N', null_values: ['NULL'])).to eq([[nil, nil]])
+      expect(parse(%(\\N,NULL\n), escape_char: '\\', null_marker: '\N', null_values: nil)).to eq([[nil, "NULL"]])
+    end
+
+    it 'should keep the null marker and the null values given to the parser and the call' do
+      parser = FastCSV::Parser.new(null_marker: 'X')
+      expect(parser.raw_parse("X,Y,Z\n", null_values: ['Y']).to_a).to eq([[nil, nil, "Z"]])
+      parser = FastCSV::Parser.new(null_values: ['Y'])
+      expect(parser.raw_parse("X,Y,Z\n", null_marker: 'X').to_a).to eq([[nil, nil, "Z"]])
+      expect(parser.raw_parse("X,Y,Z\n", null_marker: nil).to_a).to eq([["X", nil, "Z"]])
+    end
+
+    it 'should share one frozen value' do
+      rows = parse("a,\nb,\n", nil_value: 'x')
+      expect(rows[0][1].frozen?).to eq(true)
+      expect(rows[0][1]).to be(rows[1][1])
+    end
+
+    it 'should return the values in Arrays of columns' do
+      expect(FastCSV.read_columns(csv, null_values: ["NULL"], nil_value: 0)).to eq([["a", nil, nil, "NA"], [0, nil, nil, "NA"], ["", nil, nil, "x"]])
+    end
+
+    it 'should return the values across chunks' do
+      (1..6).each do |buffer_size|
+        parser = FastCSV::Parser.new
+        parser.buffer_size = buffer_size
+        expect(parser.raw_parse(StringIO.new(csv), null_values: ["NULL", "NA"], empty_value: nil).to_a).to eq([["a", nil, nil], [nil], [], ["NA", nil, "x"]])
+      end
+    end
+
+    it 'should raise an error if the option is invalid' do
+      expect{parse('', null_values: "NULL")}.to raise_error(ArgumentError, ':null_values has to be an Array of non-empty Strings')
+      expect{parse('', null_values: [""])}.to raise_error(ArgumentError, ':null_values has to be an Array of non-empty Strings')
+    end
+  end
+
+  context 'when sniffing' do
+    it 'should guess the column separator' do
+      expect(FastCSV.sniff("a,b;c\n1,2;3\n")[:col_sep]).to eq(',')
+      expect(FastCSV.sniff("a;b;c,d\n1;2;3,4\n")[:col_sep]).to eq(";")
+      expect(FastCSV.sniff("a\tb\n1\t2\n")[:col_sep]).to eq("\t")
+      expect(FastCSV.sniff("a|b|c\n1|2|3\nx,y|z|w\n")[:col_sep]).to eq('|')
+      expect(FastCSV.sniff(%(a;"b,c"\n1;"2,3"\n))[:col_sep]).to eq(';')
+      expect(FastCSV.sniff("abc\n")[:col_sep]).to eq(',')
+    end
+
+    it 'should guess the quote character' do
+      expect(FastCSV.sniff(%('a,b',c\n'1',2\n))[:quote_char]).to eq("'")
+      expect(FastCSV.sniff(%("it's",c\n"that's",2\n))[:quote_char]).to eq('"')
+      expect(FastCSV.sniff("a,b\n")[:quote_char]).to eq('"')
+    end
+
+    it 'should guess the row separator' do
+      expect(FastCSV.sniff("a,b\r\n1,2\r\n")[:row_sep]).to eq("\r\n")
+      expect(FastCSV.sniff(%("a\nb",c\r1,2\r))[:row_sep]).to eq("\r")
+      expect(FastCSV.sniff("a,b")[:row_sep]).to eq(nil)
+    end
+
+    it 'should guess whether the first row is a header' do
+      expect(FastCSV.sniff("name,age\nalice,30\nbob,4\n")[:headers]).to eq(true)
+      expect(FastCSV.sniff("1,2\n3,4\n")[:headers]).to eq(false)
+      expect(FastCSV.sniff("id,code\n1,AB\n2,CD\n")[:headers]).to eq(true)
+      expect(FastCSV.sniff("ab,x\ncd,yy\nef,z\n")[:headers]).to eq(false)
+      expect(FastCSV.sniff("a,b\n")[:headers]).to eq(false)
+    end
+
+    it 'should ignore discarded lines' do
+      expect(FastCSV.sniff("Report; daily\n# x;y;z\na,b\n1,2\n", skip_rows: 1, comment_char: '#')).to eq(col_sep: ',', quote_char: '"', row_sep: "\n", headers: true)
+    end
+
+    it 'should keep the options that are given' do
+      expect(FastCSV.sniff("a;b\n1;2\n", col_sep: '|')[:col_sep]).to eq('|')
+    end
+
+    it 'should not move an IO' do
+      io = StringIO.new("x\na;b\n1;2\n")
+      io.gets
+      expect(FastCSV.sniff(io)).to eq(col_sep: ';', quote_char: '"', row_sep: "\n", headers: true)
+      expect(io.read).to eq("a;b\n1;2\n")
+    end
+
+    it 'should parse with the guessed options' do
+      csv = %('a';'b,c'\n'1';'2;3'\n)
+      expect(parse(csv, col_sep: :auto, quote_char: :auto)).to eq([["a", "b,c"], ["1", "2;3"]])
+      expect(parse(StringIO.new(csv), col_sep: :auto, quote_char: :auto)).to eq([["a", "b,c"], ["1", "2;3"]])
+      expect(FastCSV.read_columns(csv, FastCSV::Dialect.new(col_sep: :auto, quote_char: :auto))).to eq([["a", "1"], ["b,c", "2;3"]])
+      expect(FastCSV::Parser.new(col_sep: :auto).count_rows("a;b\n1;2\n")).to eq(2)
+      expect(parse("a\tb\n", col_sep: :auto, quote_char: :auto)).to eq([["a", "b"]])
+    end
+
+    it 'should keep a separator that is given after :auto' do
+      expect(FastCSV::Parser.new(col_sep: :auto).raw_parse("a;b\n", col_sep: ',').to_a).to eq([["a;b"]])
+    end
+  end
+
+  describe 'Parser#parse' do
+    it 'should return the rows without a block' do
+      expect(FastCSV::Parser.new.parse("a,b\n1,2\n")).to eq([["a", "b"], ["1", "2"]])
+    end
+
+    it 'should yield the rows with a block' do
+      rows = []
+      FastCSV::Parser.new.parse("a,b\n1,2\n"){|row| rows << row}
+      expect(rows).to eq([["a", "b"], ["1", "2"]])
+    end
+
+    it 'should use the options given to the parser' do
+      parser = FastCSV::Parser.new(col_sep: ';', quote_char: "'")
+      expect(parser.parse("a;'b;c'\n")).to eq([["a", "b;c"]])
+      expect(parser.parse(StringIO.new("d;'e'\n"))).to eq([["d", "e"]])
+    end
+
+    it 'should override the options given to the parser' do
+      parser = FastCSV::Parser.new(col_sep: ';', strict_width: true)
+      expect(parser.parse("a,b\n1\n", col_sep: ',', strict_width: false)).to eq([["a", "b"], ["1"]])
+      expect(parser.parse("a;b\n")).to eq([["a", "b"]])
+    end
+
+    it 'should parse many inputs' do
+      parser = FastCSV::Parser.new
+      1_000.times do |i|
+        csv = "#{i},\"#{'x' * (i % 50)}\"\n#{i}"
+        expect(parser.parse(csv)).to eq(CSV.parse(csv))
+      end
+    end
+
+    it 'should parse with the same parser from the block' do
+      parser = FastCSV::Parser.new
+      rows = []
+      parser.parse("a\nb"){|row| rows << row + parser.parse("c,\"d\"").flatten}
+      expect(rows).to eq([["a", "c", "d"], ["b", "c", "d"]])
+    end
+
+    it 'should raise an error if the options are invalid' do
+      expect{FastCSV::Parser.new('')}.to raise_error(ArgumentError, 'options has to be a Hash, a FastCSV::Dialect or nil')
+      expect{FastCSV::Parser.new(col_sep: ';;')}.to raise_error(ArgumentError, ':col_sep has to be a single character String or :auto')
+    end
+  end
+
+  describe FastCSV::Rows do
+    let(:csv) { "a,b\n\n\"c\",d\n" }
+
+    it 'should return the rows one at a time' do
+      rows = FastCSV.raw_parse(StringIO.new(csv))
+      expect(rows.shift).to eq(["a", "b"])
+      expect(rows.next).to eq([])
+      expect(rows.shift).to eq(["c", "d"])
+      expect(rows.shift).to eq(nil)
+      expect{rows.next}.to raise_error(StopIteration)
+    end
+
+    it 'should yield the rows that have not been read' do
+      rows = FastCSV.raw_parse(csv)
+      rows.first
+      expect(rows.to_a).to eq([[], ["c", "d"]])
+    end
+
+    it 'should read only the chunks that are needed' do
+      io = StringIO.new("x,y\n" * 100_000)
+      rows = FastCSV.raw_parse(io)
+      expect(rows.lazy.map{|row| row.join}.first(3)).to eq(["xy", "xy", "xy"])
+      expect(io.pos).to eq(16_384)
+    end
+
+    it 'should not share the buffer with later calls on the parser' do
+      parser = FastCSV::Parser.new
+      csv = %(a,"b\n"\n) * 10_000
+      parser.raw_parse(csv){}
+      expect(parser.raw_parse(csv).first).to eq(["a", "b\n"])
+      expect(parser.raw_parse(csv).to_a.size).to eq(10_000)
+    end
+
+    it 'should parse rows across chunks' do
+      csv = (1..5_000).map{|i| %(#{'x' * (i % 300)},"y""#{i}\nz"\n)}.join
+      expect(FastCSV.raw_parse(StringIO.new(csv)).to_a).to eq(CSV.parse(csv, row_sep: "\n"))
+    end
+
+    it 'should raise an error at the row with the error' do
+      rows = FastCSV.raw_parse(%(a\n"b))
+      expect(rows.shift).to eq(["a"])
+      expect{rows.shift}.to raise_error(FastCSV::MalformedCSVError, 'Unclosed quoted field on line 2.')
+      expect(rows.shift).to eq(nil)
+    end
+  end
+
+  describe '.parse_line' do
+    [
+      "",
+      "\n",
+      "x,y",
+      "x,y\nz",
+      "x,\"y\nz\"\n\"",
+      %("x""y",z\r\n),
+    ].each do |csv|
+      it "should parse: #{csv.inspect.gsub('\"', '"')}" do
+        expect(FastCSV.parse_line(csv)).to eq(CSV.parse_line(csv))
+      end
+    end
+
+    it 'should accept options' do
+      expect(FastCSV.parse_line("x;'y;z'", col_sep: ';', quote_char: "'")).to eq(["x", "y;z"])
+      expect(FastCSV.parse_line("x;y", FastCSV::Dialect.new(col_sep: ';'))).to eq(["x", "y"])
+    end
+
+    it 'should pass the options that CSV doesn\'t implement to the parser' do
+      expect(FastCSV.parse_line("x,,\"\"", nil_value: '', empty_value: nil)).to eq(["x", "", nil])
+      expect(FastCSV.parse_line("x,\xFF", validate_encoding: :replace, replace: '?')).to eq(["x", "?"])
+      expect{FastCSV.parse_line("x,\xFF", validate_encoding: true)}.to raise_error(FastCSV::MalformedCSVError, 'Invalid byte sequence in line 1 (byte offset 2).')
+      expect(FastCSV::RAW_PARSE_OPTIONS).to include(:validate_encoding, :replace, :nil_value, :empty_value)
+    end
+
+    it 'should raise an error on illegal quoting' do
+      expect{FastCSV.parse_line(%(x"y))}.to raise_error(FastCSV::MalformedCSVError, 'Illegal quoting in line 1.')
+    end
+
+    it 'should be available as a String refinement' do
+      expect("x,\"y\"\n".parse_fastcsv).to eq(["x", "y"])
+      expect("x;y".parse_fastcsv(col_sep: ';')).to eq(["x", "y"])
+    end
+  end
+
+  describe FastCSV::Dialect do
+    let(:dialect) { FastCSV::Dialect.new(col_sep: ';', quote_char: "'", encoding: 'iso-8859-1:utf-8') }
+
+    it 'should parse with the dialect' do
+      rows = []
+      FastCSV.raw_parse("a;'b;\xF1'\n", dialect){|row| rows << row}
+      expect(rows).to eq([["a", "b;\u00F1"]])
+      expect(rows[0][1].encoding).to eq(Encoding::UTF_8)
+    end
+
+    it 'should be reusable across parsers and parses' do
+      parser = FastCSV::Parser.new(dialect)
+      expect(parser.parse("a;b\n")).to eq([["a", "b"]])
+      expect(parser.parse(StringIO.new("c;'d'\n"))).to eq([["c", "d"]])
+      expect(FastCSV.read_columns("a;b\nc;d\n", dialect)).to eq([["a", "c"], ["b", "d"]])
+    end
+
+    it 'should replace the options given to the parser' do
+      parser = FastCSV::Parser.new(col_sep: '|')
+      expect(parser.parse("a|b;c\n", FastCSV::Dialect.new)).to eq([["a|b;c"]])
+    end
+
+    it 'should raise an error if the options are invalid' do
+      expect{FastCSV::Dialect.new('')}.to raise_error(ArgumentError, 'options has to be a Hash or nil')
+      expect{FastCSV::Dialect.new(quote_char: '')}.to raise_error(ArgumentError, ':quote_char has to be a single character String or :auto')
+    end
+  end
+
+  describe '.read_columns' do
+    [
+      "",
+      "x",
+      "x,y\n1,2\n",
+      %(x,"y\nz"\n1,2),
+      "1,2\n1,2,3\n1",
+      "1,2,3\n\n1,2",
+      "0123456789," * 2_000,
+    ].each do |csv|
+      it "should return the columns for: #{csv.inspect.gsub('\"', '"')}" do
+        rows = CSV.parse(csv)
+        width = rows.map(&:size).max || 0
+        expect(FastCSV.read_columns(csv)).to eq((0...width).map{|i| rows.map{|row| row[i]}})
+      end
+    end
+
+    it 'should read columns from an IO' do
+      expect(FastCSV.read_columns(StringIO.new("x,y\n" * 5_000), col_sep: ',')).to eq([["x"] * 5_000, ["y"] * 5_000])
+    end
+  end
+
+  describe '.infer_schema' do
+    def types(csv, options = nil)
+      FastCSV.infer_schema(csv, options).map{|column| column[:type]}
+    end
+
+    it 'should infer types' do
+      csv = "1,1.5,true,2000-02-29,2000-01-01T00:00:00Z,x\n-2,2,FALSE,2001-12-31,2000-01-01 00:00:00.5+01:00,1\n"
+      expect(types(csv)).to eq([:integer, :float, :bool, :date, :timestamp, :string])
+    end
+
+    it 'should infer timestamps from dates and timestamps' do
+      expect(types("2000-01-01\n2000-01-01T00:00\n")).to eq([:timestamp])
+    end
+
+    it 'should not infer invalid dates' do
+      expect(types("2001-02-29\n")).to eq([:string])
+    end
+
+    it 'should infer strings from nulls' do
+      expect(types("x,\n")).to eq([:string, :string])
+    end
+
+    it 'should report names, null ratios and widths' do
+      expect(FastCSV.infer_schema("id,name\n1,foo\n2,\n3\n,\"\"\n", headers: true)).to eq([
+        {name: 'id', type: :integer, null_ratio: 0.25, max_width: 1},
+        {name: 'name', type: :string, null_ratio: 0.75, max_width: 3},
+      ])
+    end
+
+    it 'should encode names like fields and count widths in bytes' do
+      schema = FastCSV.infer_schema("caf\xE9\n\xE9\xE9\n".force_encoding('iso-8859-1'), headers: true, encoding: 'iso-8859-1:utf-8')
+      expect(schema).to eq([{name: "caf\u00E9", type: :string, null_ratio: 0.0, max_width: 2}])
+      expect(schema[0][:name].encoding).to eq(Encoding::UTF_8)
+    end
+
+    it 'should read the header row of an input without other rows' do
+      expect(FastCSV.infer_schema("id,name\n", headers: true)).to eq([
+        {name: 'id', type: :string, null_ratio: 0.0, max_width: 0},
+        {name: 'name', type: :string, null_ratio: 0.0, max_width: 0},
+      ])
+    end
+
+    it 'should read only the sample' do
+      expect(types(StringIO.new("1\n" * 10_000 + "x\n"), sample_rows: 10_000)).to eq([:integer])
+    end
+
+    it 'should validate the encoding' do
+      expect{types("x\n\xFF\n", validate_encoding: true)}.to raise_error(FastCSV::MalformedCSVError, 'Invalid byte sequence in line 2 (byte offset 2).')
+    end
+
+    it 'should raise an error if the sample size is invalid' do
+      expect{FastCSV.infer_schema('', sample_rows: 0)}.to raise_error(ArgumentError, ':sample_rows has to be a positive Integer')
+    end
+  end
+
+  describe '.count_rows' do
+    def count_rows(csv, basename = 'fastcsv', options = {})
+      Tempfile.open(basename) do |tempfile|
+        tempfile.binmode
+        tempfile.write(csv)
+        tempfile.close
+        FastCSV.count_rows(tempfile.path, options)
+      end
+    end
+
+    [
+      "",
+      "\n",
+      "x",
+      "x\n\ny",
+      "x\r\ny\r\n",
+      "x\ry\r",
+      %("x\ny"\n),
+      %("x""\n""y",z\n\n),
+      %("",""\n""),
+    ].each do |csv|
+      it "should count: #{csv.inspect.gsub('\"', '"')}" do
+        expect(count_rows(csv)).to eq(FastCSV.raw_parse(csv).to_a.size)
+      end
+    end
+
+    it 'should count rows across chunks' do
+      csv = (1..5_000).map{|i| %(#{'x' * (i % 300)},"y\r\n#{i}"\r\n)}.join
+      expect(count_rows(csv)).to eq(5_000)
+    end
+
+    it 'should count the rows of a compressed file' do
+      expect(count_rows(Zlib.gzip("x\ny\n"), ['fastcsv', '.csv.gz'])).to eq(2)
+    end
+
+    it 'should raise an error on an unclosed quoted field' do
+      expect{count_rows(%(x\n"y\nz))}.to raise_error(FastCSV::MalformedCSVError, 'Unclosed quoted field on line 2.')
+    end
+
+    [
+      ["#c\na\nb\n", {comment_char: '#'}],
+      ["h\na\nb\n", {skip_rows: 1}],
+      ["a\n\nb\n\n", {skip_blanks: true}],
+      ["#c\na\n#d\n", {skip_lines: '#'}],
+      [%(a\\"b\nc\n), {escape_char: '\\'}],
+      [%(a"b\nc\n), {liberal_parsing: true}],
+    ].each do |csv, options|
+      it "should count with #{options.inspect}" do
+        expect(count_rows(csv, 'fastcsv', options)).to eq(FastCSV.raw_parse(csv, options).to_a.size)
+      end
+    end
+
+    it 'should raise the parser\'s errors with an option that it implements' do
+      expect{count_rows(%(a"b\n), 'fastcsv', escape_char: '\\')}.to raise_error(FastCSV::MalformedCSVError, 'Illegal quoting in line 1.')
+    end
+  end
+
+  describe '.headers' do
+    it 'should return the first row' do
+      Tempfile.open('fastcsv') do |tempfile|
+        tempfile.write(%(id,"na\nme"\n) + "1,x\n" * 10_000 + %("))
+        tempfile.close
+        expect(FastCSV.headers(tempfile.path)).to eq(["id", "na\nme"])
+      end
+    end
+
+    it 'should return nil if the file is empty' do
+      Tempfile.open('fastcsv') do |tempfile|
+        tempfile.close
+        expect(FastCSV.headers(tempfile.path)).to eq(nil)
+      end
+    end
+  end
+
+  describe '.to_arrow' do
+    def to_arrow(csv, options)
+      output = StringIO.new(''.force_encoding('ascii-8bit'))
+      [FastCSV::Parser.new.to_arrow(csv, output, options), output.string]
+    end
+
+    let :schema do
+      {id: :int64, name: :utf8, score: :float64, ok: :bool}
+    end
+
+    it 'should write an Arrow IPC stream' do
+      rows, arrow = to_arrow(%(id,name,score,ok\n1,"x ""y""",1.5,true\n2,,,\n), schema: schema, headers: true)
+      expect(rows).to eq(2)
+      expect(arrow[0, 4]).to eq("\xFF\xFF\xFF\xFF".force_encoding('ascii-8bit'))
+      expect(arrow[-8, 8]).to eq("\xFF\xFF\xFF\xFF\x00\x00\x00\x00".force_encoding('ascii-8bit'))
+      expect(arrow).to include('x "y"')
+      expect(arrow).to include([1, 2].pack('q<q<'))
+      expect(arrow).to include([1.5].pack('E'))
+    end
+
+    it 'should write record batches' do
+      rows, arrow = to_arrow("1\n" * 10, schema: {id: :int64}, batch_size: 3)
+      expect(rows).to eq(10)
+      expect(arrow.scan([3].pack('q<') + [0].pack('q<')).size).to eq(3)
+    end
+
+    it 'should skip blank rows' do
+      expect(to_arrow("1\n\n2\n", schema: {id: :int64})[0]).to eq(2)
+    end
+
+    it 'should raise an error if a value is invalid' do
+      expect{to_arrow("1\nx\n", schema: {id: :int64})}.to raise_error(FastCSV::MalformedCSVError, 'Invalid int64 value "x" for column "id" in line 2.')
+    end
+
+    it 'should raise an error if a utf8 value is invalid' do
+      expect{to_arrow("x\n\xFFy\n".b, schema: {name: :utf8})}.to raise_error(FastCSV::MalformedCSVError, 'Invalid UTF-8 for column "name" in line 2.')
+    end
+
+    it 'should validate the encoding' do
+      expect{to_arrow("1,x\n2,\"\xFF\"\n", schema: {id: :int64, name: :utf8}, validate_encoding: true)}.to raise_error(FastCSV::MalformedCSVError, 'Invalid byte sequence in line 2 (byte offset 7).')
+      expect(to_arrow("1,\xFF\n", schema: {id: :int64, name: :utf8}, validate_encoding: :replace)[0]).to eq(1)
+    end
+
+    it 'should raise an error if a row has too many fields' do
+      expect{to_arrow("1,2\n", schema: {id: :int64})}.to raise_error(FastCSV::MalformedCSVError, 'Too many fields (the schema has 1 columns) in line 1.')
+    end
+
+    it 'should raise an error if the schema is invalid' do
+      expect{to_arrow('', schema: {id: :int32})}.to raise_error(ArgumentError, ':schema types have to be :int64, :float64, :utf8 or :bool')
+    end
+
+    it 'should write a file only if the input is parsed' do
+      Dir.mktmpdir do |dir|
+        input = File.join(dir, 'input.csv')
+        output = File.join(dir, 'output.arrow')
+        File.write(input, "1\n2\n")
+        expect(FastCSV.to_arrow(input, output, schema: {id: :int64})).to eq(2)
+        expect(File.binread(output)).to eq(to_arrow("1\n2\n", schema: {id: :int64})[1])
+        File.write(input, "1\nx\n")
+        expect{FastCSV.to_arrow(input, output, schema: {id: :int64})}.to raise_error(FastCSV::MalformedCSVError)
+        expect(Dir.children(dir).sort).to eq(['input.csv', 'output.arrow'])
+        File.unlink(output)
+        expect{FastCSV.to_arrow(input, output, schema: {id: :int64})}.to raise_error(FastCSV::MalformedCSVError)
+        expect(Dir.children(dir)).to eq(['input.csv'])
+      end
+    end
+  end
+
+  describe 'the C API' do
+    # A native extension that records the fields and row ends that it receives.
+    # It stops at a field of "stop" and fails at a field of "fail".
+    consumer = <<~'C'
+      #include <string.h>
+      #include <fastcsv.h>
+
+      static int on_field(void *data, const char *ptr, size_t len, int column, bool quoted) {
+        if (ptr != NULL && len == 4 && memcmp(ptr, "stop", 4) == 0) {
+          return 1;
+        }
+        if (ptr != NULL && len == 4 && memcmp(ptr, "fail", 4) == 0) {
+          return -1;
+        }
+        rb_ary_push((VALUE)data, rb_ary_new_from_args(3, ptr == NULL ? Qnil : rb_str_new(ptr, len), INT2NUM(column), quoted ? Qtrue : Qfalse));
+        return 0;
+      }
+
+      static int on_row_end(void *data) {
+        rb_ary_push((VALUE)data, ID2SYM(rb_intern("row_end")));
+        return 0;
+      }
+
+      static VALUE parse(VALUE self, VALUE port, VALUE opts, VALUE error) {
+        VALUE events = rb_ary_new();
+        FastCSVSink sink;
+        long rows;
+
+        sink.data = (void *)events;
+        sink.on_field = on_field;
+        sink.on_row_end = on_row_end;
+        sink.error = NIL_P(error) ? NULL : StringValueCStr(error);
+        rows = fastcsv_parse(port, opts, &sink);
+
+        return rb_ary_new_from_args(2, LONG2NUM(rows), events);
+      }
+
+      void Init_fastcsv_consumer(void) {
+        rb_define_module_function(rb_define_module("FastCSVConsumer"), "parse", parse, 3);
+      }
+    C
+
+    before(:all) do
+      @dir = Dir.mktmpdir
+      File.write(File.join(@dir, 'fastcsv_consumer.c'), consumer)
+      File.write(File.join(@dir, 'extconf.rb'), "require 'mkmf'\nfind_header('fastcsv.h', #{FastCSV.include_dir.inspect}) or abort\ncreate_makefile('fastcsv_consumer')\n")
+      Dir.chdir(@dir) do
+        system(RbConfig.ruby, 'extconf.rb', out: File::NULL) && system(ENV['MAKE'] || 'make', out: File::NULL) or raise 'the consumer failed to build'
+      end
+      require File.join(@dir, 'fastcsv_consumer')
+    end
+
+    after(:all) do
+      FileUtils.rm_rf(@dir)
+    end
+
+    it 'should pass the fields and row ends to the sink' do
+      expect(FastCSVConsumer.parse(%(a,"b"\n,""\n), nil, nil)).to eq([2, [["a", 0, false], ["b", 1, true], :row_end, [nil, 0, false], ["", 1, true], :row_end]])
+    end
+
+    it 'should parse with options' do
+      expect(FastCSVConsumer.parse(StringIO.new("a;b\n"), {col_sep: ';'}, nil)).to eq([1, [["a", 0, false], ["b", 1, false], :row_end]])
+    end
+
+    it 'should stop if the sink returns 1' do
+      expect(FastCSVConsumer.parse("a\nstop\nb\n", nil, nil)).to eq([1, [["a", 0, false], :row_end]])
+    end
+
+    it 'should raise the sink\'s error if it returns -1' do
+      expect{FastCSVConsumer.parse("a\nfail\n", nil, 'Bad field')}.to raise_error(FastCSV::MalformedCSVError, 'Bad field in line 2.')
+      expect{FastCSVConsumer.parse("a\nfail\n", nil, nil)}.to raise_error(FastCSV::MalformedCSVError, 'Invalid field in line 2.')
+    end
+  end
+
+  context 'when decompressing' do
+    let :csv do
+      "foo,\"bar\nbaz\"\n" * 2_000
+    end
+
+    it 'should decompress gzip data' do
+      expect(parse(StringIO.new(Zlib.gzip(csv)), compression: :gzip)).to eq(CSV.parse(csv))
+    end
+
+    it 'should decompress gzip data across buffers' do
+      expect(parse(StringIO.new(Zlib.gzip(csv)), compression: :gzip, buffer_size: 7)).to eq(CSV.parse(csv))
+    end
+
+    it 'should decompress concatenated gzip members' do
+      expect(parse(Zlib.gzip("x,y\n") + Zlib.gzip("z\n"), compression: :gzip)).to eq([["x", "y"], ["z"]])
+    end
+
+    it 'should ignore bytes after the last gzip member' do
+      expect(parse(Zlib.gzip("x,y\n") + Zlib.gzip("z\n") + "\0\0garbage", compression: :gzip)).to eq([["x", "y"], ["z"]])
+      expect(parse(StringIO.new(Zlib.gzip("x,y\n") + "\x1F"), compression: :gzip, buffer_size: 7)).to eq([["x", "y"]])
+    end
+
+    it 'should detect gzip data' do
+      expect(parse(StringIO.new(Zlib.gzip(csv)), compression: :auto)).to eq(CSV.parse(csv))
+    end
+
+    it 'should not decompress plain data if detecting' do
+      expect(parse(StringIO.new(csv), compression: :auto)).to eq(CSV.parse(csv))
+    end
+
+    it 'should decompress a gzip file' do
+      File.open(File.expand_path(File.join('..', '..', 'test', 'csv', 'line_endings.gz'), __FILE__), 'rb') do |f|
+        expect(parse(f, compression: :auto).size).to eq(2)
+      end
+    end
+
+    it 'should raise an error if the gzip data is truncated' do
+      expect{parse(Zlib.gzip(csv)[0, 100], compression: :gzip)}.to raise_error(FastCSV::MalformedCSVError, 'Invalid gzip data (unexpected end of input).')
+    end
+
+    it 'should raise an error if the data is not gzip data' do
+      expect{parse(csv, compression: :gzip)}.to raise_error(FastCSV::MalformedCSVError, 'Invalid gzip data (incorrect header check).')
+    end
+
+    it 'should raise an error if the option is invalid' do
+      expect{parse('', compression: :bzip2)}.to raise_error(ArgumentError, ':compression has to be :gzip, :zstd, :auto or nil')
+    end
+  end
+
   context 'when initializing' do
     it 'should raise an error if the input is not a String or IO' do
       expect{FastCSV.raw_parse(nil)}.to raise_error(ArgumentError, 'data has to respond to #read or #to_str')